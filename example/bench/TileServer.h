@@ -0,0 +1,620 @@
+// Loopback HTTP server standing in for the tile host in benchmarks
+//-----------------------------------------------------------------------------
+
+#ifndef TILE_SERVER_H
+#define TILE_SERVER_H
+
+#include <string>
+#include <list>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "Atomic.h"
+#include "TimeUs.h"
+
+// How the server behaves, usually read from a script with one setting per
+// line or separated by ';', e.g.
+//
+//   seed 7; latency 40 10; bandwidth 262144; error 0.02 503; timeout 0.01
+//
+//   seed <n>                    seeds every random decision
+//   latency <ms> [jitter ms]    before the response headers
+//   bandwidth <bytes/s>         per connection, 0 for unlimited
+//   link <bytes/s>              shared by all connections, 0 for unlimited
+//   keepalive on|off            off closes after every response
+//   max-requests <n>            per connection, 0 for unlimited
+//   chunked on|off [bytes]      chunked transfer encoding, chunk size
+//   body <bytes> [variation]    size of the synthetic tiles
+//   redirect <share> [status]   redirects to /r/<path>, 301 by default
+//   error <share> [status]      answers with a 5xx, 503 by default
+//   timeout <share>             reads the request and never answers
+//   cut <share>                 closes the connection halfway through the body
+//   range on|off                Range and If-Range, 206 and 416 answers
+//   etag on|off                 ETag and If-None-Match, 304 answers
+//   max-age <s>                 Cache-Control max-age, 0 leaves it out
+//
+// Faults are not drawn from a shared random sequence, which would depend
+// on the order the connection threads run in. Whether a request fails is
+// a hash of the seed, its path and how often that path was asked for
+// before, so the same requests get the same answers on every run.
+struct TileServerConfig {
+	unsigned long seed;
+	int latency_ms;
+	int jitter_ms;
+	long bandwidth;
+	long link;
+	bool keepalive;
+	int max_requests;
+	bool chunked;
+	int chunk_bytes;
+	int body_bytes;
+	int body_variation;
+	double redirect_share;
+	int redirect_status;
+	double error_share;
+	int error_status;
+	double timeout_share;
+	double cut_share;
+	bool range;
+	bool etag;
+	int max_age;
+
+	TileServerConfig()
+		: seed(1),latency_ms(0),jitter_ms(0),bandwidth(0),link(0),keepalive(true),max_requests(0),
+		chunked(false),chunk_bytes(4096),body_bytes(16 * 1024),body_variation(0),
+		redirect_share(0),redirect_status(301),error_share(0),error_status(503),
+		timeout_share(0),cut_share(0),range(true),etag(true),max_age(0)
+	{
+	}
+	// Applies a script on top of the current settings, false and a message
+	// on the first line it does not understand
+	bool parse(const std::string &script,std::string *error) {
+		size_t p = 0;
+		while( p <= script.size() ) {
+			size_t e = script.find_first_of(";\n",p);
+			if( e == std::string::npos )
+				e = script.size();
+			std::string line = script.substr(p,e - p);
+			p = e + 1;
+			char key[32], a[32], b[32];
+			int n = sscanf(line.c_str()," %31s %31s %31s",key,a,b);
+			if( n <= 0 || key[0] == '#' )
+				continue;
+			bool ok = true;
+			if( n < 2 )
+				ok = false;
+			else if( !strcmp(key,"seed") )
+				seed = strtoul(a,0,10);
+			else if( !strcmp(key,"latency") ) {
+				latency_ms = atoi(a);
+				jitter_ms = n > 2 ? atoi(b) : 0;
+			} else if( !strcmp(key,"bandwidth") )
+				bandwidth = atol(a);
+			else if( !strcmp(key,"link") )
+				link = atol(a);
+			else if( !strcmp(key,"keepalive") )
+				keepalive = !strcmp(a,"on");
+			else if( !strcmp(key,"max-requests") )
+				max_requests = atoi(a);
+			else if( !strcmp(key,"chunked") ) {
+				chunked = !strcmp(a,"on");
+				if( n > 2 )
+					chunk_bytes = atoi(b) > 0 ? atoi(b) : chunk_bytes;
+			} else if( !strcmp(key,"body") ) {
+				body_bytes = atoi(a);
+				body_variation = n > 2 ? atoi(b) : 0;
+			} else if( !strcmp(key,"redirect") ) {
+				redirect_share = atof(a);
+				if( n > 2 )
+					redirect_status = atoi(b);
+			} else if( !strcmp(key,"error") ) {
+				error_share = atof(a);
+				if( n > 2 )
+					error_status = atoi(b);
+			} else if( !strcmp(key,"timeout") )
+				timeout_share = atof(a);
+			else if( !strcmp(key,"cut") )
+				cut_share = atof(a);
+			else if( !strcmp(key,"range") )
+				range = !strcmp(a,"on");
+			else if( !strcmp(key,"etag") )
+				etag = !strcmp(a,"on");
+			else if( !strcmp(key,"max-age") )
+				max_age = atoi(a);
+			else
+				ok = false;
+			if( !ok ) {
+				if( error )
+					*error = "can't parse '" + line + "'";
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Serves synthetic tiles for any path ending in /<z>/<x>/<y>.png on a
+// loopback port, with a thread per connection. Bodies and ETags are a
+// function of the tile, so revalidation works across runs.
+class TileServer {
+public:
+	struct Stats {
+		volatile long connections;
+		volatile long requests;
+		volatile long not_modified;
+		volatile long redirects;
+		volatile long errors;
+		volatile long timeouts;
+		volatile long cuts;
+		volatile long ranges;     // 206 answers
+		volatile long bytes;
+	};
+private:
+	TileServerConfig config;
+	int listen_fd;
+	int port;
+	volatile long quit;
+	pthread_t acceptor;
+	bool running;
+	pthread_mutex_t lock;                 // guards seen, threads, finished and link_free_at
+	std::map<std::string,unsigned long> seen; // requests per path so far
+	std::list<pthread_t> threads;         // connection threads not joined yet
+	std::list<pthread_t> finished;        // of those, the ones which are done serving
+	int64_t link_free_at;                 // when the shared link has sent what it was given
+	Stats stats;
+
+	struct Connection {
+		TileServer *server;
+		int fd;
+	};
+	enum Fault {
+		kServe,
+		kRedirect,
+		kError,
+		kTimeout,
+		kCut,
+	};
+
+	// Forbid copying
+	TileServer(const TileServer &);
+	TileServer &operator=(const TileServer &);
+public:
+	TileServer(const TileServerConfig &a_config)
+		: config(a_config),listen_fd(-1),port(0),quit(0),running(false),link_free_at(0)
+	{
+		pthread_mutex_init(&lock,0);
+		Stats s = { 0,0,0,0,0,0,0,0,0 };
+		stats = s;
+	}
+	virtual ~TileServer()
+	{
+		stop();
+		pthread_mutex_destroy(&lock);
+	}
+	// Listens on 127.0.0.1:a_port, a free port when 0; see get_port()
+	bool start(int a_port = 0) {
+		listen_fd = socket(AF_INET,SOCK_STREAM,0);
+		if( listen_fd < 0 )
+			return false;
+		int on = 1;
+		setsockopt(listen_fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+		struct sockaddr_in a;
+		memset(&a,0,sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a.sin_port = htons((unsigned short)a_port);
+		socklen_t len = sizeof(a);
+		if( bind(listen_fd,(struct sockaddr *)&a,sizeof(a)) != 0 || listen(listen_fd,128) != 0 ||
+			getsockname(listen_fd,(struct sockaddr *)&a,&len) != 0 ) {
+			close(listen_fd);
+			listen_fd = -1;
+			return false;
+		}
+		port = ntohs(a.sin_port);
+		AtomicSet(&quit,0);
+		if( pthread_create(&acceptor,0,TileServer::Accept,this) != 0 ) {
+			close(listen_fd);
+			listen_fd = -1;
+			return false;
+		}
+		running = true;
+		return true;
+	}
+	void stop() {
+		if( !running )
+			return;
+		AtomicSet(&quit,1);
+		pthread_join(acceptor,0);
+		for( ;; ) {
+			pthread_mutex_lock(&lock);
+			if( threads.empty() ) {
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+			pthread_t t = threads.front();
+			threads.pop_front();
+			pthread_mutex_unlock(&lock);
+			pthread_join(t,0);
+		}
+		finished.clear();
+		close(listen_fd);
+		listen_fd = -1;
+		running = false;
+	}
+	int get_port() const { return port; }
+	const TileServerConfig &get_config() const { return config; }
+	const Stats &get_stats() const { return stats; }
+protected:
+	// Runs first on every thread of the server, e.g. to leave its
+	// allocations out of what a benchmark measures
+	virtual void thread_started() {}
+private:
+	static uint32_t hash(const std::string &s,uint32_t h = 2166136261u) {
+		for( size_t i = 0; i < s.size(); i++ ) {
+			h ^= (unsigned char)s[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+	static uint32_t mix(uint32_t h) {
+		h ^= h >> 16;
+		h *= 0x45d9f3b;
+		h ^= h >> 16;
+		return h;
+	}
+	// Waits up to ms for fd to become readable, giving up early on stop()
+	bool readable(int fd,int ms) {
+		while( !AtomicGet(&quit) ) {
+			int slice = ms < 100 ? ms : 100;
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(fd,&fds);
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = slice * 1000;
+			int r = select(fd + 1,&fds,0,0,&tv);
+			if( r > 0 )
+				return true;
+			if( r < 0 && errno != EINTR )
+				return false;
+			ms -= slice;
+			if( ms <= 0 )
+				return false;
+		}
+		return false;
+	}
+	void pause_ms(int ms) {
+		while( ms > 0 && !AtomicGet(&quit) ) {
+			int slice = ms < 100 ? ms : 100;
+			usleep(slice * 1000);
+			ms -= slice;
+		}
+	}
+	static void *Accept(void *arg) {
+		((TileServer *)arg)->thread_started();
+		((TileServer *)arg)->accept_loop();
+		return 0;
+	}
+	void accept_loop() {
+		while( !AtomicGet(&quit) ) {
+			reap();
+			if( !readable(listen_fd,100) )
+				continue;
+			int fd = accept(listen_fd,0,0);
+			if( fd < 0 )
+				continue;
+			int on = 1;
+			setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+			if( config.link ) {
+				// a queue at the link, not in the socket buffers
+				int buffer = kLinkSlice * 4;
+				setsockopt(fd,SOL_SOCKET,SO_SNDBUF,&buffer,sizeof(buffer));
+			}
+			AtomicAdd(&stats.connections,1);
+			Connection *c = new Connection();
+			c->server = this;
+			c->fd = fd;
+			pthread_t t;
+			pthread_mutex_lock(&lock);
+			if( pthread_create(&t,0,TileServer::Serve,c) == 0 ) {
+				threads.push_back(t);
+			} else {
+				close(fd);
+				delete c;
+			}
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	// Joins the connection threads which are done, so a long run does not
+	// pile up their stacks
+	void reap() {
+		pthread_mutex_lock(&lock);
+		std::list<pthread_t> done;
+		done.swap(finished);
+		std::list<pthread_t>::iterator e = done.end();
+		std::list<pthread_t>::iterator i = done.begin();
+		for( ; i != e; i++ ) {
+			std::list<pthread_t>::iterator te = threads.end();
+			std::list<pthread_t>::iterator t = threads.begin();
+			for( ; t != te; t++ ) {
+				if( pthread_equal(*t,*i) ) {
+					threads.erase(t);
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		e = done.end();
+		i = done.begin();
+		for( ; i != e; i++ )
+			pthread_join(*i,0);
+	}
+	static void *Serve(void *arg) {
+		Connection *c = (Connection *)arg;
+		TileServer *server = c->server;
+		server->thread_started();
+		server->serve(c->fd);
+		close(c->fd);
+		delete c;
+		pthread_mutex_lock(&server->lock);
+		server->finished.push_back(pthread_self());
+		pthread_mutex_unlock(&server->lock);
+		return 0;
+	}
+	void serve(int fd) {
+		std::string in;
+		int served = 0;
+		for( ;; ) {
+			size_t end;
+			while( (end = in.find("\r\n\r\n")) == std::string::npos ) {
+				if( !readable(fd,30000) )
+					return;
+				char buf[4096];
+				ssize_t n = recv(fd,buf,sizeof(buf),0);
+				if( n <= 0 )
+					return;
+				in.append(buf,n);
+			}
+			std::string head = in.substr(0,end + 4);
+			in.erase(0,end + 4);
+			served++;
+			bool close_after = !config.keepalive ||
+				(config.max_requests && served >= config.max_requests) ||
+				header(head,"Connection") == "close";
+			if( !respond(fd,head,close_after) || close_after )
+				return;
+		}
+	}
+	static std::string header(const std::string &head,const char *name) {
+		size_t p = 0;
+		size_t len = strlen(name);
+		while( (p = head.find("\r\n",p)) != std::string::npos ) {
+			p += 2;
+			if( head.size() > p + len && !strncasecmp(head.c_str() + p,name,len) && head[p + len] == ':' ) {
+				size_t b = head.find_first_not_of(" \t",p + len + 1);
+				size_t e = head.find("\r\n",p);
+				return b == std::string::npos || b > e ? "" : head.substr(b,e - b);
+			}
+		}
+		return "";
+	}
+	Fault fault_for(const std::string &path,uint32_t *roll) {
+		pthread_mutex_lock(&lock);
+		unsigned long nth = seen[path]++;
+		pthread_mutex_unlock(&lock);
+		char salt[48];
+		snprintf(salt,sizeof(salt),"%lu/%lu/",config.seed,nth);
+		*roll = mix(hash(path,hash(salt)));
+		double r = (*roll >> 8) / (double)(1 << 24);
+		if( path.compare(0,3,"/r/") != 0 ) {
+			if( r < config.redirect_share )
+				return kRedirect;
+			r -= config.redirect_share;
+		}
+		if( r < config.error_share )
+			return kError;
+		r -= config.error_share;
+		if( r < config.timeout_share )
+			return kTimeout;
+		r -= config.timeout_share;
+		if( r < config.cut_share )
+			return kCut;
+		return kServe;
+	}
+	bool respond(int fd,const std::string &head,bool close_after) {
+		AtomicAdd(&stats.requests,1);
+		char path_buf[1024] = "";
+		sscanf(head.c_str(),"%*s %1023s",path_buf);
+		std::string path = path_buf;
+		uint32_t roll = 0;
+		Fault fault = fault_for(path,&roll);
+		if( config.latency_ms || config.jitter_ms )
+			pause_ms(config.latency_ms + (config.jitter_ms ? (int)(roll % (config.jitter_ms + 1)) : 0));
+		const char *connection = close_after ? "close" : "keep-alive";
+		char hdr[1024];
+		switch( fault ) {
+		case kTimeout:
+			AtomicAdd(&stats.timeouts,1);
+			readable(fd,60 * 60 * 1000);
+			return false;
+		case kError:
+			AtomicAdd(&stats.errors,1);
+			snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d Injected\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+				config.error_status,connection);
+			return send_all(fd,hdr,strlen(hdr));
+		case kRedirect:
+			AtomicAdd(&stats.redirects,1);
+			snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d Moved\r\nLocation: /r%s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+				config.redirect_status,path.c_str(),connection);
+			return send_all(fd,hdr,strlen(hdr));
+		case kServe:
+		case kCut:
+			break;
+		}
+		int z, x, y;
+		size_t slash = path.size();
+		for( int i = 0; i < 3 && slash != std::string::npos && slash > 0; i++ )
+			slash = path.rfind('/',slash - 1);
+		if( slash == std::string::npos || sscanf(path.c_str() + slash,"/%d/%d/%d.png",&z,&x,&y) != 3 ) {
+			snprintf(hdr,sizeof(hdr),"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",connection);
+			return send_all(fd,hdr,strlen(hdr));
+		}
+		char tile[64];
+		snprintf(tile,sizeof(tile),"%d/%d/%d",z,x,y);
+		uint32_t th = mix(hash(tile));
+		char etag[16];
+		snprintf(etag,sizeof(etag),"\"%08x\"",th);
+		std::string extra;
+		if( config.etag ) {
+			extra += std::string("ETag: ") + etag + "\r\n";
+			if( header(head,"If-None-Match") == etag ) {
+				AtomicAdd(&stats.not_modified,1);
+				snprintf(hdr,sizeof(hdr),"HTTP/1.1 304 Not Modified\r\n%sConnection: %s\r\n\r\n",extra.c_str(),connection);
+				return send_all(fd,hdr,strlen(hdr));
+			}
+		}
+		if( config.max_age > 0 ) {
+			char cc[64];
+			snprintf(cc,sizeof(cc),"Cache-Control: max-age=%d\r\n",config.max_age);
+			extra += cc;
+		}
+		int size = config.body_bytes + (config.body_variation ? (int)(th % (2 * config.body_variation + 1)) - config.body_variation : 0);
+		if( size < 8 )
+			size = 8;
+		std::string body(size,'\0');
+		static const unsigned char kPng[8] = { 0x89,'P','N','G','\r','\n',0x1a,'\n' };
+		memcpy(&body[0],kPng,8);
+		uint32_t r = th;
+		for( int i = 8; i < size; i++ ) {
+			r = r * 1103515245u + 12345u;
+			body[i] = (char)(r >> 24);
+		}
+		// a single bytes=<first>-[<last>], and with If-Range only while the
+		// tile is the same; anything else gets the whole body
+		size_t from = 0;
+		size_t end = body.size();
+		const char *status = "200 OK";
+		std::string range = header(head,"Range");
+		std::string if_range = header(head,"If-Range");
+		long first, last = -1;
+		int n = sscanf(range.c_str(),"bytes=%ld-%ld",&first,&last);
+		if( config.range && n >= 1 && first >= 0 && (n == 1 || last >= first) &&
+			range.find(',') == std::string::npos && (n == 2 || range[range.size() - 1] == '-') &&
+			(if_range.empty() || (config.etag && if_range == etag)) ) {
+			char cr[96];
+			if( first >= size ) {
+				snprintf(hdr,sizeof(hdr),"HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%d\r\n"
+					"Content-Length: 0\r\nConnection: %s\r\n\r\n",size,connection);
+				return send_all(fd,hdr,strlen(hdr));
+			}
+			AtomicAdd(&stats.ranges,1);
+			from = (size_t)first;
+			if( n == 2 && last < size - 1 )
+				end = (size_t)last + 1;
+			status = "206 Partial Content";
+			snprintf(cr,sizeof(cr),"Content-Range: bytes %ld-%d/%d\r\n",first,(int)end - 1,size);
+			extra += cr;
+		}
+		if( config.chunked )
+			extra += "Transfer-Encoding: chunked\r\n";
+		else {
+			char cl[64];
+			snprintf(cl,sizeof(cl),"Content-Length: %d\r\n",(int)(end - from));
+			extra += cl;
+		}
+		snprintf(hdr,sizeof(hdr),"HTTP/1.1 %s\r\nContent-Type: image/png\r\n%sConnection: %s\r\n\r\n",
+			status,extra.c_str(),connection);
+		if( !send_all(fd,hdr,strlen(hdr)) )
+			return false;
+		// a cut sends half of what was asked for and hangs up
+		if( fault == kCut ) {
+			AtomicAdd(&stats.cuts,1);
+			end = from + (end - from) / 2;
+		}
+		if( !config.chunked )
+			return send_body(fd,body.data() + from,end - from) && fault != kCut;
+		for( size_t p = from; p < end; p += config.chunk_bytes ) {
+			size_t n = end - p < (size_t)config.chunk_bytes ? end - p : (size_t)config.chunk_bytes;
+			char ch[32];
+			snprintf(ch,sizeof(ch),"%lx\r\n",(unsigned long)n);
+			if( !send_all(fd,ch,strlen(ch)) || !send_body(fd,body.data() + p,n) || !send_all(fd,"\r\n",2) )
+				return false;
+		}
+		return fault != kCut && send_all(fd,"0\r\n\r\n",5);
+	}
+	// Sends at most the configured bandwidth, in slices of 1/20 s, and takes
+	// turns with the other connections on the link
+	bool send_body(int fd,const char *p,size_t size) {
+		if( config.link )
+			return send_linked(fd,p,size);
+		if( !config.bandwidth )
+			return send_all(fd,p,size);
+		size_t slice = config.bandwidth / 20 > 0 ? config.bandwidth / 20 : 1;
+		while( size ) {
+			size_t n = size < slice ? size : slice;
+			if( !send_all(fd,p,n) )
+				return false;
+			p += n;
+			size -= n;
+			if( size )
+				pause_ms(50);
+		}
+		return true;
+	}
+	// The link sends kLinkSlice bytes at a time for whichever connection
+	// asked first, so a connection whose client reads slowly blocks in
+	// send() and leaves its turns to the others
+	static const size_t kLinkSlice = 4096;
+	bool send_linked(int fd,const char *p,size_t size) {
+		int64_t last = TimeUs();
+		while( size ) {
+			size_t n = size < kLinkSlice ? size : kLinkSlice;
+			int64_t slice_us = (int64_t)n * 1000000 / config.link;
+			if( config.bandwidth ) {
+				// the connection's own limit, since its last slice
+				int64_t own_us = (int64_t)n * 1000000 / config.bandwidth - (TimeUs() - last);
+				if( own_us > 0 )
+					usleep((useconds_t)own_us);
+			}
+			pthread_mutex_lock(&lock);
+			int64_t now = TimeUs();
+			int64_t at = link_free_at > now ? link_free_at : now;
+			link_free_at = at + slice_us;
+			pthread_mutex_unlock(&lock);
+			if( at > now )
+				usleep((useconds_t)(at - now));
+			if( AtomicGet(&quit) || !send_all(fd,p,n) )
+				return false;
+			last = TimeUs();
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	bool send_all(int fd,const char *p,size_t size) {
+		while( size ) {
+			ssize_t n = send(fd,p,size,MSG_NOSIGNAL);
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				return false;
+			AtomicAdd(&stats.bytes,(long)n);
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+};
+
+#endif /* !TILE_SERVER_H */
@@ -0,0 +1,714 @@
+// Headless benchmark of the request manager
+//-----------------------------------------------------------------------------
+//
+// Drives RequestManager against a local HTTP server without the Marmalade
+// runtime and prints the results of every scenario as one JSON document,
+// so runs can be compared by a script. Built on a Linux desktop against
+// the system libcurl:
+//
+//   g++ -O2 -I example/h example/bench/request-bench.cpp -o request-bench -lcurl -lpthread
+//
+//   ./request-bench [-u url-template | -s script] [-n requests] [-c 1,4,8,16] [-t 0,1,2]
+//                   [-a system,slab] [-r attempts] [-H percentile] [-g share]
+//                   [-b bytes/s] [-m bytes] [-d dir] [-p] [-L] [-o out.json]
+//
+// Without -u the requests go to a TileServer started on a loopback port
+// inside the process, set up by the script given with -s, either a file
+// or the settings themselves (see TileServer.h), e.g.
+//
+//   ./request-bench -s "seed 3; latency 30 10; bandwidth 524288; error 0.01"
+//
+// so a scenario is reproduced exactly by running the same script again.
+// The URL template takes the z,x,y of a tile the way HTTP_TILES does.
+// Every request of a run asks for a tile of its own, so nothing is
+// coalesced, and the response cache is off, so every request goes to the
+// server. Each run reports requests per second, p50/p99 of the transfer
+// time, connects per request, the peak RSS of the process so far and the
+// heap allocations per request, counting both operator new and libcurl's
+// own allocations. The cancel runs abort half of the transfers while they
+// are running and report how long their slots took to free.
+//
+// -r sets the transfers a request may take, retries included (1 turns
+// retrying off), and -H hedges transfers slower than that percentile of
+// the host, e.g. -H 0.95. The runs then also report the retries and
+// hedges made and p50/p99 of the whole request, from get() until it is
+// done, backoff and all; with a script like "error 0.05; timeout 0.01"
+// that is where they show.
+//
+// -g makes that share of the requests background traffic and the rest
+// urgent, and -b gives the bandwidth scheduler the capacity of the link
+// instead of letting it measure. The runs then report p50/p99 of the
+// urgent requests on their own, and how often the scheduler rebalanced
+// and paused a transfer. The server's link setting makes all transfers
+// share one bottleneck, e.g. "link 2097152; body 262144".
+//
+// -m sets the high-water mark of the memory governor, and -d the directory
+// finished bodies are spilled to past it. Every run reports the peak of
+// the bytes held in bodies, and how many transfers were paused for memory
+// and bodies spilled.
+//
+// -p streams every body through a Crc32Stage instead of keeping it, and
+// the runs report the bytes the stages saw.
+//
+// Every run reports how many retries continued a partial body with a
+// Range request, the bytes that saved, and how often the server sent the
+// whole body instead. The server's cut setting breaks bodies off halfway
+// and range off makes it ignore Range, e.g. "body 262144; cut 0.1".
+//
+// -L adds a large object scenario per thread count: one object, as large
+// as the server's body setting, is fetched once with a single request and
+// once as a SegmentedDownload into a file, which is compared with the
+// single body. Per connection bandwidth and latency stand in for a
+// high-latency link, e.g. "body 33554432; latency 100; bandwidth 1048576".
+//
+// Every scenario runs once per allocator given with -a: libcurl's
+// allocations go either to the system heap or to SlabAllocator. The slab
+// runs add the per size class counts, and a replay of a libcurl-like mix
+// of allocation sizes times both allocators on their own. The peak RSS is
+// that of the whole process, so it is only comparable between allocators
+// when they run in separate processes.
+//-----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "RequestManager.h"
+#include "LatencyHistogram.h"
+#include "TileServer.h"
+#include "SlabAllocator.h"
+#include "SegmentedDownload.h"
+
+//-----------------------------------------------------------------------------
+// Allocation counting
+
+static volatile long allocations = 0;
+static __thread bool uncounted = false; // threads of the built-in server
+static bool slab = false;               // libcurl allocates from SlabAllocator
+
+static void *CountedMalloc(size_t size)
+{
+	if( !uncounted )
+		AtomicAdd(&allocations,1);
+	return slab ? SlabAllocator::Malloc(size) : malloc(size);
+}
+static void CountedFree(void *ptr)
+{
+	if( slab )
+		SlabAllocator::Free(ptr);
+	else
+		free(ptr);
+}
+static void *CountedRealloc(void *ptr,size_t size)
+{
+	if( !uncounted )
+		AtomicAdd(&allocations,1);
+	return slab ? SlabAllocator::Realloc(ptr,size) : realloc(ptr,size);
+}
+static char *CountedStrdup(const char *str)
+{
+	if( !uncounted )
+		AtomicAdd(&allocations,1);
+	return slab ? SlabAllocator::Strdup(str) : strdup(str);
+}
+static void *CountedCalloc(size_t nmemb,size_t size)
+{
+	if( !uncounted )
+		AtomicAdd(&allocations,1);
+	return slab ? SlabAllocator::Calloc(nmemb,size) : calloc(nmemb,size);
+}
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC
+{
+	if( !uncounted )
+		AtomicAdd(&allocations,1);
+	void *p = malloc(size ? size : 1);
+	if( !p )
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size) THROW_BAD_ALLOC
+{
+	return operator new(size);
+}
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+void operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+class BenchServer : public TileServer {
+public:
+	BenchServer(const TileServerConfig &config)
+		: TileServer(config)
+	{
+	}
+protected:
+	void thread_started() {
+		uncounted = true;
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+struct Options {
+	std::string url;
+	std::string script;
+	size_t requests;
+	std::vector<size_t> concurrency;
+	std::vector<size_t> threads;
+	std::vector<std::string> allocators;
+	int attempts;
+	double hedging;
+	double background;
+	long bandwidth;
+	size_t memory;
+	std::string spill_dir;
+	bool stream;
+	bool large;
+	const char *out;
+};
+
+struct Result {
+	const char *scenario;
+	const char *allocator;
+	size_t threads;
+	size_t concurrency;
+	size_t requests;
+	size_t errors;
+	double seconds;
+	LatencyHistogram latency;
+	LatencyHistogram wall;    // from get() to done
+	LatencyHistogram urgent;  // wall of the urgent requests only
+	double connects_per_request;
+	long peak_rss_kb;
+	double allocs_per_request;
+	size_t cancels;
+	int64_t cancel_us_mean;
+	int64_t cancel_us_max;
+	size_t retries;
+	size_t hedges;
+	size_t hedges_won;
+	size_t rebalances;
+	size_t pauses;
+	size_t peak_body_bytes;
+	size_t holds;
+	size_t spills;
+	size_t streamed_bytes;
+	size_t resumes;
+	size_t resumed_bytes;
+	size_t refusals;
+};
+
+static long PeakRssKb()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF,&ru);
+	return ru.ru_maxrss;
+}
+
+static std::string TileUrl(const Options &o,size_t i)
+{
+	char buf[1024];
+	snprintf(buf,sizeof(buf),o.url.c_str(),14,(int)(10000 + i % 1000),(int)(5000 + i / 1000));
+	return buf;
+}
+
+// Waits a little for the transfers instead of spinning on step()
+static void Idle(const RequestManager &m)
+{
+	CURLM *curlm = m.get_curlm();
+	if( !curlm ) {
+		usleep(200);
+		return;
+	}
+	fd_set fdread, fdwrite, fdexcep;
+	int maxfd = -1;
+	FD_ZERO(&fdread);
+	FD_ZERO(&fdwrite);
+	FD_ZERO(&fdexcep);
+	curl_multi_fdset(curlm,&fdread,&fdwrite,&fdexcep,&maxfd);
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000;
+	select(maxfd + 1,&fdread,&fdwrite,&fdexcep,&tv);
+}
+
+// A script argument naming a readable file stands for its contents
+static std::string ReadScript(const char *arg)
+{
+	FILE *f = fopen(arg,"r");
+	if( !f )
+		return arg;
+	std::string s;
+	char buf[1024];
+	size_t n;
+	while( (n = fread(buf,1,sizeof(buf),f)) > 0 )
+		s.append(buf,n);
+	fclose(f);
+	return s;
+}
+
+// Issues o.requests requests, keeping twice the concurrency queued, and
+// with cancel set aborts every other transfer once it is running
+static void Run(const Options &o,size_t threads,size_t concurrency,bool cancel,Result *r)
+{
+	RequestManager m(concurrency);
+	m.set_max_handles(concurrency,concurrency);
+	m.set_max_attempts(o.attempts);
+	m.set_hedging(o.hedging);
+	m.set_bandwidth(o.bandwidth);
+	m.set_memory_limits(o.memory);
+	m.set_spill_dir(o.spill_dir);
+	m.start(threads);
+	long allocs_before = AtomicGet(&allocations);
+	int64_t begin = TimeUs();
+	size_t issued = 0, finished = 0;
+	r->errors = 0;
+	r->latency.clear();
+	r->wall.clear();
+	r->urgent.clear();
+	std::vector<Request *> done;
+	std::set<Request *> doomed;
+	std::map<Request *,int64_t> issued_at;
+	std::set<Request *> urgent;
+	std::map<Request *,Crc32Stage *> stages;
+	r->streamed_bytes = 0;
+	while( finished < o.requests ) {
+		while( issued < o.requests && m.get_queue().size() < 2 * concurrency ) {
+			// spread the background requests over the run
+			bool background = (issued * 7919) % 100 < o.background * 100;
+			Crc32Stage *stage = o.stream ? new Crc32Stage() : 0;
+			Request *q = m.get(TileUrl(o,issued).c_str(),background ? 1 : 0,
+				background ? kTrafficBackground : o.background > 0 ? kTrafficUrgent : kTrafficNormal,stage);
+			if( stage )
+				stages[q] = stage;
+			issued_at[q] = TimeUs();
+			if( o.background > 0 && !background )
+				urgent.insert(q);
+			if( cancel && issued % 2 )
+				doomed.insert(q);
+			issued++;
+		}
+		m.step();
+		done.clear();
+		std::list<Request *>::const_iterator e = m.get_queue().end();
+		std::list<Request *>::const_iterator i = m.get_queue().begin();
+		for( ; i != e; i++ ) {
+			Request *q = *i;
+			if( q->get_state() == kOK || q->get_state() == kError ) {
+				done.push_back(q);
+			} else if( q->get_state() == kDownloading && doomed.erase(q) ) {
+				m.cancel(q);
+			}
+		}
+		for( size_t n = 0; n < done.size(); n++ ) {
+			Request *q = done[n];
+			if( q->get_state() == kOK && q->get_response_code() < 400 ) {
+				r->latency.record(q->get_timing().total_us());
+				r->wall.record(TimeUs() - issued_at[q]);
+				if( urgent.count(q) )
+					r->urgent.record(TimeUs() - issued_at[q]);
+			} else if( !q->get_canceling() && q->get_errcode() != CURLE_ABORTED_BY_CALLBACK )
+				r->errors++;
+			doomed.erase(q);
+			issued_at.erase(q);
+			urgent.erase(q);
+			std::map<Request *,Crc32Stage *>::iterator st = stages.find(q);
+			m.clean(q);
+			if( st != stages.end() ) {
+				r->streamed_bytes += st->second->get_bytes();
+				delete st->second;
+				stages.erase(st);
+			}
+			finished++;
+		}
+		if( done.empty() )
+			Idle(m);
+	}
+	r->seconds = (TimeUs() - begin) / 1000000.0;
+	long allocs = AtomicGet(&allocations) - allocs_before;
+	size_t connects = 0, transfers = 0;
+	std::map<std::string,HostTiming>::const_iterator te = m.get_timings().end();
+	std::map<std::string,HostTiming>::const_iterator ti = m.get_timings().begin();
+	for( ; ti != te; ti++ ) {
+		connects += ti->second.connects;
+		transfers += ti->second.requests;
+	}
+	r->scenario = cancel ? "cancel" : "throughput";
+	r->allocator = slab ? "slab" : "system";
+	r->threads = threads;
+	r->concurrency = concurrency;
+	r->requests = o.requests;
+	r->connects_per_request = transfers ? (double)connects / transfers : 0;
+	r->allocs_per_request = o.requests ? (double)allocs / o.requests : 0;
+	r->cancels = m.get_cancels();
+	r->cancel_us_mean = m.get_cancel_us_mean();
+	r->cancel_us_max = m.get_cancel_us_max();
+	r->retries = m.get_retry().get_retries();
+	r->hedges = m.get_retry().get_hedges();
+	r->hedges_won = m.get_retry().get_hedges_won();
+	r->rebalances = m.get_bandwidth().get_rebalances();
+	r->pauses = m.get_bandwidth().get_pauses();
+	r->peak_body_bytes = m.get_memory().get_peak();
+	r->holds = m.get_memory().get_holds();
+	r->spills = m.get_memory().get_spills();
+	r->resumes = m.get_partials().get_resumes();
+	r->resumed_bytes = m.get_partials().get_resumed_bytes();
+	r->refusals = m.get_partials().get_refusals();
+	m.stop();
+	while( !m.get_queue().empty() )
+		m.clean(m.get_queue().front());
+	std::map<Request *,Crc32Stage *>::iterator se = stages.end();
+	std::map<Request *,Crc32Stage *>::iterator si = stages.begin();
+	for( ; si != se; si++ ) {
+		delete si->second;
+	}
+	r->peak_rss_kb = PeakRssKb();
+}
+
+struct LargeResult {
+	size_t threads;
+	long bytes;
+	double single_seconds;
+	double segmented_seconds;
+	size_t segments;
+	int width;
+	int failures;
+	bool same;
+};
+
+// Times one large object fetched whole, then segmented into a file
+static void RunLarge(const Options &o,size_t threads,LargeResult *r)
+{
+	static const char *kPath = "request-bench-large.tmp";
+	RequestManager m(SegmentedDownload::kMaxWidth);
+	m.set_max_attempts(o.attempts);
+	m.start(threads);
+	std::string url = TileUrl(o,o.requests);
+	int64_t begin = TimeUs();
+	Request *q = m.get(url.c_str());
+	while( q->get_state() != kOK && q->get_state() != kError ) {
+		m.step();
+		Idle(m);
+	}
+	r->threads = threads;
+	r->single_seconds = (TimeUs() - begin) / 1000000.0;
+	std::string body = q->get_content();
+	m.clean(q);
+	{
+		SegmentedDownload d(&m,url,kPath);
+		if( d.start() ) {
+			while( d.get_state() == SegmentedDownload::kRunning ) {
+				m.step();
+				d.step();
+				Idle(m);
+			}
+		}
+		if( d.get_state() != SegmentedDownload::kDone )
+			fprintf(stderr,"SEGMENTED DOWNLOAD FAILED: %s\n",d.get_errmsg().c_str());
+		r->segmented_seconds = d.get_seconds();
+		r->segments = d.get_segments();
+		r->width = d.get_width();
+		r->failures = d.get_failures();
+		r->bytes = d.get_bytes();
+	}
+	std::string file;
+	FILE *f = fopen(kPath,"rb");
+	if( f ) {
+		char buf[65536];
+		size_t n;
+		while( (n = fread(buf,1,sizeof(buf),f)) > 0 )
+			file.append(buf,n);
+		fclose(f);
+	}
+	remove(kPath);
+	r->same = !body.empty() && file == body;
+	m.stop();
+	while( !m.get_queue().empty() )
+		m.clean(m.get_queue().front());
+}
+
+// Nanoseconds per allocation and free of a mix of sizes like libcurl's:
+// mostly strings and list nodes, some header buffers, a few receive
+// buffers, with up to kLive blocks alive at a time
+static double ReplayNs(bool use_slab,size_t ops)
+{
+	static const size_t kLive = 512;
+	void *live[kLive];
+	memset(live,0,sizeof(live));
+	uint32_t seed = 12345;
+	int64_t begin = TimeUs();
+	for( size_t i = 0; i < ops; i++ ) {
+		seed = seed * 1103515245u + 12345u;
+		uint32_t r = seed >> 8;
+		size_t slot = r % kLive;
+		uint32_t kind = (r / kLive) % 100;
+		size_t size = kind < 60 ? 8 + r % 56 : kind < 85 ? 64 + r % 192 : kind < 97 ? 256 + r % 768 : 16384;
+		if( use_slab ) {
+			SlabAllocator::Free(live[slot]);
+			live[slot] = SlabAllocator::Malloc(size);
+		} else {
+			free(live[slot]);
+			live[slot] = malloc(size);
+		}
+		*(char *)live[slot] = 1;
+	}
+	for( size_t i = 0; i < kLive; i++ ) {
+		if( use_slab )
+			SlabAllocator::Free(live[i]);
+		else
+			free(live[i]);
+	}
+	return ops ? (TimeUs() - begin) * 1000.0 / ops : 0.0;
+}
+
+// The size class counts of every run with the slab allocator, then the
+// replay of both allocators
+static void PrintAllocators(FILE *f)
+{
+	const SlabAllocator &a = SlabAllocator::instance();
+	const SlabAllocator::LargeStats &l = a.get_large_stats();
+	fprintf(f,"  \"allocators\": {\"large\": {\"allocs\": %ld, \"peak_bytes\": %ld},\n",l.allocs,l.peak_bytes);
+	fprintf(f,"    \"classes\": [\n");
+	for( int i = 0; i < SlabAllocator::get_classes(); i++ ) {
+		SlabAllocator::ClassStats st = a.get_class_stats(i);
+		fprintf(f,"      {\"size\": %d, \"allocs\": %ld, \"peak\": %ld, \"slabs\": %ld}%s\n",
+			(int)a.get_class_size(i),st.allocs,st.peak,st.slabs,i + 1 == SlabAllocator::get_classes() ? "" : ",");
+	}
+	const size_t kOps = 2000000;
+	double system_ns = ReplayNs(false,kOps);
+	double slab_ns = ReplayNs(true,kOps);
+	fprintf(f,"    ],\n    \"replay_ops\": %d, \"system_ns\": %.1f, \"slab_ns\": %.1f},\n",
+		(int)kOps,system_ns,slab_ns);
+}
+
+static void PrintResult(FILE *f,const Result &r,bool last)
+{
+	fprintf(f,"    {\"scenario\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"concurrency\": %d, \"requests\": %d, \"errors\": %d,\n",
+		r.scenario,r.allocator,(int)r.threads,(int)r.concurrency,(int)r.requests,(int)r.errors);
+	fprintf(f,"     \"seconds\": %.3f, \"rps\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f,\n",
+		r.seconds,r.seconds > 0 ? r.requests / r.seconds : 0.0,
+		r.latency.percentile(0.50) / 1000.0,r.latency.percentile(0.99) / 1000.0,r.latency.max() / 1000.0);
+	fprintf(f,"     \"connects_per_request\": %.3f, \"peak_rss_kb\": %ld, \"allocs_per_request\": %.1f,\n",
+		r.connects_per_request,r.peak_rss_kb,r.allocs_per_request);
+	fprintf(f,"     \"cancels\": %d, \"cancel_us_mean\": %lld, \"cancel_us_max\": %lld,\n",
+		(int)r.cancels,(long long)r.cancel_us_mean,(long long)r.cancel_us_max);
+	fprintf(f,"     \"retries\": %d, \"hedges\": %d, \"hedges_won\": %d, \"p50_wall_ms\": %.3f, \"p99_wall_ms\": %.3f,\n",
+		(int)r.retries,(int)r.hedges,(int)r.hedges_won,
+		r.wall.percentile(0.50) / 1000.0,r.wall.percentile(0.99) / 1000.0);
+	fprintf(f,"     \"p50_urgent_ms\": %.3f, \"p99_urgent_ms\": %.3f, \"rebalances\": %d, \"pauses\": %d,\n",
+		r.urgent.percentile(0.50) / 1000.0,r.urgent.percentile(0.99) / 1000.0,(int)r.rebalances,(int)r.pauses);
+	fprintf(f,"     \"peak_body_kb\": %d, \"holds\": %d, \"spills\": %d, \"streamed_kb\": %d,\n",
+		(int)(r.peak_body_bytes / 1024),(int)r.holds,(int)r.spills,(int)(r.streamed_bytes / 1024));
+	fprintf(f,"     \"resumes\": %d, \"resumed_kb\": %d, \"range_refusals\": %d}%s\n",
+		(int)r.resumes,(int)(r.resumed_bytes / 1024),(int)r.refusals,last ? "" : ",");
+}
+
+static std::vector<size_t> ParseList(const char *s)
+{
+	std::vector<size_t> v;
+	while( *s ) {
+		char *end;
+		long n = strtol(s,&end,10);
+		if( end == s )
+			break;
+		v.push_back((size_t)n);
+		s = *end == ',' ? end + 1 : end;
+	}
+	return v;
+}
+
+static std::vector<std::string> ParseNames(const char *s)
+{
+	std::vector<std::string> v;
+	while( *s ) {
+		const char *end = strchr(s,',');
+		if( !end )
+			end = s + strlen(s);
+		if( end > s )
+			v.push_back(std::string(s,end - s));
+		s = *end ? end + 1 : end;
+	}
+	return v;
+}
+
+static void Usage()
+{
+	fprintf(stderr,"usage: request-bench [-u url-template | -s script] [-n requests] [-c 1,4,8,16] [-t 0,1,2]\n"
+		"                     [-a system,slab] [-r attempts] [-H percentile] [-g share]\n"
+		"                     [-b bytes/s] [-m bytes] [-d dir] [-p] [-L] [-o out.json]\n");
+	exit(2);
+}
+
+int main(int argc,char **argv)
+{
+	Options o;
+	o.requests = 2000;
+	o.concurrency = ParseList("1,4,8,16");
+	o.threads = ParseList("0,1,2");
+	o.allocators = ParseNames("system,slab");
+	o.attempts = 3;
+	o.hedging = 0;
+	o.background = 0;
+	o.bandwidth = 0;
+	o.memory = 0;
+	o.stream = false;
+	o.large = false;
+	o.out = 0;
+	for( int i = 1; i < argc; i++ ) {
+		if( !strcmp(argv[i],"-p") ) {
+			o.stream = true;
+			continue;
+		}
+		if( !strcmp(argv[i],"-L") ) {
+			o.large = true;
+			continue;
+		}
+		if( i + 1 >= argc )
+			Usage();
+		if( !strcmp(argv[i],"-u") )
+			o.url = argv[++i];
+		else if( !strcmp(argv[i],"-s") )
+			o.script = ReadScript(argv[++i]);
+		else if( !strcmp(argv[i],"-n") )
+			o.requests = (size_t)atol(argv[++i]);
+		else if( !strcmp(argv[i],"-c") )
+			o.concurrency = ParseList(argv[++i]);
+		else if( !strcmp(argv[i],"-t") )
+			o.threads = ParseList(argv[++i]);
+		else if( !strcmp(argv[i],"-a") )
+			o.allocators = ParseNames(argv[++i]);
+		else if( !strcmp(argv[i],"-r") )
+			o.attempts = atoi(argv[++i]);
+		else if( !strcmp(argv[i],"-H") )
+			o.hedging = atof(argv[++i]);
+		else if( !strcmp(argv[i],"-g") )
+			o.background = atof(argv[++i]);
+		else if( !strcmp(argv[i],"-b") )
+			o.bandwidth = atol(argv[++i]);
+		else if( !strcmp(argv[i],"-m") )
+			o.memory = (size_t)atol(argv[++i]);
+		else if( !strcmp(argv[i],"-d") )
+			o.spill_dir = argv[++i];
+		else if( !strcmp(argv[i],"-o") )
+			o.out = argv[++i];
+		else
+			Usage();
+	}
+	TileServerConfig config;
+	std::string error;
+	if( !config.parse(o.script,&error) ) {
+		fprintf(stderr,"BAD SCRIPT: %s\n",error.c_str());
+		return 2;
+	}
+	BenchServer server(config);
+	if( o.url.empty() ) {
+		if( !server.start() ) {
+			fprintf(stderr,"CAN'T START TILE SERVER\n");
+			return 1;
+		}
+		char url[128];
+		snprintf(url,sizeof(url),"http://127.0.0.1:%d/tiles/%%d/%%d/%%d.png",server.get_port());
+		o.url = url;
+	}
+	std::vector<Result *> results;
+	std::vector<LargeResult> large;
+	std::string version;
+	for( size_t a = 0; a < o.allocators.size(); a++ ) {
+		slab = o.allocators[a] == "slab";
+		if( curl_global_init_mem(CURL_GLOBAL_ALL,CountedMalloc,CountedFree,CountedRealloc,CountedStrdup,CountedCalloc) != CURLE_OK ) {
+			fprintf(stderr,"CURL INIT FAILED\n");
+			return 1;
+		}
+		version = curl_version_info(CURLVERSION_NOW)->version;
+		for( size_t t = 0; t < o.threads.size(); t++ ) {
+			for( size_t c = 0; c < o.concurrency.size(); c++ ) {
+				for( int cancel = 0; cancel < 2; cancel++ ) {
+					Result *r = new Result();
+					fprintf(stderr,"%s, %s allocator: %d threads, concurrency %d...",cancel ? "cancel" : "throughput",
+						o.allocators[a].c_str(),(int)o.threads[t],(int)o.concurrency[c]);
+					Run(o,o.threads[t],o.concurrency[c],cancel != 0,r);
+					fprintf(stderr," %.1f requests/s\n",r->seconds > 0 ? r->requests / r->seconds : 0.0);
+					results.push_back(r);
+				}
+			}
+		}
+		curl_global_cleanup();
+	}
+	slab = false;
+	if( o.large ) {
+		curl_global_init(CURL_GLOBAL_ALL);
+		for( size_t t = 0; t < o.threads.size(); t++ ) {
+			LargeResult r;
+			fprintf(stderr,"large object, %d threads...",(int)o.threads[t]);
+			RunLarge(o,o.threads[t],&r);
+			fprintf(stderr," %.2f s whole, %.2f s segmented\n",r.single_seconds,r.segmented_seconds);
+			large.push_back(r);
+		}
+		curl_global_cleanup();
+	}
+	FILE *f = o.out ? fopen(o.out,"w") : stdout;
+	if( !f ) {
+		fprintf(stderr,"CAN'T WRITE %s\n",o.out);
+		return 1;
+	}
+	server.stop();
+	fprintf(f,"{\n  \"benchmark\": \"request-manager\",\n  \"url\": \"%s\",\n  \"libcurl\": \"%s\",\n",
+		o.url.c_str(),version.c_str());
+	if( server.get_port() ) {
+		std::string script;
+		for( size_t i = 0; i < o.script.size(); i++ ) {
+			char c = o.script[i];
+			if( c == '\n' )
+				script += "; ";
+			else if( c == '"' || c == '\\' )
+				script += std::string("\\") + c;
+			else if( (unsigned char)c >= ' ' )
+				script += c;
+		}
+		const TileServer::Stats &s = server.get_stats();
+		fprintf(f,"  \"server\": {\"script\": \"%s\", \"connections\": %ld, \"requests\": %ld, \"not_modified\": %ld,\n",
+			script.c_str(),s.connections,s.requests,s.not_modified);
+		fprintf(f,"             \"redirects\": %ld, \"errors\": %ld, \"timeouts\": %ld, \"cuts\": %ld, \"ranges\": %ld, \"bytes\": %ld},\n",
+			s.redirects,s.errors,s.timeouts,s.cuts,s.ranges,s.bytes);
+	}
+	PrintAllocators(f);
+	fprintf(f,"  \"results\": [\n");
+	for( size_t i = 0; i < results.size(); i++ ) {
+		PrintResult(f,*results[i],i + 1 == results.size());
+		delete results[i];
+	}
+	fprintf(f,"  ]");
+	if( o.large ) {
+		fprintf(f,",\n  \"large\": [\n");
+		for( size_t i = 0; i < large.size(); i++ ) {
+			const LargeResult &r = large[i];
+			fprintf(f,"    {\"threads\": %d, \"bytes\": %ld, \"single_s\": %.3f, \"segmented_s\": %.3f, \"speedup\": %.2f,\n",
+				(int)r.threads,r.bytes,r.single_seconds,r.segmented_seconds,
+				r.segmented_seconds > 0 ? r.single_seconds / r.segmented_seconds : 0.0);
+			fprintf(f,"     \"segments\": %d, \"width\": %d, \"failures\": %d, \"same\": %s}%s\n",
+				(int)r.segments,r.width,r.failures,r.same ? "true" : "false",i + 1 == large.size() ? "" : ",");
+		}
+		fprintf(f,"  ]");
+	}
+	fprintf(f,"\n}\n");
+	if( f != stdout )
+		fclose(f);
+	return 0;
+}
@@ -0,0 +1,83 @@
+// Standalone tile server for running the example against
+//-----------------------------------------------------------------------------
+//
+// Serves TileServer on a fixed loopback port until interrupted, so the
+// example on the simulator can point HTTP_TILES at it instead of the real
+// tile host. Built like request-bench:
+//
+//   g++ -O2 -I example/h example/bench/tile-server.cpp -o tile-server -lpthread
+//
+//   ./tile-server [-p port] [-s script]
+//
+// The script is a file or the settings themselves, see TileServer.h. The
+// server's counters are printed when it is stopped.
+//-----------------------------------------------------------------------------
+
+#include <string>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "TileServer.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void OnSignal(int)
+{
+	interrupted = 1;
+}
+
+static void Usage()
+{
+	fprintf(stderr,"usage: tile-server [-p port] [-s script]\n");
+	exit(2);
+}
+
+int main(int argc,char **argv)
+{
+	int port = 8080;
+	std::string script;
+	for( int i = 1; i < argc; i++ ) {
+		if( i + 1 >= argc )
+			Usage();
+		if( !strcmp(argv[i],"-p") ) {
+			port = atoi(argv[++i]);
+		} else if( !strcmp(argv[i],"-s") ) {
+			const char *arg = argv[++i];
+			FILE *f = fopen(arg,"r");
+			if( f ) {
+				char buf[1024];
+				size_t n;
+				while( (n = fread(buf,1,sizeof(buf),f)) > 0 )
+					script.append(buf,n);
+				fclose(f);
+			} else {
+				script = arg;
+			}
+		} else {
+			Usage();
+		}
+	}
+	TileServerConfig config;
+	std::string error;
+	if( !config.parse(script,&error) ) {
+		fprintf(stderr,"BAD SCRIPT: %s\n",error.c_str());
+		return 2;
+	}
+	TileServer server(config);
+	if( !server.start(port) ) {
+		fprintf(stderr,"CAN'T LISTEN ON PORT %d\n",port);
+		return 1;
+	}
+	signal(SIGINT,OnSignal);
+	signal(SIGTERM,OnSignal);
+	fprintf(stderr,"serving http://127.0.0.1:%d/<z>/<x>/<y>.png\n",server.get_port());
+	while( !interrupted )
+		usleep(100 * 1000);
+	server.stop();
+	const TileServer::Stats &s = server.get_stats();
+	fprintf(stderr,"%ld connections, %ld requests, %ld not modified, %ld redirects, %ld errors, %ld timeouts, %ld bytes\n",
+		s.connections,s.requests,s.not_modified,s.redirects,s.errors,s.timeouts,s.bytes);
+	return 0;
+}
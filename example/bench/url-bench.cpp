@@ -0,0 +1,356 @@
+// Fuzzing and timing of the URL view parser
+//-----------------------------------------------------------------------------
+//
+// Checks UrlView against URLs built from known parts and against random
+// mutations of them, then times it against the extract_* functions it
+// replaced in the workaround example. Built on a Linux desktop, best with
+// the address sanitizer while fuzzing:
+//
+//   g++ -O2 -I example/h example/bench/url-bench.cpp -o url-bench
+//   g++ -g -fsanitize=address,undefined -I example/h example/bench/url-bench.cpp -o url-bench
+//
+//   ./url-bench [-n iterations] [-s seed]
+//
+// A failure prints the URL and the check it broke and exits with 1. Built
+// URLs must come back as the parts they were made of. For any input at
+// all, the views must lie in order inside it and glued back together with
+// their separators give the input again.
+//-----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "UrlView.h"
+#include "TimeUs.h"
+
+//-----------------------------------------------------------------------------
+// Allocation counting
+
+static long allocations = 0;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC
+{
+	allocations++;
+	void *p = malloc(size ? size : 1);
+	if( !p )
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size) THROW_BAD_ALLOC
+{
+	return operator new(size);
+}
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+void operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+//-----------------------------------------------------------------------------
+// The functions UrlView replaced, as they were
+
+static std::string extract_host(const std::string &url) {
+	size_t p1 = url.find("://");
+	if( p1 == std::string::npos )
+		return "";
+	p1 += 3;
+	size_t p2 = url.find(":",p1);
+	size_t p3 = url.find("/",p1);
+	if( p2 != std::string::npos && (p3 == std::string::npos || p2 < p3) ) {
+		p3 = p2;
+	}
+	if( p3 == std::string::npos )
+		return url.substr(p1);
+	return url.substr(p1,p3 - p1);
+}
+
+static std::string extract_port(const std::string &url) {
+	size_t p1 = url.find("://");
+	if( p1 == std::string::npos )
+		return "";
+	p1 += 3;
+	size_t p2 = url.find(":",p1);
+	size_t p3 = url.find("/",p1);
+	if( p2 == std::string::npos )
+		return "";
+	return url.substr(p2,p3);
+}
+
+static std::string extract_path(const std::string &url) {
+	size_t p1 = url.find("://");
+	if( p1 == std::string::npos )
+		return "";
+	p1 += 3;
+	size_t p3 = url.find("/",p1);
+	if( p3 == std::string::npos )
+		return "";
+	return url.substr(p3);
+}
+
+static std::string extract_proto(const std::string &url) {
+	size_t p1 = url.find("://");
+	if( p1 == std::string::npos )
+		return "";
+	return url.substr(0,p1);
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t seed = 1;
+
+static uint32_t Random(uint32_t n)
+{
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 8) % n;
+}
+
+static std::string RandomWord(const char *alphabet,size_t min,size_t max)
+{
+	size_t len = min + Random((uint32_t)(max - min + 1));
+	size_t n = strlen(alphabet);
+	std::string s;
+	for( size_t i = 0; i < len; i++ )
+		s += alphabet[Random((uint32_t)n)];
+	return s;
+}
+
+// The parts of a well formed URL, absent ones with present false
+struct Part {
+	bool present;
+	std::string value;
+};
+
+struct Parts {
+	Part scheme, userinfo, host, port, path, query, fragment;
+};
+
+static Part Present(const std::string &value)
+{
+	Part p = { true,value };
+	return p;
+}
+
+static Part Absent()
+{
+	Part p = { false,"" };
+	return p;
+}
+
+static void MakeParts(Parts *p)
+{
+	static const char *schemes[] = { "http","https","ftp","HTTP","svn+ssh" };
+	static const char *kName = "abcdefghijklmnopqrstuvwxyz0123456789-.";
+	static const char *kPath = "abcdefghijklmnopqrstuvwxyz0123456789-._~%!$&'()*+,;=:@";
+	p->scheme = Random(5) ? Present(schemes[Random(5)]) : Absent();
+	p->userinfo = Random(5) ? Absent() : Present(RandomWord("abcdef:%",0,8));
+	switch( Random(3) ) {
+	case 0:
+		p->host = Present(RandomWord(kName,0,20));
+		break;
+	case 1: {
+		char buf[32];
+		snprintf(buf,sizeof(buf),"%d.%d.%d.%d",Random(256),Random(256),Random(256),Random(256));
+		p->host = Present(buf);
+		break;
+	}
+	default:
+		p->host = Present("[" + RandomWord("0123456789abcdef:",2,20) + "]");
+		break;
+	}
+	p->port = Random(3) ? Absent() : Present(RandomWord("0123456789",0,5));
+	std::string path;
+	for( uint32_t n = Random(4); n > 0; n-- )
+		path += "/" + RandomWord(kPath,0,10);
+	p->path = Present(path);
+	// "host:" and a path starting "//" would read as a scheme
+	if( !p->scheme.present && p->port.present && p->port.value.empty() && !path.compare(0,2,"//") )
+		p->port = Absent();
+	p->query = Random(3) ? Absent() : Present(RandomWord("abc=&/?:@%",0,12));
+	p->fragment = Random(4) ? Absent() : Present(RandomWord("abc=&/?:@#%",0,8));
+}
+
+static std::string Glue(const Parts &p)
+{
+	std::string s;
+	if( p.scheme.present )
+		s += p.scheme.value + "://";
+	if( p.userinfo.present )
+		s += p.userinfo.value + "@";
+	s += p.host.value;
+	if( p.port.present )
+		s += ":" + p.port.value;
+	s += p.path.value;
+	if( p.query.present )
+		s += "?" + p.query.value;
+	if( p.fragment.present )
+		s += "#" + p.fragment.value;
+	return s;
+}
+
+static bool Same(const StrView &v,const Part &p)
+{
+	return v.present() == p.present && v.str() == p.value;
+}
+
+static int Fail(const std::string &url,const char *check)
+{
+	fprintf(stderr,"FAILED %s: \"%s\"\n",check,url.c_str());
+	return 1;
+}
+
+// Views in order inside the input and glued back into it
+static int CheckAny(const std::string &url)
+{
+	UrlView v(url);
+	const StrView *views[] = { &v.scheme,&v.userinfo,&v.host,&v.port,&v.path,&v.query,&v.fragment };
+	const char *at = url.data();
+	for( size_t i = 0; i < sizeof(views) / sizeof(views[0]); i++ ) {
+		const StrView &w = *views[i];
+		if( !w.present() )
+			continue;
+		if( w.data < at || w.data + w.size > url.data() + url.size() )
+			return Fail(url,"view out of order or bounds");
+		at = w.data + w.size;
+	}
+	std::string glued;
+	if( v.scheme.present() )
+		glued += v.scheme.str() + "://";
+	if( v.userinfo.present() )
+		glued += v.userinfo.str() + "@";
+	glued += v.host.str();
+	if( v.port.present() )
+		glued += ":" + v.port.str();
+	glued += v.path.str();
+	if( v.query.present() )
+		glued += "?" + v.query.str();
+	if( v.fragment.present() )
+		glued += "#" + v.fragment.str();
+	if( glued != url )
+		return Fail(url,"glued views differ from the input");
+	int port = v.port_number();
+	if( port < -1 || port > 65535 )
+		return Fail(url,"port out of range");
+	if( v.valid() && v.port.size && port != -1 && port != atoi(v.port.str().c_str()) )
+		return Fail(url,"port number");
+	StrView hp = v.host_port();
+	if( hp.data != v.host.data || hp.size < v.host.size )
+		return Fail(url,"host_port");
+	return 0;
+}
+
+static int CheckBuilt(const Parts &p)
+{
+	std::string url = Glue(p);
+	UrlView v(url);
+	if( !Same(v.scheme,p.scheme) || !Same(v.userinfo,p.userinfo) || !Same(v.host,p.host) ||
+		!Same(v.port,p.port) || !Same(v.path,p.path) || !Same(v.query,p.query) || !Same(v.fragment,p.fragment) )
+		return Fail(url,"parts differ from the ones built");
+	return CheckAny(url);
+}
+
+static std::string Mutate(std::string s)
+{
+	static const char kChars[] = ":/?#@[]a1%. \xff";
+	for( uint32_t n = 1 + Random(4); n > 0; n-- ) {
+		size_t at = s.empty() ? 0 : Random((uint32_t)s.size() + 1);
+		char c = kChars[Random(sizeof(kChars))]; // the terminating 0 as well
+		switch( Random(3) ) {
+		case 0:
+			s.insert(at,1,c);
+			break;
+		case 1:
+			if( at < s.size() )
+				s.erase(at,1);
+			break;
+		default:
+			if( at < s.size() )
+				s[at] = c;
+			break;
+		}
+	}
+	return s;
+}
+
+//-----------------------------------------------------------------------------
+
+static void Time(const std::vector<std::string> &urls,size_t rounds)
+{
+	size_t sum = 0;
+	long allocs = allocations;
+	int64_t begin = TimeUs();
+	for( size_t r = 0; r < rounds; r++ ) {
+		for( size_t i = 0; i < urls.size(); i++ ) {
+			// what start_resolve, start_curl and GotResolve took
+			UrlView v(urls[i]);
+			sum += v.scheme.size + v.host.size + v.port.size + v.path.size + v.port_number();
+		}
+	}
+	double view_ns = (TimeUs() - begin) * 1000.0 / (rounds * urls.size());
+	double view_allocs = (double)(allocations - allocs) / (rounds * urls.size());
+	allocs = allocations;
+	begin = TimeUs();
+	for( size_t r = 0; r < rounds; r++ ) {
+		for( size_t i = 0; i < urls.size(); i++ ) {
+			sum += extract_proto(urls[i]).size() + extract_host(urls[i]).size() * 3 +
+				extract_port(urls[i]).size() * 2 + extract_path(urls[i]).size();
+		}
+	}
+	double old_ns = (TimeUs() - begin) * 1000.0 / (rounds * urls.size());
+	double old_allocs = (double)(allocations - allocs) / (rounds * urls.size());
+	printf("UrlView:   %.1f ns, %.2f allocations per URL\n",view_ns,view_allocs);
+	printf("extract_*: %.1f ns, %.2f allocations per URL\n",old_ns,old_allocs);
+	if( sum == 42 )
+		printf("\n");
+}
+
+int main(int argc,char **argv)
+{
+	long iterations = 1000000;
+	for( int i = 1; i + 1 < argc; i += 2 ) {
+		if( !strcmp(argv[i],"-n") )
+			iterations = atol(argv[i + 1]);
+		else if( !strcmp(argv[i],"-s") )
+			seed = (uint32_t)strtoul(argv[i + 1],0,10);
+	}
+	std::vector<std::string> urls;
+	for( long i = 0; i < iterations; i++ ) {
+		Parts p;
+		MakeParts(&p);
+		if( CheckBuilt(p) )
+			return 1;
+		if( CheckAny(Mutate(Glue(p))) )
+			return 1;
+	}
+	printf("%ld built and %ld mutated URLs parsed\n",iterations,iterations);
+	// the URLs of the example: a tile server, a port, an address
+	for( int i = 0; i < 1000; i++ ) {
+		char buf[256];
+		switch( i % 3 ) {
+		case 0:
+			snprintf(buf,sizeof(buf),"http://jams.doroga.tv/jams/14/%d/%d.png",10189 + i % 7,5076 + i / 7);
+			break;
+		case 1:
+			snprintf(buf,sizeof(buf),"http://127.0.0.1:8080/tiles/14/%d/%d.png",10189 + i % 7,5076 + i / 7);
+			break;
+		default:
+			snprintf(buf,sizeof(buf),"http://78.40.184.246/jams/14/%d/%d.png?v=%d",10189 + i % 7,5076 + i / 7,i);
+			break;
+		}
+		urls.push_back(buf);
+	}
+	Time(urls,1000);
+	return 0;
+}
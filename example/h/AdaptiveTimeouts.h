@@ -0,0 +1,141 @@
+// Connect and stall timeouts derived from the RTTs seen per host
+//-----------------------------------------------------------------------------
+
+#ifndef ADAPTIVE_TIMEOUTS_H
+#define ADAPTIVE_TIMEOUTS_H
+
+#include <string>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include "RequestTiming.h"
+
+// Smoothed RTT and its mean deviation the way TCP keeps them (RFC 6298):
+// the first sample sets srtt and half of it as the deviation, later ones
+// move the deviation by 1/4 of the error and srtt by 1/8. A response later
+// than srtt + 4 * rttvar is then very unlikely to come at all.
+struct RttEstimator {
+	double srtt;   // us
+	double rttvar; // us
+	size_t samples;
+
+	RttEstimator()
+		: srtt(0),rttvar(0),samples(0)
+	{
+	}
+	void add(int64_t us) {
+		double r = (double)us;
+		if( !samples ) {
+			srtt = r;
+			rttvar = r / 2;
+		} else {
+			double error = r > srtt ? r - srtt : srtt - r;
+			rttvar += (error - rttvar) / 4;
+			srtt += (r - srtt) / 8;
+		}
+		samples++;
+	}
+	int64_t rto_us() const { return (int64_t)(srtt + 4 * rttvar); }
+};
+
+// What a transfer is given: libcurl's connect timeout (resolving
+// included), the low speed abort, and the overall timeout
+struct Timeouts {
+	long connect_ms;
+	long low_speed_limit; // bytes per second, 0 turns the check off
+	long low_speed_time;  // seconds
+	long total_ms;
+
+	Timeouts()
+		: connect_ms(15000),low_speed_limit(0),low_speed_time(0),total_ms(30000)
+	{
+	}
+};
+
+// Per host estimates of the connect time, the time to the first byte and
+// the transfer rate, turned into the timeouts of its next transfers.
+//
+// The connect timeout is the RTO of the resolve and connect times, and
+// at least kMinConnectMs, so a dead address is given up after hundreds of
+// milliseconds on a fast network instead of 15 seconds. Stalls are left
+// to libcurl's low speed check: a transfer which gets less than 1/16 of
+// the host's usual rate for as long as the RTO of the time to the first
+// byte is aborted. libcurl counts that in whole seconds and takes a speed
+// sample only about once a second, so a shorter window can run out before
+// a healthy transfer was ever measured; the window is kMinLowSpeedSec at
+// least, and a stall is found after that long or a little more. Until a
+// host has kMinSamples samples, the fixed defaults apply.
+//
+// Each timeout on a host doubles its timeouts, up to kMaxBackoff times,
+// and the next transfer which succeeds goes back to the estimates, like
+// TCP backs off its RTO; a path which only became slower is not timed out
+// over and over.
+class AdaptiveTimeouts {
+public:
+	static const size_t kMinSamples = 3;
+	static const long kMinConnectMs = 200;
+	static const long kMinLowSpeedSec = 3; // a few of libcurl's speed samples
+	static const int kMaxBackoff = 8;
+	static const int kRateMinBytes = 16 * 1024; // smaller bodies say little about the rate
+
+	struct Host {
+		RttEstimator connect;  // resolve and connect, new connections only
+		RttEstimator wait;     // request sent to first byte
+		double rate;           // smoothed bytes per second of a transfer
+		int backoff;
+		size_t timeouts;
+		Host()
+			: rate(0),backoff(1),timeouts(0)
+		{
+		}
+	};
+private:
+	std::map<std::string,Host> hosts;
+	Timeouts defaults;
+public:
+	// Timeouts for the next transfer to host
+	Timeouts get(const std::string &host) const {
+		Timeouts t = defaults;
+		std::map<std::string,Host>::const_iterator f = hosts.find(host);
+		if( f == hosts.end() )
+			return t;
+		const Host &h = f->second;
+		if( h.connect.samples >= kMinSamples ) {
+			long ms = (long)(h.connect.rto_us() * h.backoff / 1000);
+			t.connect_ms = ms < kMinConnectMs ? kMinConnectMs : ms > defaults.connect_ms ? defaults.connect_ms : ms;
+		}
+		if( h.wait.samples >= kMinSamples ) {
+			long s = (long)((h.wait.rto_us() * h.backoff + 999999) / 1000000);
+			long max_s = defaults.total_ms / 1000;
+			if( s < kMinLowSpeedSec )
+				s = kMinLowSpeedSec;
+			t.low_speed_time = s > max_s ? max_s : s;
+			t.low_speed_limit = h.rate >= 16 ? (long)(h.rate / 16) : 1;
+		}
+		return t;
+	}
+	// A transfer to host finished with a response; a throttled one has no
+	// rate_sample
+	void got_transfer(const std::string &host,const RequestTiming &t,bool rate_sample = true) {
+		Host &h = hosts[host];
+		if( t.connects > 0 )
+			h.connect.add(t.dns_us() + t.connect_us());
+		h.wait.add(t.wait_us());
+		int64_t us = t.receive_us();
+		if( rate_sample && t.downloaded >= kRateMinBytes && us > 0 ) {
+			double sample = t.downloaded * 1000000 / us;
+			h.rate = h.rate > 0 ? h.rate + (sample - h.rate) / 8 : sample;
+		}
+		h.backoff = 1;
+	}
+	// A transfer to host timed out, connecting or stalled
+	void got_timeout(const std::string &host) {
+		Host &h = hosts[host];
+		h.timeouts++;
+		if( h.backoff < kMaxBackoff )
+			h.backoff *= 2;
+	}
+	const std::map<std::string,Host> &get_hosts() const { return hosts; }
+};
+
+#endif /* !ADAPTIVE_TIMEOUTS_H */
@@ -0,0 +1,91 @@
+// Atomic operations on words and pointers shared between threads
+//-----------------------------------------------------------------------------
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+// Every operation is a full memory barrier, which is more than the lock-free
+// queues strictly need but keeps them correct on the ARM devices as well as
+// on the x86 simulator. GCC and ARMCC provide the __sync builtins, the
+// Windows simulator build goes through the Interlocked intrinsics.
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+inline long AtomicGet(volatile long *p)
+{
+	return _InterlockedCompareExchange(p,0,0);
+}
+inline void AtomicSet(volatile long *p,long v)
+{
+	_InterlockedExchange(p,v);
+}
+// Returns the new value
+inline long AtomicAdd(volatile long *p,long v)
+{
+	return _InterlockedExchangeAdd(p,v) + v;
+}
+inline bool AtomicCas(volatile long *p,long expected,long v)
+{
+	return _InterlockedCompareExchange(p,v,expected) == expected;
+}
+inline void *AtomicGetPtr(void *volatile *p)
+{
+	return _InterlockedCompareExchangePointer(p,0,0);
+}
+inline void AtomicSetPtr(void *volatile *p,void *v)
+{
+	_InterlockedExchangePointer(p,v);
+}
+// Returns the old value
+inline void *AtomicSwapPtr(void *volatile *p,void *v)
+{
+	return _InterlockedExchangePointer(p,v);
+}
+
+#else
+
+inline long AtomicGet(volatile long *p)
+{
+	return __sync_add_and_fetch(p,0);
+}
+// A plain store between two barriers would do on the hardware, but a
+// compare-and-swap keeps every access to the word atomic for the tools
+inline void AtomicSet(volatile long *p,long v)
+{
+	long old = __sync_add_and_fetch(p,0);
+	long seen;
+	while( (seen = __sync_val_compare_and_swap(p,old,v)) != old )
+		old = seen;
+}
+// Returns the new value
+inline long AtomicAdd(volatile long *p,long v)
+{
+	return __sync_add_and_fetch(p,v);
+}
+inline bool AtomicCas(volatile long *p,long expected,long v)
+{
+	return __sync_bool_compare_and_swap(p,expected,v);
+}
+inline void *AtomicGetPtr(void *volatile *p)
+{
+	return __sync_val_compare_and_swap(p,(void *)0,(void *)0);
+}
+// Returns the old value. __sync_lock_test_and_set is only an acquire
+// barrier, so this is a compare-and-swap loop instead.
+inline void *AtomicSwapPtr(void *volatile *p,void *v)
+{
+	void *old = AtomicGetPtr(p);
+	void *seen;
+	while( (seen = __sync_val_compare_and_swap(p,old,v)) != old )
+		old = seen;
+	return old;
+}
+inline void AtomicSetPtr(void *volatile *p,void *v)
+{
+	AtomicSwapPtr(p,v);
+}
+
+#endif
+
+#endif /* !ATOMIC_H */
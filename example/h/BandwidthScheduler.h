@@ -0,0 +1,173 @@
+// Shares the link between the running transfers by priority class
+//-----------------------------------------------------------------------------
+
+#ifndef BANDWIDTH_SCHEDULER_H
+#define BANDWIDTH_SCHEDULER_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+enum TrafficClass
+{
+	kTrafficUrgent,     // what the user is looking at right now
+	kTrafficNormal,
+	kTrafficBackground, // prefetching and other speculative downloads
+};
+static const int kTrafficClasses = 3;
+
+// Gives a running transfer its rate, 0 for no limit, or pauses it. Only
+// the thread driving its multi handle may call this. libcurl would count a
+// paused transfer as stalled, so its low speed check is off meanwhile, and
+// no lower than half the rate otherwise. A throttled transfer may take far
+// longer than its overall timeout allows, so that is off for good.
+inline void ThrottleTransfer(CURL *handle,curl_off_t rate,bool paused,long low_speed_limit,long low_speed_time)
+{
+	long limit = paused ? 0 : rate && low_speed_limit > rate / 2 ? (long)(rate / 2) : low_speed_limit;
+	curl_easy_setopt(handle,CURLOPT_MAX_RECV_SPEED_LARGE,rate);
+	curl_easy_setopt(handle,CURLOPT_LOW_SPEED_LIMIT,limit);
+	curl_easy_setopt(handle,CURLOPT_LOW_SPEED_TIME,low_speed_time);
+	if( rate || paused )
+		curl_easy_setopt(handle,CURLOPT_TIMEOUT_MS,0L);
+	curl_easy_pause(handle,paused ? CURLPAUSE_RECV : CURLPAUSE_CONT);
+}
+
+// Weighted split of the link. The transfers of the most urgent class
+// running get no limit at all; each transfer of a lower class is held to
+// its weighted share of the capacity, the weight() of its class over those
+// of all running transfers. Whatever the urgent ones leave unused is lost
+// to the others for a while, which is the price of keeping the link free
+// for them.
+//
+// A share below kMinRate is not worth a connection, so that transfer is
+// paused instead, for at most kMaxPauseUs at a stretch and then let
+// through at kMinRate for as long, so it neither starves nor times out.
+//
+// The capacity is set_bandwidth() when given, else the highest aggregate
+// rate sampled recently: each sample of the bytes all transfers received
+// over kSampleUs, the maximum fading to half in kWindowUs. Until there is
+// one, lower classes are paused whenever an urgent one runs.
+class BandwidthScheduler {
+public:
+	static const curl_off_t kMinRate = 4096; // bytes per second
+	static const int64_t kMaxPauseUs = 2000000;
+	static const int64_t kSampleUs = 250000;
+	static const int64_t kWindowUs = 10000000;
+
+	// A running transfer, as rebalance() sees and changes it
+	struct Flow {
+		int traffic;        // TrafficClass
+		curl_off_t rate;    // granted, 0 for no limit
+		bool paused;
+		int64_t paused_at;  // when the pause began
+		int64_t resumed_at; // when the last pause ended
+		bool changed;       // by the last rebalance(), to be applied
+		Flow()
+			: traffic(kTrafficNormal),rate(0),paused(false),paused_at(0),resumed_at(0),changed(false)
+		{
+		}
+		// For a new transfer of the same class
+		void reset() {
+			rate = 0;
+			paused = false;
+			paused_at = 0;
+			resumed_at = 0;
+			changed = false;
+		}
+	};
+	static int weight(int traffic) {
+		switch( traffic ) {
+		case kTrafficUrgent: return 16;
+		case kTrafficNormal: return 4;
+		default: return 1;
+		}
+	}
+private:
+	curl_off_t configured;  // bytes per second, 0 to measure
+	double estimate;        // bytes per second
+	int64_t sample_at;
+	long sample_bytes;
+	size_t rebalances;
+	size_t pauses;
+
+	// Forbid copying
+	BandwidthScheduler(const BandwidthScheduler &);
+	BandwidthScheduler &operator=(const BandwidthScheduler &);
+public:
+	BandwidthScheduler()
+		: configured(0),estimate(0),sample_at(0),sample_bytes(0),rebalances(0),pauses(0)
+	{
+	}
+	// Capacity of the link in bytes per second, 0 to estimate it
+	void set_bandwidth(curl_off_t bytes_per_second) {
+		configured = bytes_per_second;
+	}
+	curl_off_t get_capacity() const {
+		return configured ? configured : (curl_off_t)estimate;
+	}
+	// Bytes all transfers have received so far, fed every step; true when
+	// that made a new sample, and the grants should be looked at again even
+	// if no transfer started or finished
+	bool got_bytes(long total,int64_t now) {
+		if( !sample_at || total < sample_bytes ) {
+			sample_at = now;
+			sample_bytes = total;
+			return false;
+		}
+		int64_t us = now - sample_at;
+		if( us < kSampleUs )
+			return false;
+		double rate = (total - sample_bytes) * 1000000.0 / us;
+		estimate -= estimate * us / kWindowUs / 2;
+		if( rate > estimate )
+			estimate = rate;
+		sample_at = now;
+		sample_bytes = total;
+		return true;
+	}
+	// New grants for the running transfers; those which changed have
+	// changed set
+	void rebalance(const std::vector<Flow *> &flows,int64_t now) {
+		rebalances++;
+		int top = kTrafficClasses;
+		double weights = 0;
+		for( size_t i = 0; i < flows.size(); i++ ) {
+			if( flows[i]->traffic < top )
+				top = flows[i]->traffic;
+			weights += weight(flows[i]->traffic);
+		}
+		curl_off_t capacity = get_capacity();
+		for( size_t i = 0; i < flows.size(); i++ ) {
+			Flow &f = *flows[i];
+			curl_off_t rate = 0;
+			bool paused = false;
+			if( f.traffic != top ) {
+				double share = capacity * weight(f.traffic) / weights;
+				if( share >= kMinRate )
+					rate = (curl_off_t)share;
+				else if( f.paused ? now - f.paused_at >= kMaxPauseUs : f.resumed_at && now - f.resumed_at < kMaxPauseUs )
+					rate = kMinRate;
+				else
+					paused = true;
+			}
+			// the capacity moves with every sample, small moves of a rate
+			// are not worth telling libcurl about
+			if( rate && f.rate && rate > f.rate - f.rate / 8 && rate < f.rate + f.rate / 8 )
+				rate = f.rate;
+			f.changed = rate != f.rate || paused != f.paused;
+			if( paused && !f.paused ) {
+				f.paused_at = now;
+				pauses++;
+			} else if( !paused && f.paused ) {
+				f.resumed_at = now;
+			}
+			f.rate = rate;
+			f.paused = paused;
+		}
+	}
+	size_t get_rebalances() const { return rebalances; }
+	size_t get_pauses() const { return pauses; }
+};
+
+#endif /* !BANDWIDTH_SCHEDULER_H */
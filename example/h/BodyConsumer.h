@@ -0,0 +1,129 @@
+// Stages response bodies go through while they arrive
+//-----------------------------------------------------------------------------
+
+#ifndef BODY_CONSUMER_H
+#define BODY_CONSUMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Takes the body of a request piece by piece instead of as one string at
+// the end, so decoding, hashing or parsing overlaps the download and the
+// whole body never has to sit in memory. Only 2xx bodies stream; those of
+// other statuses are kept as usual, for the error.
+//
+// In threaded mode got_chunk() runs on a network thread, and got_reset()
+// and got_end() on the thread calling step(); they never run at once. A
+// consumer has to outlive its request.
+class BodyConsumer {
+public:
+	virtual ~BodyConsumer() {}
+	// The next piece of the body; false aborts the transfer, which then
+	// fails with CURLE_WRITE_ERROR
+	virtual bool got_chunk(const char *data,size_t size) = 0;
+	// What came so far is void and the body starts over, for a retry or
+	// when a hedge's body is replayed
+	virtual void got_reset() {}
+	// The request is over, with the whole 2xx body when ok; comes once,
+	// from the step() after the request finished or from clean()
+	virtual void got_end(bool ok) {}
+};
+
+// A consumer which passes what it sees on to the next one, so stages can
+// be chained into a pipeline
+class BodyStage : public BodyConsumer {
+	BodyConsumer *next;
+protected:
+	bool emit(const char *data,size_t size) {
+		return !next || next->got_chunk(data,size);
+	}
+public:
+	BodyStage(BodyConsumer *a_next = 0)
+		: next(a_next)
+	{
+	}
+	virtual void got_reset() {
+		if( next )
+			next->got_reset();
+	}
+	virtual void got_end(bool ok) {
+		if( next )
+			next->got_end(ok);
+	}
+};
+
+// CRC-32 (the zlib and PNG one) and length of the body
+class Crc32Stage : public BodyStage {
+	uint32_t crc;
+	size_t bytes;
+	uint32_t table[256];
+public:
+	Crc32Stage(BodyConsumer *next = 0)
+		: BodyStage(next),crc(0xffffffffu),bytes(0)
+	{
+		for( uint32_t n = 0; n < 256; n++ ) {
+			uint32_t c = n;
+			for( int k = 0; k < 8; k++ )
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+	bool got_chunk(const char *data,size_t size) {
+		for( size_t i = 0; i < size; i++ )
+			crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+		bytes += size;
+		return emit(data,size);
+	}
+	void got_reset() {
+		crc = 0xffffffffu;
+		bytes = 0;
+		BodyStage::got_reset();
+	}
+	uint32_t get_crc() const { return crc ^ 0xffffffffu; }
+	size_t get_bytes() const { return bytes; }
+};
+
+// Reads the size of a PNG from its IHDR chunk as soon as the first 24
+// bytes are in, and aborts a body which is no PNG at all right away
+// instead of downloading the rest
+class PngHeaderStage : public BodyStage {
+	unsigned char head[24];
+	size_t seen;
+	uint32_t width;
+	uint32_t height;
+public:
+	PngHeaderStage(BodyConsumer *next = 0)
+		: BodyStage(next),seen(0),width(0),height(0)
+	{
+	}
+	bool got_chunk(const char *data,size_t size) {
+		if( seen < sizeof(head) ) {
+			size_t n = sizeof(head) - seen < size ? sizeof(head) - seen : size;
+			memcpy(head + seen,data,n);
+			seen += n;
+			if( seen == sizeof(head) && !parse() )
+				return false;
+		}
+		return emit(data,size);
+	}
+	void got_reset() {
+		seen = 0;
+		width = height = 0;
+		BodyStage::got_reset();
+	}
+	// 0 until the header was read
+	uint32_t get_width() const { return width; }
+	uint32_t get_height() const { return height; }
+private:
+	bool parse() {
+		static const unsigned char kSignature[8] = { 0x89,'P','N','G','\r','\n',0x1a,'\n' };
+		if( memcmp(head,kSignature,8) || memcmp(head + 12,"IHDR",4) )
+			return false;
+		width = (uint32_t)head[16] << 24 | (uint32_t)head[17] << 16 | (uint32_t)head[18] << 8 | head[19];
+		height = (uint32_t)head[20] << 24 | (uint32_t)head[21] << 16 | (uint32_t)head[22] << 8 | head[23];
+		return true;
+	}
+};
+
+#endif /* !BODY_CONSUMER_H */
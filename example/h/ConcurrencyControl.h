@@ -0,0 +1,213 @@
+// Per-host and global concurrency limits adapted at runtime
+//-----------------------------------------------------------------------------
+
+#ifndef CONCURRENCY_CONTROL_H
+#define CONCURRENCY_CONTROL_H
+
+#include <string>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include "TimeUs.h"
+
+// AIMD controller for the number of parallel transfers. Every host has its
+// own limit, and so does the manager as a whole; both grow by about one
+// transfer per window of successful completions and are cut
+// multiplicatively on a congestion signal:
+//
+//  - an error (connect failure, timeout, 5xx) halves the limit,
+//  - a response time above kRttInflation times the best one seen (and at
+//    least kRttSlackMs above it, which also hides the frame-sized steps
+//    of a manager stepped once per frame), or a transfer rate below half
+//    of the running average, takes a quarter off. Rates are only sampled
+//    from bodies of kRateMinBytes or more; smaller ones mostly measure
+//    latency.
+//
+// Cuts are at most once per smoothed RTT, so a burst of failures from one
+// outage counts once. Every change remembers its reason.
+class ConcurrencyControl {
+public:
+	enum Reason {
+		kInitial,
+		kIncrease,   // completions came back healthy, probing for more
+		kErrors,     // transfers failed
+		kLatency,    // response time inflated, queues are building up
+		kThroughput, // transfer rate dropped, the link is saturated
+		kHostCut,    // global limit follows a cut on one of the hosts
+	};
+	static const char *reason_name(Reason r) {
+		switch( r ) {
+		case kInitial: return "initial";
+		case kIncrease: return "increase";
+		case kErrors: return "errors";
+		case kLatency: return "latency";
+		case kThroughput: return "throughput";
+		case kHostCut: return "host cut";
+		}
+		return "?";
+	}
+	struct Limit {
+		double value;       // fractional, floor(value) transfers may run
+		double max;
+		Reason reason;      // why value last changed
+		int64_t changed_at; // us
+		int64_t cut_at;     // last multiplicative decrease, us
+		Limit(double a_value,double a_max)
+			: value(a_value),max(a_max),reason(kInitial),changed_at(TimeUs()),cut_at(0)
+		{
+		}
+		size_t allowed() const { return value < 1 ? 1 : (size_t)value; }
+	};
+	struct Host {
+		Limit limit;
+		size_t active;
+		size_t completions;
+		size_t errors;
+		double rtt_min;     // seconds
+		double srtt;        // smoothed, seconds
+		double rate;        // smoothed bytes per second per transfer
+		double error_rate;  // smoothed share of failed transfers
+		Host(double initial,double max)
+			: limit(initial,max),active(0),completions(0),errors(0),
+			rtt_min(0),srtt(0),rate(0),error_rate(0)
+		{
+		}
+	};
+private:
+	std::map<std::string,Host> hosts;
+	Limit global;
+	size_t active;
+	double host_initial;
+	double host_max;
+
+	// Forbid copying
+	ConcurrencyControl(const ConcurrencyControl &);
+	ConcurrencyControl &operator=(const ConcurrencyControl &);
+public:
+	static const int kRttInflation = 2;
+	static const int kRttSlackMs = 50;
+	static const int kRateMinBytes = 16 * 1024;
+
+	ConcurrencyControl(size_t initial,size_t a_host_max,size_t global_max)
+		: global((double)initial,(double)global_max),active(0),
+		host_initial((double)initial),host_max((double)a_host_max)
+	{
+	}
+	void set_max(size_t a_host_max,size_t global_max) {
+		host_max = (double)a_host_max;
+		global.max = (double)global_max;
+		std::map<std::string,Host>::iterator e = hosts.end();
+		std::map<std::string,Host>::iterator i = hosts.begin();
+		for( ; i != e; i++ ) {
+			i->second.limit.max = host_max;
+			clamp(i->second.limit);
+		}
+		clamp(global);
+	}
+	bool can_start(const std::string &host) const {
+		if( active >= global.allowed() )
+			return false;
+		std::map<std::string,Host>::const_iterator f = hosts.find(host);
+		return f == hosts.end() || f->second.active < f->second.limit.allowed();
+	}
+	// Whether a hedge of a slow transfer may start. It only has to stay
+	// under the ceilings: the limits may have been cut by the very stalls
+	// it is there to get around.
+	bool can_hedge(const std::string &host) const {
+		if( active >= (size_t)global.max )
+			return false;
+		std::map<std::string,Host>::const_iterator f = hosts.find(host);
+		return f == hosts.end() || f->second.active < (size_t)f->second.limit.max;
+	}
+	bool global_full() const {
+		return active >= global.allowed();
+	}
+	void started(const std::string &host) {
+		host_of(host).active++;
+		active++;
+	}
+	// ok is false for transfers which failed in a way that hints at
+	// trouble on the path; canceled transfers should only be stopped().
+	// rtt is the time from request sent to first byte, seconds the whole
+	// transfer time.
+	void finished(const std::string &host,bool ok,double rtt,double bytes,double seconds) {
+		Host &h = host_of(host);
+		stopped(h);
+		h.completions++;
+		h.error_rate += ((ok ? 0.0 : 1.0) - h.error_rate) / 8;
+		if( !ok ) {
+			h.errors++;
+			cut(h,0.5,kErrors);
+			return;
+		}
+		if( rtt > 0 ) {
+			if( h.rtt_min <= 0 || rtt < h.rtt_min )
+				h.rtt_min = rtt;
+			h.srtt = h.srtt > 0 ? h.srtt + (rtt - h.srtt) / 8 : rtt;
+		}
+		double sample = seconds > 0 && bytes >= kRateMinBytes ? bytes / seconds : 0;
+		double average = h.rate;
+		if( sample > 0 )
+			h.rate = h.rate > 0 ? h.rate + (sample - h.rate) / 8 : sample;
+		if( h.rtt_min > 0 && rtt > kRttInflation * h.rtt_min && rtt > h.rtt_min + kRttSlackMs / 1000.0 ) {
+			cut(h,0.75,kLatency);
+		} else if( average > 0 && sample > 0 && sample < average / 2 && h.limit.value > 1 ) {
+			cut(h,0.75,kThroughput);
+		} else {
+			increase(h.limit);
+			increase(global);
+		}
+	}
+	// A transfer ended without telling anything about the path
+	void stopped(const std::string &host) {
+		stopped(host_of(host));
+	}
+	const Limit &get_global() const { return global; }
+	size_t get_active() const { return active; }
+	const std::map<std::string,Host> &get_hosts() const { return hosts; }
+private:
+	Host &host_of(const std::string &host) {
+		std::map<std::string,Host>::iterator f = hosts.find(host);
+		if( f == hosts.end() )
+			f = hosts.insert(std::make_pair(host,Host(host_initial,host_max))).first;
+		return f->second;
+	}
+	void stopped(Host &h) {
+		if( h.active )
+			h.active--;
+		if( active )
+			active--;
+	}
+	static void clamp(Limit &l) {
+		if( l.value > l.max )
+			l.value = l.max;
+		if( l.value < 1 )
+			l.value = 1;
+	}
+	// about +1 per window of limit completions
+	static void increase(Limit &l) {
+		if( l.value >= l.max )
+			return;
+		l.value += 1 / l.value;
+		clamp(l);
+		l.reason = kIncrease;
+		l.changed_at = TimeUs();
+	}
+	void cut(Host &h,double factor,Reason reason) {
+		int64_t now = TimeUs();
+		int64_t window = (int64_t)(h.srtt * 1000000);
+		if( h.limit.cut_at && now - h.limit.cut_at < window )
+			return;
+		apply_cut(h.limit,factor,reason,now);
+		apply_cut(global,factor > 0.75 ? factor : 0.75,kHostCut,now);
+	}
+	static void apply_cut(Limit &l,double factor,Reason reason,int64_t now) {
+		l.value *= factor;
+		clamp(l);
+		l.reason = reason;
+		l.changed_at = now;
+		l.cut_at = now;
+	}
+};
+
+#endif /* !CONCURRENCY_CONTROL_H */
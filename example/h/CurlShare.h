@@ -0,0 +1,135 @@
+// Share handle for easy handles running on several threads
+//-----------------------------------------------------------------------------
+
+#ifndef CURL_SHARE_H
+#define CURL_SHARE_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "Atomic.h"
+#include "TimeUs.h"
+
+// Shares the DNS and cookie caches between every transfer of the request
+// manager, whichever thread runs it. Each kind of shared data has its own
+// reader/writer lock, so a DNS lookup never waits for a cookie update and
+// libcurl's CURL_LOCK_ACCESS_SHARED requests can run side by side.
+//
+// Every lock first tries without blocking; when that fails the lock counts
+// as contended and the time spent blocked is added up, which tells whether
+// sharing saves more than it costs.
+//
+// A lock which cannot be taken at all is a bug, and libcurl would go on
+// to touch the shared data unguarded, so it aborts like a failed assert.
+class CurlShare {
+public:
+	struct Stats {
+		volatile long locks;
+		volatile long contended;
+		volatile long wait_us;     // total time blocked
+		volatile long max_wait_us;
+	};
+private:
+	CURLSH *curlsh;
+	pthread_rwlock_t locks[CURL_LOCK_DATA_LAST];
+	Stats stats[CURL_LOCK_DATA_LAST];
+
+	// Forbid copying
+	CurlShare(const CurlShare &);
+	CurlShare &operator=(const CurlShare &);
+public:
+	CurlShare()
+		: curlsh(0)
+	{
+		for( int i = 0; i < CURL_LOCK_DATA_LAST; i++ ) {
+			pthread_rwlock_init(&locks[i],0);
+			Stats s = { 0,0,0,0 };
+			stats[i] = s;
+		}
+	}
+	~CurlShare()
+	{
+		cleanup();
+		for( int i = 0; i < CURL_LOCK_DATA_LAST; i++ )
+			pthread_rwlock_destroy(&locks[i]);
+	}
+	CURLSH *init() {
+		if( curlsh )
+			return curlsh;
+		curlsh = curl_share_init();
+		if( !curlsh )
+			return 0;
+		curl_share_setopt(curlsh,CURLSHOPT_LOCKFUNC,CurlShare::Lock);
+		curl_share_setopt(curlsh,CURLSHOPT_UNLOCKFUNC,CurlShare::Unlock);
+		curl_share_setopt(curlsh,CURLSHOPT_USERDATA,(void *)this);
+		curl_share_setopt(curlsh,CURLSHOPT_SHARE,CURL_LOCK_DATA_COOKIE);
+		curl_share_setopt(curlsh,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+		return curlsh;
+	}
+	// Every easy handle using the share must have been cleaned up before
+	void cleanup() {
+		if( curlsh )
+			curl_share_cleanup(curlsh);
+		curlsh = 0;
+	}
+	CURLSH *get() const { return curlsh; }
+	const Stats &get_stats(curl_lock_data data) const { return stats[data]; }
+	// Share of the locks of data which had to wait, 0..1
+	double contention(curl_lock_data data) const {
+		long n = AtomicGet((volatile long *)&stats[data].locks);
+		return n ? (double)AtomicGet((volatile long *)&stats[data].contended) / n : 0.0;
+	}
+	static const char *data_name(curl_lock_data data) {
+		switch( data ) {
+		case CURL_LOCK_DATA_SHARE: return "share";
+		case CURL_LOCK_DATA_COOKIE: return "cookie";
+		case CURL_LOCK_DATA_DNS: return "dns";
+		case CURL_LOCK_DATA_SSL_SESSION: return "ssl session";
+		case CURL_LOCK_DATA_CONNECT: return "connect";
+		default: break;
+		}
+		return "?";
+	}
+private:
+	static void Lock(CURL *handle,curl_lock_data data,curl_lock_access access,void *userptr)
+	{
+		((CurlShare *)userptr)->lock(data,access);
+	}
+	static void Unlock(CURL *handle,curl_lock_data data,void *userptr)
+	{
+		((CurlShare *)userptr)->unlock(data);
+	}
+	void lock(curl_lock_data data,curl_lock_access access) {
+		if( data < 0 || data >= CURL_LOCK_DATA_LAST )
+			return;
+		pthread_rwlock_t *l = &locks[data];
+		Stats &s = stats[data];
+		bool shared = access == CURL_LOCK_ACCESS_SHARED;
+		AtomicAdd(&s.locks,1);
+		int err = shared ? pthread_rwlock_tryrdlock(l) : pthread_rwlock_trywrlock(l);
+		if( err == 0 )
+			return;
+		int64_t begin = TimeUs();
+		if( err == EBUSY )
+			err = shared ? pthread_rwlock_rdlock(l) : pthread_rwlock_wrlock(l);
+		if( err != 0 ) {
+			printf("CURL SHARE: CAN'T TAKE THE %s LOCK (%d)\n",data_name(data),err);
+			abort();
+		}
+		long us = (long)(TimeUs() - begin);
+		AtomicAdd(&s.contended,1);
+		AtomicAdd(&s.wait_us,us);
+		long max = AtomicGet(&s.max_wait_us);
+		while( us > max && !AtomicCas(&s.max_wait_us,max,us) )
+			max = AtomicGet(&s.max_wait_us);
+	}
+	void unlock(curl_lock_data data) {
+		if( data < 0 || data >= CURL_LOCK_DATA_LAST )
+			return;
+		pthread_rwlock_unlock(&locks[data]);
+	}
+};
+
+#endif /* !CURL_SHARE_H */
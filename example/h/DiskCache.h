@@ -0,0 +1,526 @@
+// Persistent HTTP cache with conditional revalidation
+//-----------------------------------------------------------------------------
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <curl/curl.h>
+
+// Caching headers of one response. Fed with raw header lines from the
+// curl header callback; a status line starts a new response, so only the
+// headers of the last hop of a redirect chain are kept.
+struct CacheMeta {
+	std::string etag;
+	std::string last_modified;
+	long stored_at;  // seconds since the epoch
+	long max_age;    // seconds the response stays fresh after stored_at
+	bool no_store;
+	bool no_cache;
+	long date;
+	long expires;
+	bool have_max_age;
+
+	CacheMeta()
+	{
+		reset();
+	}
+	void reset() {
+		etag = "";
+		last_modified = "";
+		stored_at = (long)time(0);
+		max_age = 0;
+		no_store = false;
+		no_cache = false;
+		date = -1;
+		expires = -1;
+		have_max_age = false;
+	}
+	void parse_header(const char *ptr,size_t size) {
+		while( size && (ptr[size - 1] == '\r' || ptr[size - 1] == '\n') )
+			size--;
+		std::string value;
+		if( size >= 5 && !memcmp(ptr,"HTTP/",5) ) {
+			reset();
+		} else if( header_value(ptr,size,"ETag",&value) ) {
+			etag = value;
+		} else if( header_value(ptr,size,"Last-Modified",&value) ) {
+			last_modified = value;
+		} else if( header_value(ptr,size,"Date",&value) ) {
+			date = (long)curl_getdate(value.c_str(),0);
+		} else if( header_value(ptr,size,"Expires",&value) ) {
+			expires = (long)curl_getdate(value.c_str(),0);
+		} else if( header_value(ptr,size,"Cache-Control",&value) ) {
+			parse_cache_control(value);
+		} else if( header_value(ptr,size,"Pragma",&value) ) {
+			if( value.find("no-cache") != std::string::npos )
+				no_cache = true;
+		}
+	}
+	// Resolves the freshness lifetime once all headers are in: max-age,
+	// then Expires - Date, then 10% of the age of Last-Modified
+	void finish() {
+		stored_at = (long)time(0);
+		if( no_cache ) {
+			// always revalidate, also after a reload from disk
+			max_age = 0;
+			return;
+		}
+		if( have_max_age )
+			return;
+		long now = date > 0 ? date : stored_at;
+		if( expires >= 0 ) {
+			max_age = expires > now ? expires - now : 0;
+		} else if( last_modified.size() ) {
+			long lm = (long)curl_getdate(last_modified.c_str(),0);
+			max_age = lm > 0 && lm < now ? (now - lm) / 10 : 0;
+		}
+	}
+	bool fresh(long now) const {
+		return !no_cache && now - stored_at < max_age;
+	}
+	bool has_validators() const {
+		return etag.size() || last_modified.size();
+	}
+	// Adds If-None-Match/If-Modified-Since for a conditional request
+	curl_slist *append_conditions(curl_slist *headers) const {
+		if( etag.size() )
+			headers = curl_slist_append(headers,("If-None-Match: " + etag).c_str());
+		if( last_modified.size() )
+			headers = curl_slist_append(headers,("If-Modified-Since: " + last_modified).c_str());
+		return headers;
+	}
+	// Value of the header line when it is name's, without leading blanks
+	static bool header_value(const char *ptr,size_t size,const char *name,std::string *value) {
+		size_t n = strlen(name);
+		if( size <= n || ptr[n] != ':' )
+			return false;
+		for( size_t i = 0; i < n; i++ ) {
+			if( tolower((unsigned char)ptr[i]) != tolower((unsigned char)name[i]) )
+				return false;
+		}
+		size_t b = n + 1;
+		while( b < size && (ptr[b] == ' ' || ptr[b] == '\t') )
+			b++;
+		*value = std::string(ptr + b,size - b);
+		return true;
+	}
+private:
+	void parse_cache_control(const std::string &v) {
+		if( v.find("no-store") != std::string::npos )
+			no_store = true;
+		if( v.find("no-cache") != std::string::npos )
+			no_cache = true;
+		size_t p = v.find("max-age=");
+		if( p != std::string::npos ) {
+			max_age = atol(v.c_str() + p + sizeof("max-age=") - 1);
+			have_max_age = true;
+		}
+	}
+};
+
+// Response bodies and their caching headers kept across sessions in two
+// files: <prefix>.dat is an append-only log of records, each holding the
+// URL, the validators and the body, and <prefix>.idx is a compact index of
+// the live records written on flush(). If the index is missing or does not
+// match the log it is rebuilt by scanning the log. Updated metadata after
+// a revalidation only touches the index. Once the log outgrows the byte
+// budget the oldest entries are dropped and the log is rewritten.
+//
+// All numbers are stored little-endian as 32 bit values.
+class DiskCache {
+public:
+	enum Lookup {
+		kMiss,
+		kFresh,
+		kStale,
+	};
+private:
+	struct Entry {
+		unsigned long offset;    // of the record in the log
+		unsigned long body_offset;
+		unsigned long body_len;
+		unsigned long record_len; // as written, which a refresh does not change
+		CacheMeta meta;
+	};
+	std::map<std::string,Entry> index;
+	std::string data_path;
+	std::string index_path;
+	FILE *data;
+	unsigned long data_size;
+	unsigned long live_bytes;
+	size_t max_bytes;
+	bool dirty;
+	size_t fresh_hits;
+	size_t revalidated;
+	size_t misses;
+
+	// Forbid copying
+	DiskCache(const DiskCache &);
+	DiskCache &operator=(const DiskCache &);
+public:
+	DiskCache(const char *prefix,size_t a_max_bytes)
+		: data_path(std::string(prefix) + ".dat"),index_path(std::string(prefix) + ".idx"),
+		data(0),data_size(0),live_bytes(0),max_bytes(a_max_bytes),dirty(false),
+		fresh_hits(0),revalidated(0),misses(0)
+	{
+	}
+	virtual ~DiskCache() {
+		close();
+	}
+	bool open() {
+		if( data )
+			return true;
+		data = fopen(data_path.c_str(),"r+b");
+		if( !data )
+			data = fopen(data_path.c_str(),"w+b");
+		if( !data ) {
+			printf("DISK CACHE: CAN'T OPEN %s\n",data_path.c_str());
+			return false;
+		}
+		fseek(data,0,SEEK_END);
+		data_size = (unsigned long)ftell(data);
+		if( !load_index() )
+			rebuild_index();
+		return true;
+	}
+	void close() {
+		if( !data )
+			return;
+		flush();
+		fclose(data);
+		data = 0;
+		index.clear();
+	}
+	bool is_open() const { return data != 0; }
+	Lookup lookup(const std::string &url,CacheMeta *meta) {
+		std::map<std::string,Entry>::iterator f = index.find(url);
+		if( f == index.end() ) {
+			misses++;
+			return kMiss;
+		}
+		if( meta )
+			*meta = f->second.meta;
+		return f->second.meta.fresh((long)time(0)) ? kFresh : kStale;
+	}
+	bool read(const std::string &url,std::string *body) {
+		std::map<std::string,Entry>::iterator f = index.find(url);
+		if( !data || f == index.end() )
+			return false;
+		body->resize(f->second.body_len);
+		if( f->second.body_len == 0 )
+			return true;
+		if( fseek(data,f->second.body_offset,SEEK_SET) != 0 ||
+			fread(&(*body)[0],1,f->second.body_len,data) != f->second.body_len ) {
+			printf("DISK CACHE: SHORT READ FOR %s\n",url.c_str());
+			erase(url);
+			return false;
+		}
+		return true;
+	}
+	// Called for a fresh hit served straight from disk
+	void got_fresh_hit() {
+		fresh_hits++;
+	}
+	bool put(const std::string &url,const CacheMeta &meta,const std::string &body) {
+		if( !data || meta.no_store || body.size() > max_bytes / 4 )
+			return false;
+		erase(url);
+		Entry e;
+		e.meta = meta;
+		if( !append_record(url,e.meta,body,&e) )
+			return false;
+		index[url] = e;
+		live_bytes += e.record_len;
+		dirty = true;
+		if( data_size > max_bytes )
+			compact();
+		return true;
+	}
+	// A 304 came back: keep the body, take the new caching headers
+	bool refresh(const std::string &url,const CacheMeta &meta) {
+		std::map<std::string,Entry>::iterator f = index.find(url);
+		if( f == index.end() )
+			return false;
+		CacheMeta m = meta;
+		// a 304 need not repeat the validators
+		if( !m.etag.size() )
+			m.etag = f->second.meta.etag;
+		if( !m.last_modified.size() )
+			m.last_modified = f->second.meta.last_modified;
+		f->second.meta = m;
+		dirty = true;
+		revalidated++;
+		return true;
+	}
+	bool erase(const std::string &url) {
+		std::map<std::string,Entry>::iterator f = index.find(url);
+		if( f == index.end() )
+			return false;
+		live_bytes -= f->second.record_len;
+		index.erase(f);
+		dirty = true;
+		return true;
+	}
+	void flush() {
+		if( !data || !dirty )
+			return;
+		fflush(data);
+		write_index();
+		dirty = false;
+	}
+	size_t get_entries() const { return index.size(); }
+	unsigned long get_data_size() const { return data_size; }
+	unsigned long get_live_bytes() const { return live_bytes; }
+	size_t get_fresh_hits() const { return fresh_hits; }
+	size_t get_revalidated() const { return revalidated; }
+	size_t get_misses() const { return misses; }
+private:
+	static const unsigned long kRecordMagic = 0x31524354; // "TCR1"
+	static const unsigned long kIndexMagic = 0x31494354;  // "TCI1"
+	static const unsigned long kRecordHeader = 4 * 7;
+
+	static void put32(std::string &out,unsigned long v) {
+		char b[4] = { (char)(v & 0xff),(char)((v >> 8) & 0xff),(char)((v >> 16) & 0xff),(char)((v >> 24) & 0xff) };
+		out.append(b,4);
+	}
+	static bool get32(FILE *f,unsigned long *v) {
+		unsigned char b[4];
+		if( fread(b,1,4,f) != 4 )
+			return false;
+		*v = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned long)b[3] << 24);
+		return true;
+	}
+	static bool get_string(FILE *f,unsigned long n,std::string *s) {
+		s->resize(n);
+		return n == 0 || fread(&(*s)[0],1,n,f) == n;
+	}
+	// record: magic, url, etag, last-modified and body lengths, stored_at,
+	// max_age, then the four byte strings
+	bool append_record(const std::string &url,const CacheMeta &m,const std::string &body,Entry *e) {
+		std::string head;
+		put32(head,kRecordMagic);
+		put32(head,url.size());
+		put32(head,m.etag.size());
+		put32(head,m.last_modified.size());
+		put32(head,body.size());
+		put32(head,m.stored_at);
+		put32(head,m.max_age);
+		head += url;
+		head += m.etag;
+		head += m.last_modified;
+		if( fseek(data,data_size,SEEK_SET) != 0 ||
+			fwrite(head.data(),1,head.size(),data) != head.size() ||
+			fwrite(body.data(),1,body.size(),data) != body.size() ) {
+			printf("DISK CACHE: WRITE FAILED FOR %s\n",url.c_str());
+			return false;
+		}
+		e->offset = data_size;
+		e->body_offset = data_size + head.size();
+		e->body_len = body.size();
+		e->record_len = head.size() + body.size();
+		data_size += e->record_len;
+		return true;
+	}
+	bool read_record(unsigned long offset,std::string *url,Entry *e) {
+		unsigned long magic,url_len,etag_len,lm_len,body_len,stored_at,max_age;
+		if( fseek(data,offset,SEEK_SET) != 0 ||
+			!get32(data,&magic) || magic != kRecordMagic ||
+			!get32(data,&url_len) || !get32(data,&etag_len) ||
+			!get32(data,&lm_len) || !get32(data,&body_len) ||
+			!get32(data,&stored_at) || !get32(data,&max_age) )
+			return false;
+		unsigned long body_offset = offset + kRecordHeader + url_len + etag_len + lm_len;
+		if( body_offset + body_len > data_size )
+			return false;
+		e->meta.reset();
+		if( !get_string(data,url_len,url) ||
+			!get_string(data,etag_len,&e->meta.etag) ||
+			!get_string(data,lm_len,&e->meta.last_modified) )
+			return false;
+		e->meta.stored_at = (long)stored_at;
+		e->meta.max_age = (long)max_age;
+		e->offset = offset;
+		e->body_offset = body_offset;
+		e->body_len = body_len;
+		e->record_len = body_offset + body_len - offset;
+		return true;
+	}
+	// Later records for the same URL win; a torn record at the end of the
+	// log is cut off
+	void rebuild_index() {
+		index.clear();
+		live_bytes = 0;
+		unsigned long offset = 0;
+		while( offset < data_size ) {
+			std::string url;
+			Entry e;
+			if( !read_record(offset,&url,&e) ) {
+				printf("DISK CACHE: LOG DAMAGED AT %lu, TRUNCATING\n",offset);
+				data_size = offset;
+				break;
+			}
+			erase(url);
+			index[url] = e;
+			live_bytes += e.record_len;
+			offset = e.body_offset + e.body_len;
+		}
+		dirty = true;
+	}
+	// index: magic, log size, entry count, then per entry the record and
+	// body positions, stored_at, max_age and the three strings
+	void write_index() {
+		std::string out;
+		put32(out,kIndexMagic);
+		put32(out,data_size);
+		put32(out,index.size());
+		std::map<std::string,Entry>::const_iterator e = index.end();
+		std::map<std::string,Entry>::const_iterator i = index.begin();
+		for( ; i != e; i++ ) {
+			const CacheMeta &m = i->second.meta;
+			put32(out,i->second.offset);
+			put32(out,i->second.body_offset);
+			put32(out,i->second.body_len);
+			put32(out,m.stored_at);
+			put32(out,m.max_age);
+			put32(out,i->first.size());
+			put32(out,m.etag.size());
+			put32(out,m.last_modified.size());
+			out += i->first;
+			out += m.etag;
+			out += m.last_modified;
+		}
+		std::string tmp = index_path + ".tmp";
+		FILE *f = fopen(tmp.c_str(),"wb");
+		if( !f )
+			return;
+		bool ok = fwrite(out.data(),1,out.size(),f) == out.size();
+		fclose(f);
+		remove(index_path.c_str());
+		if( !ok || rename(tmp.c_str(),index_path.c_str()) != 0 )
+			printf("DISK CACHE: CAN'T WRITE %s\n",index_path.c_str());
+	}
+	bool load_index() {
+		FILE *f = fopen(index_path.c_str(),"rb");
+		if( !f )
+			return false;
+		unsigned long magic,size,count;
+		bool ok = get32(f,&magic) && magic == kIndexMagic &&
+			get32(f,&size) && size == data_size && get32(f,&count);
+		index.clear();
+		live_bytes = 0;
+		for( unsigned long n = 0; ok && n < count; n++ ) {
+			unsigned long stored_at,max_age,url_len,etag_len,lm_len;
+			std::string url;
+			Entry e;
+			ok = get32(f,&e.offset) && get32(f,&e.body_offset) && get32(f,&e.body_len) &&
+				get32(f,&stored_at) && get32(f,&max_age) &&
+				get32(f,&url_len) && get32(f,&etag_len) && get32(f,&lm_len) &&
+				get_string(f,url_len,&url) &&
+				get_string(f,etag_len,&e.meta.etag) &&
+				get_string(f,lm_len,&e.meta.last_modified) &&
+				e.body_offset >= e.offset + kRecordHeader &&
+				e.body_offset + e.body_len <= data_size;
+			if( !ok )
+				break;
+			e.record_len = e.body_offset + e.body_len - e.offset;
+			e.meta.stored_at = (long)stored_at;
+			e.meta.max_age = (long)max_age;
+			index[url] = e;
+			live_bytes += e.record_len;
+		}
+		fclose(f);
+		if( !ok ) {
+			printf("DISK CACHE: INDEX %s STALE, REBUILDING\n",index_path.c_str());
+			index.clear();
+		}
+		return ok;
+	}
+	struct Age {
+		long stored_at;
+		unsigned long offset; // written later means newer within a second
+		std::string url;
+		bool operator<(const Age &a) const {
+			if( stored_at != a.stored_at )
+				return stored_at < a.stored_at;
+			return offset < a.offset;
+		}
+	};
+	// Drops the oldest entries down to 3/4 of the budget and rewrites the
+	// log with only the live records
+	void compact() {
+		std::vector<Age> ages;
+		std::map<std::string,Entry>::iterator e = index.end();
+		std::map<std::string,Entry>::iterator i = index.begin();
+		for( ; i != e; i++ ) {
+			Age a = { i->second.meta.stored_at,i->second.offset,i->first };
+			ages.push_back(a);
+		}
+		std::sort(ages.begin(),ages.end());
+		for( size_t n = 0; n < ages.size() && live_bytes > max_bytes / 4 * 3; n++ )
+			erase(ages[n].url);
+
+		std::string tmp = data_path + ".tmp";
+		FILE *out = fopen(tmp.c_str(),"w+b");
+		if( !out )
+			return;
+		FILE *in = data;
+		data = out;
+		unsigned long in_size = data_size;
+		data_size = 0;
+		bool ok = true;
+		// oldest first, so the log order keeps telling the age apart
+		for( size_t n = 0; ok && n < ages.size(); n++ ) {
+			i = index.find(ages[n].url);
+			if( i == e )
+				continue;
+			std::string body(i->second.body_len,'\0');
+			ok = fseek(in,i->second.body_offset,SEEK_SET) == 0 &&
+				(body.empty() || fread(&body[0],1,body.size(),in) == body.size()) &&
+				append_record(i->first,i->second.meta,body,&i->second);
+		}
+		if( !ok ) {
+			printf("DISK CACHE: COMPACTION FAILED\n");
+			fclose(out);
+			remove(tmp.c_str());
+			data = in;
+			data_size = in_size;
+			rebuild_index();
+			return;
+		}
+		fclose(in);
+		fclose(out);
+		data = 0;
+		bool moved = remove(data_path.c_str()) == 0 && rename(tmp.c_str(),data_path.c_str()) == 0;
+		data = fopen(data_path.c_str(),"r+b");
+		if( !data ) {
+			// the old log is gone and the new one could not take its place
+			printf("DISK CACHE: CAN'T REOPEN %s AFTER COMPACTION, CLOSING\n",data_path.c_str());
+			index.clear();
+			live_bytes = 0;
+			data_size = 0;
+			dirty = false;
+			return;
+		}
+		if( !moved ) {
+			// the old log is still there; the index points into the new one
+			printf("DISK CACHE: CAN'T REPLACE %s AFTER COMPACTION, REBUILDING\n",data_path.c_str());
+			remove(tmp.c_str());
+			fseek(data,0,SEEK_END);
+			data_size = (unsigned long)ftell(data);
+			rebuild_index();
+		}
+		dirty = true;
+		flush();
+	}
+};
+
+#endif /* !DISK_CACHE_H */
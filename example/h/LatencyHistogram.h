@@ -0,0 +1,99 @@
+// Log-linear latency histogram with percentiles
+//-----------------------------------------------------------------------------
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Microsecond values bucketed the way HdrHistogram does it: exact below
+// 2^kSubBits, and above that every power of two is split into 2^(kSubBits-1)
+// equal buckets, so any value is known to within about 3%. Recording is
+// a few shifts and an increment, and the fixed array of counters (under
+// 2 KB) covers up to kMaxUs, which is far beyond any timeout used here.
+class LatencyHistogram {
+public:
+	static const int kSubBits = 5;
+	static const int kMaxBits = 31;
+	static const int64_t kMaxUs = ((int64_t)1 << kMaxBits) - 1; // about 35 minutes
+private:
+	static const int kSub = 1 << kSubBits;
+	static const int kHalf = kSub / 2;
+	static const int kBuckets = kSub + (kMaxBits - kSubBits) * kHalf;
+	uint32_t counts[kBuckets];
+	uint32_t total;
+	int64_t min_us;
+	int64_t max_us;
+	int64_t sum_us;
+public:
+	LatencyHistogram()
+	{
+		clear();
+	}
+	void clear() {
+		memset(counts,0,sizeof(counts));
+		total = 0;
+		min_us = 0;
+		max_us = 0;
+		sum_us = 0;
+	}
+	void record(int64_t us) {
+		if( us < 0 )
+			us = 0;
+		if( us > kMaxUs )
+			us = kMaxUs;
+		counts[index_of(us)]++;
+		if( !total || us < min_us )
+			min_us = us;
+		if( us > max_us )
+			max_us = us;
+		sum_us += us;
+		total++;
+	}
+	size_t count() const { return total; }
+	int64_t min() const { return min_us; }
+	int64_t max() const { return max_us; }
+	int64_t mean() const { return total ? sum_us / total : 0; }
+	// Value below which share p (0..1) of the recorded values fall, as the
+	// middle of its bucket; 0 when nothing was recorded
+	int64_t percentile(double p) const {
+		if( !total )
+			return 0;
+		uint32_t rank = (uint32_t)(p * total + 0.5);
+		if( rank < 1 )
+			rank = 1;
+		if( rank > total )
+			rank = total;
+		uint32_t seen = 0;
+		for( int i = 0; i < kBuckets; i++ ) {
+			seen += counts[i];
+			if( seen >= rank ) {
+				int64_t v = value_of(i);
+				return v < min_us ? min_us : v > max_us ? max_us : v;
+			}
+		}
+		return max_us;
+	}
+private:
+	static int index_of(int64_t us) {
+		if( us < kSub )
+			return (int)us;
+		int msb = 0;
+		for( int64_t v = us; v > 1; v >>= 1 )
+			msb++;
+		int shift = msb - (kSubBits - 1);
+		int top = (int)(us >> shift);
+		return kSub + (shift - 1) * kHalf + (top - kHalf);
+	}
+	static int64_t value_of(int i) {
+		if( i < kSub )
+			return i;
+		int shift = (i - kSub) / kHalf + 1;
+		int64_t top = kHalf + (i - kSub) % kHalf;
+		return (top << shift) + ((int64_t)1 << shift) / 2;
+	}
+};
+
+#endif /* !LATENCY_HISTOGRAM_H */
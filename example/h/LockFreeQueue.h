@@ -0,0 +1,118 @@
+// Lock-free queues between the game thread and the network thread
+//-----------------------------------------------------------------------------
+
+#ifndef LOCK_FREE_QUEUE_H
+#define LOCK_FREE_QUEUE_H
+
+#include <vector>
+#include <stddef.h>
+#include "Atomic.h"
+
+// Bounded ring for exactly one producer thread and one consumer thread. The
+// producer only writes tail and the consumer only writes head, so neither
+// side ever waits for the other; push() fails when the ring is full. T is
+// copied in and out and should be small.
+template<class T>
+class SpscQueue {
+	std::vector<T> ring;
+	unsigned long mask;
+	volatile long head; // next slot to pop, written by the consumer
+	volatile long tail; // next slot to push, written by the producer
+
+	// Forbid copying
+	SpscQueue(const SpscQueue &);
+	SpscQueue &operator=(const SpscQueue &);
+public:
+	// capacity is rounded up to a power of two
+	SpscQueue(size_t capacity)
+		: head(0),tail(0)
+	{
+		size_t n = 1;
+		while( n < capacity )
+			n *= 2;
+		ring.resize(n);
+		mask = n - 1;
+	}
+	// Producer side
+	bool push(const T &v) {
+		unsigned long t = (unsigned long)AtomicGet(&tail);
+		unsigned long h = (unsigned long)AtomicGet(&head);
+		if( t - h > mask )
+			return false;
+		ring[t & mask] = v;
+		AtomicSet(&tail,(long)(t + 1));
+		return true;
+	}
+	// Consumer side
+	bool pop(T *v) {
+		unsigned long h = (unsigned long)AtomicGet(&head);
+		unsigned long t = (unsigned long)AtomicGet(&tail);
+		if( h == t )
+			return false;
+		*v = ring[h & mask];
+		AtomicSet(&head,(long)(h + 1));
+		return true;
+	}
+	// Approximate when called from neither side
+	size_t size() const {
+		unsigned long t = (unsigned long)AtomicGet((volatile long *)&tail);
+		unsigned long h = (unsigned long)AtomicGet((volatile long *)&head);
+		return (size_t)(t - h);
+	}
+	size_t capacity() const { return ring.size(); }
+};
+
+// Unbounded queue for any number of producer threads and one consumer
+// (Vyukov's intrusive MPSC queue with a stub node). push() is a single
+// atomic exchange and never fails. A push which has exchanged the head but
+// not yet linked its node is not visible to pop() for that moment, so pop()
+// may report empty while an item is on its way; the consumer picks it up on
+// its next poll.
+template<class T>
+class MpscQueue {
+	struct Node {
+		Node *volatile next;
+		T value;
+	};
+	Node *volatile head; // last pushed node, exchanged by the producers
+	Node *tail;          // stub, owned by the consumer
+
+	// Forbid copying
+	MpscQueue(const MpscQueue &);
+	MpscQueue &operator=(const MpscQueue &);
+public:
+	MpscQueue()
+	{
+		Node *stub = new Node();
+		stub->next = 0;
+		head = tail = stub;
+	}
+	~MpscQueue()
+	{
+		T v;
+		while( pop(&v) )
+			;
+		delete tail;
+	}
+	// Any thread
+	void push(const T &v) {
+		Node *n = new Node();
+		n->next = 0;
+		n->value = v;
+		Node *prev = (Node *)AtomicSwapPtr((void *volatile *)&head,n);
+		AtomicSetPtr((void *volatile *)&prev->next,n);
+	}
+	// Consumer side. The popped node becomes the new stub.
+	bool pop(T *v) {
+		Node *stub = tail;
+		Node *next = (Node *)AtomicGetPtr((void *volatile *)&stub->next);
+		if( !next )
+			return false;
+		*v = next->value;
+		tail = next;
+		delete stub;
+		return true;
+	}
+};
+
+#endif /* !LOCK_FREE_QUEUE_H */
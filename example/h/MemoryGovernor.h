@@ -0,0 +1,101 @@
+// Budget of the bytes held in response bodies across all requests
+//-----------------------------------------------------------------------------
+
+#ifndef MEMORY_GOVERNOR_H
+#define MEMORY_GOVERNOR_H
+
+#include <string>
+#include <stdio.h>
+#include <stddef.h>
+#include "Atomic.h"
+
+// Counts the body bytes all requests hold, from the first byte of a
+// transfer until the request is cleaned or its body spilled, and the
+// partial bodies kept to continue later, and tells when that is too much. Network threads add to the count from the write
+// callbacks, so it is atomic.
+//
+// Past the high-water mark, write callbacks pause their transfers with
+// CURL_WRITEFUNC_PAUSE: libcurl keeps the chunk it offered and reads no
+// more from the socket, so the server is held back by TCP. The paused
+// transfers go on once the consumers have cleaned enough requests to get
+// under the low-water mark. One transfer at a time is exempt and keeps
+// going, so partial bodies alone can never pause everything for good.
+//
+// With a spill directory, finished bodies past the high-water mark are
+// written to files there instead, largest first, until the count is
+// under the low-water mark again, and transfers only pause if that is not
+// enough. A spilled body is read back when asked for.
+//
+// A high-water mark of 0, the default, only counts.
+class MemoryGovernor {
+	long high_water;         // bytes
+	long low_water;
+	volatile long buffered;  // bytes of the bodies held
+	volatile long peak;
+	size_t holds;            // transfers paused by their write callback
+	size_t spills;
+	size_t spilled_bytes;
+	std::string spill_dir;
+	unsigned long next_spill;
+
+	// Forbid copying
+	MemoryGovernor(const MemoryGovernor &);
+	MemoryGovernor &operator=(const MemoryGovernor &);
+public:
+	MemoryGovernor()
+		: high_water(0),low_water(0),buffered(0),peak(0),holds(0),spills(0),spilled_bytes(0),next_spill(0)
+	{
+	}
+	// low is where paused transfers resume, half of high when 0
+	void set_limits(size_t high,size_t low = 0) {
+		high_water = (long)high;
+		low_water = (long)(low && low < high ? low : high / 2);
+	}
+	// Directory spilled bodies go to, empty to never spill
+	void set_spill_dir(const std::string &dir) {
+		spill_dir = dir;
+	}
+	const std::string &get_spill_dir() const { return spill_dir; }
+	// A request took or gave back delta bytes; any thread
+	void charge(long delta) {
+		long now = AtomicAdd(&buffered,delta);
+		long seen = AtomicGet(&peak);
+		while( now > seen && !AtomicCas(&peak,seen,now) )
+			seen = AtomicGet(&peak);
+	}
+	// Whether a write callback has to pause its transfer; any thread
+	bool over_high() const {
+		return high_water && AtomicGet((volatile long *)&buffered) > high_water;
+	}
+	bool over_low() const {
+		return high_water && AtomicGet((volatile long *)&buffered) > low_water;
+	}
+	// Bytes to spill to get under the low-water mark
+	long excess() const {
+		long b = AtomicGet((volatile long *)&buffered);
+		return high_water && b > high_water ? b - low_water : 0;
+	}
+	// Path for the next spilled body, empty without a spill directory
+	std::string spill_path() {
+		if( spill_dir.empty() )
+			return "";
+		char name[32];
+		snprintf(name,sizeof(name),"/spill-%lu.tmp",next_spill++);
+		return spill_dir + name;
+	}
+	void got_hold() {
+		holds++;
+	}
+	void got_spill(size_t bytes) {
+		spills++;
+		spilled_bytes += bytes;
+	}
+	size_t get_buffered() const { return (size_t)AtomicGet((volatile long *)&buffered); }
+	size_t get_peak() const { return (size_t)AtomicGet((volatile long *)&peak); }
+	size_t get_high_water() const { return (size_t)high_water; }
+	size_t get_holds() const { return holds; }
+	size_t get_spills() const { return spills; }
+	size_t get_spilled_bytes() const { return spilled_bytes; }
+};
+
+#endif /* !MEMORY_GOVERNOR_H */
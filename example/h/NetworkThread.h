@@ -0,0 +1,431 @@
+// Worker thread which drives a multi handle for the request manager
+//-----------------------------------------------------------------------------
+
+#ifndef NETWORK_THREAD_H
+#define NETWORK_THREAD_H
+
+#include <set>
+#include <list>
+#include <deque>
+#include <vector>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include "Atomic.h"
+#include "LockFreeQueue.h"
+#include "BandwidthScheduler.h"
+
+// Owns a multi handle and runs curl_multi_perform() on its own thread, so
+// slow callbacks and large bodies no longer eat into the frame. The owner
+// prepares easy handles and hands them over with submit(); from then on
+// only the worker touches them until they come back through poll(). Every
+// submitted handle comes back exactly once: with its result when the
+// transfer ends, or with CURLE_ABORTED_BY_CALLBACK after remove().
+//
+// Submissions and removals go through an MPSC queue, so any thread may
+// submit; completions come back through an SPSC ring which only the owner
+// drains. When the ring is full, the worker holds the completions back
+// until the owner catches up.
+//
+// Several workers can share the load as shards, each with its own multi
+// handle and so its own connection cache. A shard with a limit on running
+// transfers keeps the handles beyond it in a backlog, and a shard with
+// free slots and nothing of its own to do takes from the back of the
+// fullest backlog among its peers. The backlog is the only thing behind a
+// lock; it is touched once per submission and by the occasional steal.
+//
+// A command wakes the worker out of select() through a self-pipe, so a
+// submission starts right away instead of at the next poll. The pipe is
+// written only when the worker was not already woken, so a burst of
+// submissions costs one write. A shard which leaves submissions in its
+// backlog wakes its peers to steal them, so an idle worker only looks
+// around every kIdlePollMs. A worker holding completions back, and any
+// on Windows, which has no pipes in select(), polls every kPollMs.
+class NetworkThread {
+public:
+	struct Completion {
+		CURL *handle;
+		CURLcode result;
+	};
+private:
+	struct Command {
+		enum Op {
+			kAdd,
+			kRemove,
+			kThrottle,
+		};
+		Op op;
+		CURL *handle;
+		curl_off_t rate;       // kThrottle only
+		bool paused;
+		long low_speed_limit;
+		long low_speed_time;
+		Command(Op a_op = kAdd,CURL *a_handle = 0)
+			: op(a_op),handle(a_handle),rate(0),paused(false),low_speed_limit(0),low_speed_time(0)
+		{
+		}
+	};
+	CURLM *curlm;
+	pthread_t thread;
+	bool running;
+	volatile long quit;
+	MpscQueue<Command> commands;
+	SpscQueue<Completion> completions;
+	pthread_mutex_t lock;         // guards backlog
+	std::deque<CURL *> backlog;   // submitted, waiting for a free slot
+	size_t max_running;           // 0 for no limit
+	std::vector<NetworkThread *> peers;
+	volatile long running_count;
+	volatile long stolen;         // handles taken from peers
+	int wake_fds[2];              // self-pipe, -1 without one
+	volatile long woken;          // a byte is in the pipe
+	// worker side only
+	std::list<Completion> overflow;
+	std::set<CURL *> handles;
+
+	// Forbid copying
+	NetworkThread(const NetworkThread &);
+	NetworkThread &operator=(const NetworkThread &);
+public:
+	// Longest the worker sleeps in select() while it waits for room in
+	// the completion ring, or without a self-pipe to wake it
+	static const int kPollMs = 5;
+	// and otherwise, when whatever has work for it wakes it
+	static const int kIdlePollMs = 100;
+
+	NetworkThread(size_t completion_capacity,size_t a_max_running = 0)
+		: curlm(0),running(false),quit(0),completions(completion_capacity),
+		max_running(a_max_running),running_count(0),stolen(0),woken(0)
+	{
+		pthread_mutex_init(&lock,0);
+		wake_fds[0] = wake_fds[1] = -1;
+#ifndef _WIN32
+		if( pipe(wake_fds) != 0 ) {
+			printf("NETWORK THREAD WAKEUP PIPE NOT CREATED, POLLING\n");
+			wake_fds[0] = wake_fds[1] = -1;
+		} else {
+			fcntl(wake_fds[0],F_SETFL,fcntl(wake_fds[0],F_GETFL) | O_NONBLOCK);
+			fcntl(wake_fds[1],F_SETFL,fcntl(wake_fds[1],F_GETFL) | O_NONBLOCK);
+		}
+#endif
+	}
+	~NetworkThread()
+	{
+		stop();
+		pthread_mutex_destroy(&lock);
+#ifndef _WIN32
+		if( wake_fds[0] >= 0 ) {
+			close(wake_fds[0]);
+			close(wake_fds[1]);
+		}
+#endif
+	}
+	// Shards which may steal from each other, this one included; set
+	// before start()
+	void set_peers(const std::vector<NetworkThread *> &all) {
+		peers = all;
+	}
+	bool start() {
+		if( running )
+			return true;
+		curlm = curl_multi_init();
+		if( !curlm )
+			return false;
+		AtomicSet(&quit,0);
+		if( pthread_create(&thread,0,NetworkThread::Run,this) != 0 ) {
+			printf("NETWORK THREAD NOT STARTED\n");
+			curl_multi_cleanup(curlm);
+			curlm = 0;
+			return false;
+		}
+		running = true;
+		return true;
+	}
+	// Joins the worker. Handles which are still running are taken off the
+	// multi handle but not given back, so stop only once everything
+	// submitted has come back through poll().
+	void stop() {
+		if( !running )
+			return;
+		AtomicSet(&quit,1);
+		wake();
+		pthread_join(thread,0);
+		running = false;
+		std::set<CURL *>::iterator e = handles.end();
+		std::set<CURL *>::iterator i = handles.begin();
+		for( ; i != e; i++ ) {
+			curl_multi_remove_handle(curlm,*i);
+		}
+		handles.clear();
+		overflow.clear();
+		pthread_mutex_lock(&lock);
+		backlog.clear();
+		pthread_mutex_unlock(&lock);
+		AtomicSet(&running_count,0);
+		curl_multi_cleanup(curlm);
+		curlm = 0;
+	}
+	bool is_running() const { return running; }
+	void submit(CURL *handle) {
+		commands.push(Command(Command::kAdd,handle));
+		wake();
+	}
+	// Aborts a submitted transfer; a handle which already finished or which
+	// is not on this shard is left alone. A handle a peer is stealing at
+	// that moment can miss the removal, which is why the owner also makes
+	// it fail from its progress callback.
+	void remove(CURL *handle) {
+		commands.push(Command(Command::kRemove,handle));
+		wake();
+	}
+	// Sets the receive rate of a submitted transfer, 0 for no limit, or
+	// pauses it; see ThrottleTransfer(). Like remove(), it only reaches a
+	// handle on this shard, and one still waiting in the backlog only gets
+	// the rate, which is meant as the trickle it runs at when not paused.
+	void throttle(CURL *handle,curl_off_t rate,bool paused,long low_speed_limit,long low_speed_time) {
+		Command c(Command::kThrottle,handle);
+		c.rate = rate;
+		c.paused = paused;
+		c.low_speed_limit = low_speed_limit;
+		c.low_speed_time = low_speed_time;
+		commands.push(c);
+		wake();
+	}
+	// Owner side, next finished handle if any
+	bool poll(Completion *c) {
+		return completions.pop(c);
+	}
+	// Completions waiting to be polled
+	size_t get_backlog() const { return completions.size(); }
+	size_t get_running() const { return (size_t)AtomicGet((volatile long *)&running_count); }
+	size_t get_stolen() const { return (size_t)AtomicGet((volatile long *)&stolen); }
+private:
+	static void *Run(void *arg) {
+		((NetworkThread *)arg)->run();
+		return 0;
+	}
+	void run() {
+		while( !AtomicGet(&quit) ) {
+			flush_overflow();
+			drain_wake();
+			Command c;
+			bool added = false;
+			while( commands.pop(&c) ) {
+				switch( c.op ) {
+				case Command::kAdd:
+					pthread_mutex_lock(&lock);
+					backlog.push_back(c.handle);
+					pthread_mutex_unlock(&lock);
+					added = true;
+					break;
+				case Command::kRemove:
+					if( handles.erase(c.handle) ) {
+						curl_multi_remove_handle(curlm,c.handle);
+						complete(c.handle,CURLE_ABORTED_BY_CALLBACK);
+					} else if( unqueue(c.handle) ) {
+						complete(c.handle,CURLE_ABORTED_BY_CALLBACK);
+					}
+					break;
+				case Command::kThrottle:
+					if( handles.count(c.handle) )
+						ThrottleTransfer(c.handle,c.rate,c.paused,c.low_speed_limit,c.low_speed_time);
+					else
+						limit_queued(c.handle,c.rate);
+					break;
+				}
+			}
+			fill();
+			if( added && backlog_size() )
+				wake_peers();
+			int running_handles = 0;
+			CURLMcode code;
+			while( (code = curl_multi_perform(curlm,&running_handles)) == CURLM_CALL_MULTI_PERFORM )
+				;
+			if( code != CURLM_OK )
+				printf("SOMETHING BAD HAPPENS IN NETWORK THREAD: %d!!!\n",code);
+			CURLMsg *msg;
+			int msgs_left;
+			while( (msg = curl_multi_info_read(curlm,&msgs_left)) ) {
+				if( msg->msg != CURLMSG_DONE )
+					continue;
+				CURL *handle = msg->easy_handle;
+				CURLcode result = msg->data.result;
+				curl_multi_remove_handle(curlm,handle);
+				handles.erase(handle);
+				complete(handle,result);
+			}
+			AtomicSet(&running_count,(long)handles.size());
+			wait();
+		}
+	}
+	// Moves handles from the backlog, or a peer's, into free slots
+	void fill() {
+		while( !max_running || handles.size() < max_running ) {
+			CURL *handle = take_front();
+			if( !handle )
+				handle = steal();
+			if( !handle )
+				break;
+			if( curl_multi_add_handle(curlm,handle) == CURLM_OK )
+				handles.insert(handle);
+			else
+				complete(handle,CURLE_FAILED_INIT);
+		}
+		AtomicSet(&running_count,(long)handles.size());
+	}
+	CURL *take_front() {
+		CURL *handle = 0;
+		pthread_mutex_lock(&lock);
+		if( !backlog.empty() ) {
+			handle = backlog.front();
+			backlog.pop_front();
+		}
+		pthread_mutex_unlock(&lock);
+		return handle;
+	}
+	// The back of a backlog holds the latest, least urgent submissions
+	CURL *take_back() {
+		CURL *handle = 0;
+		pthread_mutex_lock(&lock);
+		if( !backlog.empty() ) {
+			handle = backlog.back();
+			backlog.pop_back();
+		}
+		pthread_mutex_unlock(&lock);
+		return handle;
+	}
+	size_t backlog_size() {
+		pthread_mutex_lock(&lock);
+		size_t n = backlog.size();
+		pthread_mutex_unlock(&lock);
+		return n;
+	}
+	CURL *steal() {
+		NetworkThread *victim = 0;
+		size_t most = 0;
+		for( size_t i = 0; i < peers.size(); i++ ) {
+			if( peers[i] == this )
+				continue;
+			size_t n = peers[i]->backlog_size();
+			if( n > most ) {
+				most = n;
+				victim = peers[i];
+			}
+		}
+		CURL *handle = victim ? victim->take_back() : 0;
+		if( handle )
+			AtomicAdd(&stolen,1);
+		return handle;
+	}
+	bool unqueue(CURL *handle) {
+		bool found = false;
+		pthread_mutex_lock(&lock);
+		std::deque<CURL *>::iterator e = backlog.end();
+		std::deque<CURL *>::iterator i = backlog.begin();
+		for( ; i != e; i++ ) {
+			if( *i == handle ) {
+				backlog.erase(i);
+				found = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		return found;
+	}
+	// Only the owner of a backlog touches the handles in it, under its lock
+	void limit_queued(CURL *handle,curl_off_t rate) {
+		pthread_mutex_lock(&lock);
+		std::deque<CURL *>::iterator e = backlog.end();
+		std::deque<CURL *>::iterator i = backlog.begin();
+		for( ; i != e; i++ ) {
+			if( *i == handle ) {
+				curl_easy_setopt(handle,CURLOPT_MAX_RECV_SPEED_LARGE,rate);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	void complete(CURL *handle,CURLcode result) {
+		Completion c = { handle,result };
+		if( !overflow.empty() || !completions.push(c) )
+			overflow.push_back(c);
+	}
+	void flush_overflow() {
+		while( !overflow.empty() && completions.push(overflow.front()) ) {
+			overflow.pop_front();
+		}
+	}
+	// Idle peers steal what does not fit here
+	void wake_peers() {
+		for( size_t i = 0; i < peers.size(); i++ ) {
+			if( peers[i] != this )
+				peers[i]->wake();
+		}
+	}
+	// Any thread; a command which was pushed before the worker clears
+	// woken is popped by the same round, one pushed after writes again
+	void wake() {
+#ifndef _WIN32
+		if( wake_fds[1] < 0 || !AtomicCas(&woken,0,1) )
+			return;
+		char b = 0;
+		if( write(wake_fds[1],&b,1) < 0 )
+			AtomicSet(&woken,0);
+#endif
+	}
+	void drain_wake() {
+#ifndef _WIN32
+		if( wake_fds[0] < 0 || !AtomicGet(&woken) )
+			return;
+		char b[64];
+		while( read(wake_fds[0],b,sizeof(b)) > 0 )
+			;
+		AtomicSet(&woken,0);
+#endif
+	}
+	// Sleeps until a socket is ready, something wakes it, libcurl wants
+	// to run a timeout or the poll interval passed
+	void wait() {
+		long poll_ms = wake_fds[0] >= 0 && overflow.empty() ? kIdlePollMs : kPollMs;
+		long timeout = -1;
+		curl_multi_timeout(curlm,&timeout);
+		if( timeout < 0 || timeout > poll_ms )
+			timeout = poll_ms;
+		if( timeout == 0 )
+			return;
+		fd_set fdread, fdwrite, fdexcep;
+		int maxfd = -1;
+		FD_ZERO(&fdread);
+		FD_ZERO(&fdwrite);
+		FD_ZERO(&fdexcep);
+		curl_multi_fdset(curlm,&fdread,&fdwrite,&fdexcep,&maxfd);
+#ifndef _WIN32
+		if( wake_fds[0] >= 0 ) {
+			FD_SET(wake_fds[0],&fdread);
+			if( wake_fds[0] > maxfd )
+				maxfd = wake_fds[0];
+		}
+#endif
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = timeout * 1000;
+#ifdef _WIN32
+		// winsock refuses a select() without sockets
+		if( maxfd < 0 ) {
+			Sleep(timeout);
+			return;
+		}
+#endif
+		select(maxfd + 1,&fdread,&fdwrite,&fdexcep,&tv);
+	}
+};
+
+#endif /* !NETWORK_THREAD_H */
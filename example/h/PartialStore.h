@@ -0,0 +1,131 @@
+// Partial bodies of abandoned downloads, kept to be continued later
+//-----------------------------------------------------------------------------
+
+#ifndef PARTIAL_STORE_H
+#define PARTIAL_STORE_H
+
+#include <string>
+#include <list>
+#include <map>
+#include <stddef.h>
+#include "MemoryGovernor.h"
+
+// What a canceled or failed transfer had received of a body, keyed by
+// URL together with the validator the body is of. A later request for the
+// URL takes it and asks only for the rest, with a Range request whose
+// If-Range makes the server send the whole body instead if it changed.
+//
+// Bodies are kept within a byte budget, the oldest dropped first; ones
+// below kMinBytes are cheaper to download again than to keep. With a
+// memory governor they count as held body bytes, and drop_oldest() gives
+// them up before anything else when those are too many.
+class PartialStore {
+public:
+	struct Partial {
+		std::string url;
+		std::string validator; // ETag or Last-Modified, for If-Range
+		std::string body;
+	};
+	static const size_t kMinBytes = 4096;
+private:
+	typedef std::list<Partial> Entries; // oldest first
+	Entries entries;
+	std::map<std::string,Entries::iterator> index;
+	size_t max_bytes;
+	size_t bytes;
+	size_t kept;
+	size_t resumes;       // range requests the server continued
+	size_t resumed_bytes; // which did not have to come again
+	size_t refusals;      // range requests answered with the whole body or not at all
+	MemoryGovernor *memory; // charged with the bytes kept, if set
+
+	// Forbid copying
+	PartialStore(const PartialStore &);
+	PartialStore &operator=(const PartialStore &);
+public:
+	PartialStore(size_t a_max_bytes)
+		: max_bytes(a_max_bytes),bytes(0),kept(0),resumes(0),resumed_bytes(0),refusals(0),memory(0)
+	{
+	}
+	void set_memory(MemoryGovernor *a_memory) {
+		memory = a_memory;
+	}
+	void set_max_bytes(size_t a_max_bytes) {
+		max_bytes = a_max_bytes;
+		while( bytes > max_bytes )
+			drop(entries.begin());
+	}
+	bool drop_oldest() {
+		if( entries.empty() )
+			return false;
+		drop(entries.begin());
+		return true;
+	}
+	// Keeps body under url in place of what was kept for it before; false
+	// if it is too small or too large for the budget
+	bool put(const std::string &url,const std::string &validator,const std::string &body) {
+		erase(url);
+		if( validator.empty() || body.size() < kMinBytes || body.size() > max_bytes )
+			return false;
+		while( bytes + body.size() > max_bytes )
+			drop(entries.begin());
+		Partial p;
+		p.url = url;
+		p.validator = validator;
+		entries.push_back(p);
+		entries.back().body = body;
+		index[url] = --entries.end();
+		bytes += body.size();
+		if( memory )
+			memory->charge((long)body.size());
+		kept++;
+		return true;
+	}
+	// Hands out and forgets what was kept for url
+	bool take(const std::string &url,Partial *p) {
+		std::map<std::string,Entries::iterator>::iterator f = index.find(url);
+		if( f == index.end() )
+			return false;
+		Entries::iterator i = f->second;
+		p->url = url;
+		p->validator = i->validator;
+		bytes -= i->body.size();
+		if( memory )
+			memory->charge(-(long)i->body.size());
+		p->body.swap(i->body);
+		index.erase(f);
+		entries.erase(i);
+		return true;
+	}
+	bool erase(const std::string &url) {
+		std::map<std::string,Entries::iterator>::iterator f = index.find(url);
+		if( f == index.end() )
+			return false;
+		drop(f->second);
+		return true;
+	}
+	void got_resume(size_t saved) {
+		resumes++;
+		resumed_bytes += saved;
+	}
+	void got_refusal() {
+		refusals++;
+	}
+	size_t get_entries() const { return entries.size(); }
+	size_t get_bytes() const { return bytes; }
+	size_t get_max_bytes() const { return max_bytes; }
+	size_t get_kept() const { return kept; }
+	size_t get_resumes() const { return resumes; }
+	size_t get_resumed_bytes() const { return resumed_bytes; }
+	size_t get_refusals() const { return refusals; }
+private:
+	void drop(Entries::iterator i) {
+		bytes -= i->body.size();
+		if( memory )
+			memory->charge(-(long)i->body.size());
+		index.erase(i->url);
+		entries.erase(i);
+	}
+};
+
+#endif /* !PARTIAL_STORE_H */
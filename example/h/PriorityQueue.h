@@ -0,0 +1,143 @@
+// Priority queue used by the request manager to pick the next request
+//-----------------------------------------------------------------------------
+
+#ifndef PRIORITY_QUEUE_H
+#define PRIORITY_QUEUE_H
+
+#include <vector>
+#include <map>
+#include <stddef.h>
+
+// Binary min-heap of items ordered by a caller-supplied score: the lower
+// the score, the sooner the item is popped. Items with equal scores come
+// out in insertion order, so with all scores at 0 this is a plain FIFO.
+// Every item remembers its heap slot, so changing the score of a queued
+// item or removing it costs O(log n) instead of a scan.
+template<class T>
+class PriorityQueue {
+	struct Entry {
+		T *item;
+		double score;
+		unsigned long seq;
+	};
+	std::vector<Entry> heap;
+	std::map<T *,size_t> slots;
+	unsigned long next_seq;
+
+	// Forbid copying
+	PriorityQueue(const PriorityQueue &);
+	PriorityQueue &operator=(const PriorityQueue &);
+public:
+	PriorityQueue()
+		: next_seq(0)
+	{
+	}
+	size_t size() const { return heap.size(); }
+	bool empty() const { return heap.empty(); }
+	bool contains(T *item) const { return slots.find(item) != slots.end(); }
+	T *top() const { return heap.empty() ? 0 : heap[0].item; }
+	// Access by heap slot, used to walk every queued item (unordered)
+	T *at(size_t i) const { return heap[i].item; }
+	double score_at(size_t i) const { return heap[i].score; }
+
+	bool push(T *item,double score) {
+		if( contains(item) )
+			return update(item,score);
+		Entry n = { item,score,next_seq++ };
+		heap.push_back(n);
+		slots[item] = heap.size() - 1;
+		sift_up(heap.size() - 1);
+		return true;
+	}
+	T *pop() {
+		if( heap.empty() )
+			return 0;
+		T *item = heap[0].item;
+		remove_at(0);
+		return item;
+	}
+	bool update(T *item,double score) {
+		typename std::map<T *,size_t>::iterator f = slots.find(item);
+		if( f == slots.end() )
+			return false;
+		size_t i = f->second;
+		double old = heap[i].score;
+		heap[i].score = score;
+		if( score < old )
+			sift_up(i);
+		else
+			sift_down(i);
+		return true;
+	}
+	bool remove(T *item) {
+		typename std::map<T *,size_t>::iterator f = slots.find(item);
+		if( f == slots.end() )
+			return false;
+		remove_at(f->second);
+		return true;
+	}
+	bool score_of(T *item,double *score) const {
+		typename std::map<T *,size_t>::const_iterator f = slots.find(item);
+		if( f == slots.end() )
+			return false;
+		*score = heap[f->second].score;
+		return true;
+	}
+	void clear() {
+		heap.clear();
+		slots.clear();
+	}
+private:
+	bool before(size_t a,size_t b) const {
+		if( heap[a].score != heap[b].score )
+			return heap[a].score < heap[b].score;
+		return heap[a].seq < heap[b].seq;
+	}
+	void place(size_t i,const Entry &n) {
+		heap[i] = n;
+		slots[n.item] = i;
+	}
+	void swap_at(size_t a,size_t b) {
+		Entry t = heap[a];
+		place(a,heap[b]);
+		place(b,t);
+	}
+	void sift_up(size_t i) {
+		while( i > 0 ) {
+			size_t parent = (i - 1) / 2;
+			if( !before(i,parent) )
+				break;
+			swap_at(i,parent);
+			i = parent;
+		}
+	}
+	void sift_down(size_t i) {
+		for( ;; ) {
+			size_t l = 2 * i + 1;
+			size_t r = l + 1;
+			size_t best = i;
+			if( l < heap.size() && before(l,best) )
+				best = l;
+			if( r < heap.size() && before(r,best) )
+				best = r;
+			if( best == i )
+				break;
+			swap_at(i,best);
+			i = best;
+		}
+	}
+	void remove_at(size_t i) {
+		slots.erase(heap[i].item);
+		size_t last = heap.size() - 1;
+		if( i != last ) {
+			place(i,heap[last]);
+			heap.pop_back();
+			sift_down(i);
+			sift_up(i);
+		} else {
+			heap.pop_back();
+		}
+	}
+};
+
+#endif /* !PRIORITY_QUEUE_H */
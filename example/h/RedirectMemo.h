@@ -0,0 +1,160 @@
+// Memo of permanent redirects, so later requests skip the round trip
+//-----------------------------------------------------------------------------
+
+#ifndef REDIRECT_MEMO_H
+#define REDIRECT_MEMO_H
+
+#include <string>
+#include <map>
+#include <list>
+#include <stdint.h>
+#include "TimeUs.h"
+#include "UrlView.h"
+
+// A 301 or 308 says the resource has moved for good, yet every request
+// for a tile behind one pays for it again. Here a permanent redirect
+// turns into a rule which rewrites later URLs before they are sent.
+//
+// Tile servers usually move a whole tree, so a rule is learnt as a prefix:
+// whatever tail of the path the old and the new URL share is cut off at a
+// '/', and "http://a/jams/14/1/2.png" -> "http://b/t/jams/14/1/2.png"
+// becomes "http://a" -> "http://b/t", applying to any URL under the old
+// prefix. When they share no tail the rule is for that URL only.
+//
+// There are at most max_rules rules, the least recently used go first,
+// and a rule expires after ttl_us. A rewritten request which fails or
+// gets an error status removes its rule, the redirect may be gone.
+class RedirectMemo {
+	struct Rule {
+		std::string to;
+		int hops;           // redirects a rewrite saves
+		bool exact;         // for the whole URL, not a prefix
+		int64_t expires_at; // us
+		std::list<std::string>::iterator lru;
+	};
+	std::map<std::string,Rule> rules; // by old URL or prefix
+	std::list<std::string> lru;       // keys, most recently used first
+	size_t max_rules;
+	int64_t ttl_us;
+	size_t learned;
+	size_t rewrites;
+	size_t hops_saved;
+	size_t expired;
+	size_t forgotten;
+
+	// Forbid copying
+	RedirectMemo(const RedirectMemo &);
+	RedirectMemo &operator=(const RedirectMemo &);
+public:
+	RedirectMemo(size_t a_max_rules = 256,int64_t a_ttl_us = (int64_t)24 * 3600 * 1000000)
+		: max_rules(a_max_rules),ttl_us(a_ttl_us),
+		learned(0),rewrites(0),hops_saved(0),expired(0),forgotten(0)
+	{
+	}
+	// Remembers that from ended up at to after hops permanent redirects
+	void learn(const std::string &from,const std::string &to,int hops) {
+		if( !max_rules || from.empty() || to.empty() || from == to )
+			return;
+		// the longest shared tail starting at a '/' of the path
+		size_t n = 0;
+		while( n < from.size() && n < to.size() && from[from.size() - 1 - n] == to[to.size() - 1 - n] )
+			n++;
+		UrlView v(from);
+		size_t path = v.path.data ? v.path.data - from.data() : from.size();
+		size_t cut = from.size() - n;
+		while( cut < from.size() && from[cut] != '/' )
+			cut++;
+		bool exact = cut < path || cut >= path + v.path.size;
+		std::string key = exact ? from : from.substr(0,cut);
+		Rule r;
+		r.to = exact ? to : to.substr(0,to.size() - (from.size() - cut));
+		r.hops = hops;
+		r.exact = exact;
+		r.expires_at = TimeUs() + ttl_us;
+		std::map<std::string,Rule>::iterator f = rules.find(key);
+		if( f != rules.end() ) {
+			lru.erase(f->second.lru);
+			rules.erase(f);
+		}
+		lru.push_front(key);
+		r.lru = lru.begin();
+		rules[key] = r;
+		learned++;
+		while( rules.size() > max_rules ) {
+			rules.erase(lru.back());
+			lru.pop_back();
+		}
+	}
+	// URL to send a request for url to instead, and the redirects that
+	// saves; false to send it as it is
+	bool rewrite(const std::string &url,std::string *target,int *hops = 0) {
+		std::map<std::string,Rule>::iterator f = find(url);
+		if( f == rules.end() )
+			return false;
+		Rule &r = f->second;
+		*target = r.exact ? r.to : r.to + url.substr(f->first.size());
+		if( hops )
+			*hops = r.hops;
+		lru.splice(lru.begin(),lru,r.lru);
+		rewrites++;
+		hops_saved += r.hops;
+		return true;
+	}
+	// Drops the rule which rewrote url
+	void forget(const std::string &url) {
+		std::map<std::string,Rule>::iterator f = find(url);
+		if( f == rules.end() )
+			return;
+		lru.erase(f->second.lru);
+		rules.erase(f);
+		forgotten++;
+	}
+	// Absolute URL of a Location header value received for base; empty
+	// for the relative forms which are not worth remembering
+	static std::string resolve(const std::string &base,const std::string &location) {
+		UrlView l(location);
+		if( l.scheme.present() )
+			return location;
+		if( location.empty() || location[0] != '/' || (location.size() > 1 && location[1] == '/') )
+			return "";
+		UrlView b(base);
+		if( !b.scheme.present() )
+			return "";
+		return b.scheme.str() + "://" + b.host_port().str() + location;
+	}
+	size_t get_rules() const { return rules.size(); }
+	size_t get_learned() const { return learned; }
+	size_t get_rewrites() const { return rewrites; }
+	// Round trips the rewrites saved
+	size_t get_hops_saved() const { return hops_saved; }
+	size_t get_expired() const { return expired; }
+	size_t get_forgotten() const { return forgotten; }
+private:
+	// Rule for url itself, or for the longest prefix of it ending before a
+	// '/' of the path; a rule found expired is dropped
+	std::map<std::string,Rule>::iterator find(const std::string &url) {
+		if( rules.empty() )
+			return rules.end();
+		std::map<std::string,Rule>::iterator f = rules.find(url);
+		if( f != rules.end() && !f->second.exact )
+			f = rules.end();
+		UrlView v(url);
+		size_t path = v.path.data ? v.path.data - url.data() : url.size();
+		for( size_t p = url.size(); f == rules.end() && p > path; p-- ) {
+			if( url[p - 1] != '/' )
+				continue;
+			f = rules.find(url.substr(0,p - 1));
+			if( f != rules.end() && f->second.exact )
+				f = rules.end();
+		}
+		if( f != rules.end() && TimeUs() >= f->second.expires_at ) {
+			lru.erase(f->second.lru);
+			rules.erase(f);
+			expired++;
+			return rules.end();
+		}
+		return f;
+	}
+};
+
+#endif /* !REDIRECT_MEMO_H */
@@ -0,0 +1,1808 @@
+// Prioritised HTTP request queue on top of a libcurl multi handle
+//-----------------------------------------------------------------------------
+
+#ifndef REQUEST_MANAGER_H
+#define REQUEST_MANAGER_H
+
+#include <string>
+#include <set>
+#include <map>
+#include <list>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include "PriorityQueue.h"
+#include "ResponseCache.h"
+#include "DiskCache.h"
+#include "TimeUs.h"
+#include "ConcurrencyControl.h"
+#include "Atomic.h"
+#include "NetworkThread.h"
+#include "CurlShare.h"
+#include "RequestTiming.h"
+#include "UrlView.h"
+#include "RedirectMemo.h"
+#include "RetryPolicy.h"
+#include "AdaptiveTimeouts.h"
+#include "BandwidthScheduler.h"
+#include "MemoryGovernor.h"
+#include "BodyConsumer.h"
+#include "PartialStore.h"
+
+enum HTTPStatus
+{
+	kNone,
+	kStarting,
+	kDownloading,
+	kOK,
+	kError,
+};
+
+// What the server made of a Range request, which continues a partial body
+// or asks for a segment of one
+enum RangeOutcome
+{
+	kRangeNone,     // no range asked for, or no answer yet
+	kRangeResumed,  // a 206 from where asked, appended to the partial body
+	kRangeReplaced, // any other answer, the partial body is gone
+	kRangeRefused,  // a 416, a 206 from elsewhere, or a whole body for a
+	                // segment after the first; another download has to follow
+};
+
+// host[:port] part of an URL, used to key per-host state
+inline std::string url_host(const std::string &url) {
+	return UrlView(url).host_port().str();
+}
+
+class Request {
+	CURL *curl;
+	curl_slist *headers;
+	HTTPStatus state;
+	CURLcode errcode;
+	std::string url;
+	UrlView parsed;       // of url, parsed once
+	std::string host;     // host[:port] of url
+	std::string target;   // URL the transfer goes to instead of url
+	int target_hops;      // redirects the rewrite to target saved
+	bool direct;          // a rewrite failed it, so it goes to url only
+	long hop_status;      // of the response whose headers are coming in
+	long body_status;     // status of the response the body is of
+	std::string hop_url;  // that response is for
+	std::string moved_to; // where the permanent redirects at the start led
+	int moved_hops;
+	std::string content;
+	std::string spill;    // file the finished body went to, content is empty then
+	size_t spill_size;
+	std::string errmsg;
+	long response_code;
+	CacheMeta meta;       // caching headers of the response
+	CacheMeta conditions; // validators of a stale cached copy
+	Request *leader;      // request doing the transfer for this one
+	std::list<Request *> followers; // requests waiting for this transfer
+	int64_t cancel_at;    // when cancel() was first called, in us
+	RequestTiming timing; // of the finished transfer
+	Timeouts limits;      // of the next transfer
+	double score;         // it was started with, a retry is queued with it again
+	int attempts;         // transfers started for it
+	int64_t started_at;   // the last one, in us
+	Request *hedge;       // duplicate transfer racing this one
+	Request *hedge_of;    // request this one is the hedge of
+	BandwidthScheduler::Flow flow; // traffic class and what it is granted
+	bool throttled;       // the transfer was held below its speed
+	MemoryGovernor *memory; // counts the body bytes, if set
+	BodyConsumer *consumer; // takes 2xx bodies instead of content
+	bool streamed;        // had a consumer, which may have seen the end already
+	size_t resume_from;   // bytes of content the next transfer continues from
+	std::string resume_validator; // the partial body is of, sent as If-Range
+	long range_first;     // of the segment asked for, -1 for the whole body
+	long range_last;      // -1 for the rest of the body
+	std::string range_validator; // the segment must be of, sent as If-Range
+	long range_start;     // of the Content-Range of the response, -1 without
+	long range_total;     // of the whole body, from the Content-Range, -1 unknown
+	RangeOutcome range;   // of the transfer
+	bool hold_applied;    // the manager has seen the hold and paused it for good
+	bool canceling;
+	bool cached;
+	// shared with the network thread while the transfer runs there
+	volatile long aborted;  // the transfer is being taken down
+	volatile long received; // body bytes so far
+	volatile long *meter;   // bytes received by all transfers
+	volatile long held;     // the write callback paused for memory
+	volatile long exempt;   // keeps going past the high-water mark
+	volatile long body_started; // the headers of the final response are all in
+
+	// Forbid copying, parsed points into url
+	Request(const Request &);
+	Request &operator=(const Request &);
+public:
+	Request(const char *a_url)
+		: curl(0),headers(0),state(kNone),errcode(CURLE_OK),url(a_url),
+		target_hops(0),direct(false),hop_status(0),body_status(0),moved_hops(0),spill_size(0),response_code(0),
+		leader(0),cancel_at(0),score(0),attempts(0),started_at(0),
+		hedge(0),hedge_of(0),throttled(false),memory(0),consumer(0),streamed(false),
+		resume_from(0),range_first(-1),range_last(-1),range_start(-1),range_total(-1),range(kRangeNone),
+		hold_applied(false),canceling(false),cached(false),
+		aborted(0),received(0),meter(0),held(0),exempt(0),body_started(0)
+	{
+		parsed.parse(url);
+		host = parsed.host_port().str();
+	}
+	virtual ~Request()
+	{
+		cleanup();
+	}
+	CURL *start(CURLSH *curlsh) {
+		state = kStarting;
+		curl = curl_easy_init();	
+		attempts++;
+		started_at = TimeUs();
+		flow.reset();
+		throttled = false;
+		hold_applied = false;
+		held = 0;
+		exempt = 0;
+		hop_url = target.size() ? target : url;
+		hop_status = 0;
+		body_status = 0;
+		range_start = -1;
+		range_total = -1;
+		range = kRangeNone;
+		body_started = 0;
+		moved_to = "";
+		moved_hops = 0;
+		curl_easy_setopt(curl, CURLOPT_URL, hop_url.c_str());
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, Request::GotData);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)this);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-airplay-agent/1.0");
+		curl_easy_setopt(curl,CURLOPT_CONNECTTIMEOUT_MS, limits.connect_ms);
+		curl_easy_setopt(curl,CURLOPT_TIMEOUT_MS, limits.total_ms);
+		if( limits.low_speed_limit ) {
+			curl_easy_setopt(curl,CURLOPT_LOW_SPEED_LIMIT, limits.low_speed_limit);
+			curl_easy_setopt(curl,CURLOPT_LOW_SPEED_TIME, limits.low_speed_time);
+		}
+		curl_easy_setopt(curl,CURLOPT_NOPROGRESS, 0);
+		curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION, 1);
+		curl_easy_setopt(curl,CURLOPT_PROGRESSFUNCTION, Request::GotProgressStatic);
+		curl_easy_setopt(curl,CURLOPT_PROGRESSDATA, (void *)this);
+		curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION, Request::GotHeaderStatic);
+		curl_easy_setopt(curl,CURLOPT_HEADERDATA, (void *)this);
+		if( conditions.has_validators() )
+			headers = conditions.append_conditions(headers);
+		if( resume_from || range_first >= 0 ) {
+			// only the rest or the segment, and only if the body is still
+			// the same one
+			char bytes[48];
+			long from = range_first >= 0 ? range_first : (long)resume_from;
+			if( range_last >= 0 )
+				snprintf(bytes,sizeof(bytes),"%ld-%ld",from,range_last);
+			else
+				snprintf(bytes,sizeof(bytes),"%ld-",from);
+			curl_easy_setopt(curl, CURLOPT_RANGE, bytes);
+			const std::string &validator = range_first >= 0 ? range_validator : resume_validator;
+			if( validator.size() )
+				headers = curl_slist_append(headers,("If-Range: " + validator).c_str());
+		}
+		if( headers )
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		if( curlsh )
+			curl_easy_setopt(curl,CURLOPT_SHARE,curlsh);
+		//curl_easy_setopt(curl,CURLOPT_VERBOSE,1);
+		return curl;
+	}
+	// Sends the request to a_target, which a permanent redirect a_hops
+	// redirects away from url leads to
+	void set_target(const std::string &a_target,int a_hops) {
+		target = a_target;
+		target_hops = a_hops;
+	}
+	// Sends the request to url from now on, without rewriting it again
+	void go_direct() {
+		target = "";
+		target_hops = 0;
+		direct = true;
+	}
+	void set_score(double a_score) {
+		score = a_score;
+	}
+	void set_timeouts(const Timeouts &a_limits) {
+		limits = a_limits;
+	}
+	void set_traffic(int traffic) {
+		flow.traffic = traffic;
+	}
+	// Counts the body bytes into *a_meter too, atomically
+	void set_meter(volatile long *a_meter) {
+		meter = a_meter;
+	}
+	// Charges the body to a_memory, whose high-water mark pauses the
+	// transfer
+	void set_memory(MemoryGovernor *a_memory) {
+		memory = a_memory;
+	}
+	// Streams 2xx bodies to a_consumer; content stays empty for them
+	void set_consumer(BodyConsumer *a_consumer) {
+		consumer = a_consumer;
+		streamed = consumer != 0;
+	}
+	// Continues body, which a transfer of validator broke off, instead of
+	// starting over; the next transfer asks for the rest with a Range request
+	void set_partial(const std::string &body,const std::string &validator) {
+		drop_content();
+		content = body;
+		charge((long)content.size());
+		resume_from = content.size();
+		resume_validator = validator;
+		received = (long)resume_from;
+	}
+	// Asks for the bytes first..last of the body only, up to its end when
+	// last is negative, and with a validator only while the body is still
+	// that one. A segment from 0 takes the whole body if that is what comes,
+	// any other segment fails then.
+	void set_byte_range(long first,long last,const std::string &validator) {
+		range_first = first;
+		range_last = last;
+		range_validator = validator;
+	}
+	// Tells the consumer the request is over, once
+	void end_stream() {
+		if( !consumer )
+			return;
+		BodyConsumer *c = consumer;
+		consumer = 0;
+		c->got_end(state == kOK && response_code >= 200 && response_code < 300);
+	}
+	void got_throttled() {
+		throttled = true;
+	}
+	// Turns the request into a conditional one, a 304 answer then means the
+	// cached copy is still good
+	void set_conditions(const CacheMeta &a_conditions) {
+		conditions = a_conditions;
+	}
+	void cleanup() {
+		if( curl ) {
+			curl_easy_cleanup(curl);
+		}
+		curl = 0;
+		if( headers ) {
+			curl_slist_free_all(headers);
+		}
+		headers = 0;
+		errmsg = "";
+		drop_content();
+		memory = 0;
+		consumer = 0;
+		streamed = false;
+		range_first = -1;
+		range_last = -1;
+		range_validator = "";
+		range_start = -1;
+		range_total = -1;
+		range = kRangeNone;
+		body_started = 0;
+		url = "";
+		parsed = UrlView();
+		host = "";
+		target = "";
+		target_hops = 0;
+		direct = false;
+		hop_url = "";
+		moved_to = "";
+		moved_hops = 0;
+		state = kNone;
+		canceling = false;
+		cancel_at = 0;
+		cached = false;
+		response_code = 0;
+		aborted = 0;
+		received = 0;
+		timing = RequestTiming();
+		score = 0;
+		attempts = 0;
+		started_at = 0;
+		hedge = 0;
+		hedge_of = 0;
+		flow = BandwidthScheduler::Flow();
+		throttled = false;
+		meter = 0;
+		hold_applied = false;
+		held = 0;
+		exempt = 0;
+	}
+	// Forgets the outcome of a failed transfer, so the request can be
+	// queued for another one; a partial body it can be continued from is
+	// kept for that
+	void retry() {
+		std::string validator = get_partial_validator();
+		if( validator.size() ) {
+			resume_from = content.size();
+			resume_validator = validator;
+		} else {
+			drop_content();
+		}
+		if( consumer )
+			consumer->got_reset();
+		errmsg = "";
+		errcode = CURLE_OK;
+		response_code = 0;
+		meta = CacheMeta();
+		received = (long)resume_from;
+		timing = RequestTiming();
+		state = kNone;
+	}
+	// A duplicate of the request with a transfer of its own, linked to it
+	Request *make_hedge() {
+		Request *h = new Request(url.c_str());
+		h->conditions = conditions;
+		h->target = target;
+		h->target_hops = target_hops;
+		h->direct = direct;
+		h->score = score;
+		h->flow.traffic = flow.traffic;
+		h->memory = memory;
+		h->set_byte_range(range_first,range_last,range_validator);
+		h->hedge_of = this;
+		hedge = h;
+		return h;
+	}
+	// Unlinks the request and its hedge
+	void unlink_hedge() {
+		if( hedge )
+			hedge->hedge_of = 0;
+		hedge = 0;
+	}
+	// After its own transfer failed, the request waits for its hedge
+	void wait_for_hedge() {
+		state = kDownloading;
+	}
+	void got_started() {
+		state = kDownloading;
+	}
+	void got_error(CURLcode code,const char *msg) {
+		errmsg = msg;
+		errcode = code;
+		got_timing();
+		curl_easy_cleanup(curl);
+		curl = 0;
+		if( headers ) {
+			curl_slist_free_all(headers);
+		}
+		headers = 0;
+		state = kError;
+		canceling = false;
+	}
+	void got_done() {
+		errmsg = "";
+		errcode = CURLE_OK;
+		curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&response_code);
+		settle_range();
+		if( range == kRangeResumed && resume_from && response_code == 206 )
+			response_code = 200; // the whole body is there now
+		got_timing();
+		curl_easy_cleanup(curl);
+		curl = 0;
+		if( headers ) {
+			curl_slist_free_all(headers);
+		}
+		headers = 0;
+		meta.finish();
+		state = kOK;
+		canceling = false;
+	}
+	// completes the request with a body which did not come from the network
+	void got_cached(const std::string &body) {
+		drop_content();
+		if( consumer ) {
+			if( !replay(body) )
+				return;
+		} else {
+			content = body;
+			charge((long)content.size());
+		}
+		errmsg = "";
+		errcode = CURLE_OK;
+		response_code = 200;
+		state = kOK;
+		cached = true;
+	}
+	// Waits for the transfer of a request for the same URL instead of
+	// starting its own
+	void follow(Request *a_leader) {
+		leader = a_leader;
+		leader->followers.push_back(this);
+		state = kStarting;
+	}
+	// Stops waiting for the leader's transfer
+	void leave() {
+		if( leader )
+			leader->followers.remove(this);
+		leader = 0;
+	}
+	// Drops whatever was received so far
+	void release_content() {
+		drop_content();
+	}
+	// Moves a finished body out of memory into the file at path; false if
+	// it could not be written, the body then stays
+	bool spill_content(const std::string &path) {
+		FILE *f = fopen(path.c_str(),"wb");
+		if( !f )
+			return false;
+		bool ok = fwrite(content.data(),1,content.size(),f) == content.size();
+		ok = fclose(f) == 0 && ok;
+		if( !ok ) {
+			remove(path.c_str());
+			return false;
+		}
+		spill = path;
+		spill_size = content.size();
+		charge(-(long)content.size());
+		std::string().swap(content);
+		return true;
+	}
+	// The manager took note of the hold, or resumes the transfer
+	void got_hold() {
+		hold_applied = true;
+	}
+	void release_hold() {
+		AtomicSet(&held,0);
+		hold_applied = false;
+	}
+	void set_exempt(bool a_exempt) {
+		AtomicSet(&exempt,a_exempt ? 1 : 0);
+	}
+	// Turns a follower into the leader of the other followers of its old
+	// leader, which is going away before its transfer started
+	void take_lead(const std::list<Request *> &others) {
+		leader = 0;
+		state = kNone;
+		std::list<Request *>::const_iterator e = others.end();
+		std::list<Request *>::const_iterator i = others.begin();
+		for( ; i != e; i++ ) {
+			(*i)->leader = this;
+			followers.push_back(*i);
+		}
+	}
+	// Completes a follower with the result of its leader
+	void got_shared(const Request *from) {
+		leader = 0;
+		if( from->state == kOK && !canceling ) {
+			drop_content();
+			if( consumer && from->response_code >= 200 && from->response_code < 300 ) {
+				if( !replay(from->get_content()) ) {
+					canceling = false;
+					return;
+				}
+			} else {
+				content = from->get_content();
+				charge((long)content.size());
+			}
+			response_code = from->response_code;
+			body_status = from->body_status;
+			range_total = from->range_total;
+			range = from->range;
+			meta = from->meta;
+			timing = from->timing;
+			cached = from->cached;
+			errmsg = "";
+			errcode = CURLE_OK;
+			state = kOK;
+		} else {
+			errmsg = canceling ? "Canceled" : from->errmsg;
+			errcode = canceling ? CURLE_ABORTED_BY_CALLBACK : from->errcode;
+			state = kError;
+		}
+		canceling = false;
+	}
+	// Requests which still want the body of this transfer; it is only
+	// aborted once this drops to zero. A hedge has those of its request.
+	size_t waiters() const {
+		if( hedge_of )
+			return hedge_of->waiters();
+		size_t n = canceling ? 0 : 1;
+		std::list<Request *>::const_iterator e = followers.end();
+		std::list<Request *>::const_iterator i = followers.begin();
+		for( ; i != e; i++ ) {
+			if( !(*i)->canceling )
+				n++;
+		}
+		return n;
+	}
+	std::list<Request *> take_followers() {
+		std::list<Request *> r;
+		r.swap(followers);
+		return r;
+	}
+	void cancel() {
+		if( !canceling )
+			cancel_at = TimeUs();
+		canceling = true;
+	}
+	// Makes the transfer fail at its next progress callback, wherever it runs
+	void abort() {
+		AtomicSet(&aborted,1);
+	}
+	bool get_aborted() const { return AtomicGet((volatile long *)&aborted) != 0; }
+	int64_t get_cancel_at() const { return cancel_at; }
+	double get_score() const { return score; }
+	int get_attempts() const { return attempts; }
+	int64_t get_started_at() const { return started_at; }
+	Request *get_hedge() const { return hedge; }
+	Request *get_hedge_of() const { return hedge_of; }
+	int get_traffic() const { return flow.traffic; }
+	BandwidthScheduler::Flow &get_flow() { return flow; }
+	// The transfer ran below the speed it could have had, so its rate says
+	// nothing about the path
+	bool get_throttled() const { return throttled; }
+	CURL *get_curl() const { return curl; }
+	const std::string &get_url() const { return url; }
+	const UrlView &get_url_view() const { return parsed; }
+	// host[:port], the key of the per-host state
+	const std::string &get_host() const { return host; }
+	const std::string &get_target() const { return target; }
+	int get_target_hops() const { return target_hops; }
+	bool is_direct() const { return direct; }
+	// Where the transfer was permanently redirected to, and in how many
+	// redirects; empty and 0 without a 301 or 308 at the start
+	const std::string &get_moved_to() const { return moved_to; }
+	int get_moved_hops() const { return moved_hops; }
+	// A spilled body is read back from its file
+	std::string get_content() const {
+		if( spill.empty() )
+			return content;
+		std::string body;
+		FILE *f = fopen(spill.c_str(),"rb");
+		if( !f ) {
+			printf("SPILLED BODY %s IS GONE\n",spill.c_str());
+			return body;
+		}
+		body.resize(spill_size);
+		if( spill_size && fread(&body[0],1,spill_size,f) != spill_size ) {
+			printf("SPILLED BODY %s IS SHORT\n",spill.c_str());
+			body = "";
+		}
+		fclose(f);
+		return body;
+	}
+	size_t get_content_length() const {
+		if( state == kDownloading || (streamed && content.empty()) )
+			return (size_t)AtomicGet((volatile long *)&received);
+		return spill.empty() ? content.size() : spill_size;
+	}
+	bool get_spilled() const { return !spill.empty(); }
+	// The 2xx body went to a consumer instead of content
+	bool get_streamed() const { return streamed; }
+	// Validator an If-Range can continue the partial body with, empty if it
+	// can't be continued: only a 200 body or one already continued is, and
+	// only with a strong ETag or a Last-Modified
+	std::string get_partial_validator() const {
+		if( streamed || content.empty() )
+			return "";
+		if( resume_from && range == kRangeNone )
+			return resume_validator; // the transfer failed before any answer
+		if( body_status != 200 && range != kRangeResumed )
+			return "";
+		std::string v = meta.etag.size() && meta.etag.compare(0,2,"W/") ? meta.etag : meta.last_modified;
+		return v.empty() && range == kRangeResumed ? resume_validator : v;
+	}
+	RangeOutcome get_range() const { return range; }
+	size_t get_resume_from() const { return resume_from; }
+	long get_range_first() const { return range_first; }
+	long get_range_last() const { return range_last; }
+	// Once the body started, the headers of the final response may be read
+	// while the transfer still runs: get_range_total(), get_meta() and
+	// get_body_status()
+	bool get_body_started() const { return AtomicGet((volatile long *)&body_started) != 0; }
+	long get_range_total() const { return range_total; }
+	long get_body_status() const { return body_status; }
+	bool get_held() const { return AtomicGet((volatile long *)&held) != 0; }
+	bool get_hold_applied() const { return hold_applied; }
+	bool get_exempt() const { return AtomicGet((volatile long *)&exempt) != 0; }
+	std::string get_errmsg() const { return errmsg; }
+	CURLcode get_errcode() const { return errcode; }
+	HTTPStatus get_state() const { return state; }
+	bool get_canceling() const { return canceling; }
+	long get_response_code() const { return response_code; }
+	bool get_cached() const { return cached; }
+	const CacheMeta &get_meta() const { return meta; }
+	const RequestTiming &get_timing() const { return timing; }
+	const Timeouts &get_timeouts() const { return limits; }
+	double get_rtt() const { return timing.wait_us() / 1000000.0; }
+	double get_total_time() const { return timing.total; }
+	double get_downloaded() const { return timing.downloaded; }
+	Request *get_leader() const { return leader; }
+	bool has_followers() const { return !followers.empty(); }
+private:
+	void got_timing() {
+		if( !curl )
+			return;
+		timing.read(curl);
+	}
+	void charge(long delta) {
+		if( memory && delta )
+			memory->charge(delta);
+	}
+	// Feeds a body which came whole to the consumer, from the start; the
+	// request fails if the consumer refuses it
+	bool replay(const std::string &body) {
+		consumer->got_reset();
+		if( body.size() && !consumer->got_chunk(body.data(),body.size()) ) {
+			errmsg = "Consumer refused the body";
+			errcode = CURLE_WRITE_ERROR;
+			state = kError;
+			return false;
+		}
+		AtomicSet(&received,(long)body.size());
+		return true;
+	}
+	void drop_content() {
+		charge(-(long)content.size());
+		std::string().swap(content);
+		resume_from = 0;
+		resume_validator = "";
+		if( spill.size() )
+			remove(spill.c_str());
+		spill = "";
+		spill_size = 0;
+	}
+	static size_t GotData(void *ptr, size_t size, size_t nmemb, void *data)
+	{
+	  size_t realsize = size * nmemb;
+	  Request *mem = (Request *)data;
+	  return mem->GotContent(ptr,realsize);
+	}
+	size_t GotContent(void *ptr,size_t size) {
+		if( !settle_range() )
+			return 0;
+		if( !AtomicGet(&body_started) )
+			AtomicSet(&body_started,1);
+		bool stream = consumer && body_status >= 200 && body_status < 300;
+		if( stream ) {
+			if( !consumer->got_chunk((const char *)ptr,size) )
+				return 0;
+		} else {
+			if( memory && memory->over_high() && !get_exempt() ) {
+				// libcurl keeps the chunk and offers it again on resume
+				AtomicSet(&held,1);
+				return CURL_WRITEFUNC_PAUSE;
+			}
+			content += std::string((char *)ptr,size);
+			charge((long)size);
+		}
+		AtomicAdd(&received,(long)size);
+		if( meter )
+			AtomicAdd(meter,(long)size);
+		return size;
+	}
+	static int GotProgressStatic(void *clientp,double dltotal,double dlnow,double ultotal,double ulnow)
+	{
+		Request *mem = (Request *)clientp;
+		return mem->GotProgress(dltotal,dlnow,ultotal,ulnow);
+	}
+	int GotProgress(double dltotal,double dlnow,double ultotal,double ulnow)
+	{
+		return get_aborted() ? 1:0;
+	}
+	static size_t GotHeaderStatic(void *ptr, size_t size, size_t nmemb, void *userdata)
+	{
+		Request *mem = (Request *)userdata;
+		return mem->GotHeader((const char *)ptr,size*nmemb);
+	}
+	size_t GotHeader(const char *ptr,size_t size)
+	{
+		meta.parse_header(ptr,size);
+		GotRedirect(ptr,size);
+		std::string value;
+		if( size >= 5 && !memcmp(ptr,"HTTP/",5) ) {
+			range_start = -1;
+			range_total = -1;
+		} else if( CacheMeta::header_value(ptr,size,"Content-Range",&value) ) {
+			long last;
+			int n = sscanf(value.c_str(),"bytes %ld-%ld/%ld",&range_start,&last,&range_total);
+			if( n < 1 )
+				range_start = -1;
+			if( n < 3 )
+				range_total = -1; // "*", the server does not know
+		}
+		return size;
+	}
+	// Decides what the response does with the range asked for, at its first
+	// body byte or at its end: a 206 from where asked goes on from there,
+	// any other answer drops a partial body. False if the server refused the
+	// range, the transfer is of no use then.
+	bool settle_range() {
+		if( (!resume_from && range_first < 0) || range != kRangeNone )
+			return range != kRangeRefused;
+		long from = range_first >= 0 ? range_first : (long)resume_from;
+		if( body_status == 206 && range_start == from ) {
+			range = kRangeResumed;
+			return true;
+		}
+		bool whole = body_status >= 200 && body_status < 300 && body_status != 206;
+		range = body_status == 206 || body_status == 416 || (whole && range_first > 0) ? kRangeRefused : kRangeReplaced;
+		if( resume_from ) {
+			drop_content();
+			AtomicSet(&received,0);
+		}
+		return range != kRangeRefused;
+	}
+	// Follows the chain of 301s and 308s libcurl goes through first, up to
+	// the first other response
+	void GotRedirect(const char *ptr,size_t size)
+	{
+		std::string value;
+		if( size >= 5 && !memcmp(ptr,"HTTP/",5) ) {
+			const char *sp = (const char *)memchr(ptr,' ',size);
+			long status = sp ? atol(sp + 1) : 0;
+			body_status = status;
+			// -1 once a response other than a permanent redirect came
+			bool chain = hop_status == 0 || hop_status == 301 || hop_status == 308;
+			hop_status = chain ? status : -1;
+		} else if( (hop_status == 301 || hop_status == 308) && CacheMeta::header_value(ptr,size,"Location",&value) ) {
+			while( value.size() && (value[value.size() - 1] == '\r' || value[value.size() - 1] == '\n') )
+				value.erase(value.size() - 1);
+			std::string to = RedirectMemo::resolve(hop_url,value);
+			if( to.empty() ) {
+				hop_status = -1;
+				return;
+			}
+			hop_url = to;
+			moved_to = to;
+			moved_hops++;
+		}
+	}
+};
+
+// Score callback for RequestManager::rescore(). Lower scores start first,
+// a negative score cancels the queued request.
+typedef double (*RequestScoreFunc)(const Request *r,void *userdata);
+
+class RequestManager {
+	std::map<CURL *,Request *> request_map;
+	std::list<Request *> queue;
+	PriorityQueue<Request> pending; // kNone requests waiting for a handle
+	std::map<std::string,Request *> leaders; // queued or running transfer per URL
+	size_t coalesced;
+	size_t cancels;          // in-flight transfers aborted
+	int64_t cancel_us_total; // from cancel() to the slot being free
+	int64_t cancel_us_max;
+	CURLM *curlm;
+	CURLSH *curlsh;
+	ConcurrencyControl concurrency;
+	ResponseCache cache;
+	DiskCache *disk;
+	std::vector<NetworkThread *> shards; // run the transfers in threaded mode
+	size_t next_shard;       // shard polled first by the next step()
+	CurlShare share;         // DNS and cookies across all transfers
+	std::map<std::string,HostTiming> timings; // of finished transfers per host
+	size_t completion_batch; // completions taken from the shards per step
+	struct ForDone {
+		CURL *handle;
+		CURLcode result;
+	};
+	std::list<ForDone> done; // finished transfers step() has not handed out yet
+	int64_t step_us;         // time the last step() took
+	size_t over_budget;      // steps which ran past their budget
+	RedirectMemo redirects;  // 301 and 308 targets to send requests to directly
+	RetryPolicy retry;
+	AdaptiveTimeouts timeouts; // per host, from the transfers so far
+	std::multimap<int64_t,Request *> delayed; // retries waiting out their backoff, by due time
+	std::set<Request *> hedges; // running duplicates, owned by the manager
+	std::set<Request *> streams; // requests whose consumer has not seen the end
+	BandwidthScheduler bandwidth;
+	MemoryGovernor memory;   // of the bodies of all requests
+	PartialStore partials;   // of canceled and failed transfers, to continue
+	volatile long received;  // body bytes of all transfers, from the threads
+	bool rebalance_due;      // a transfer started or finished
+public:
+	static const size_t kHostMaxHandles = 8;
+	static const size_t kGlobalMaxHandles = 16;
+	static const size_t kCompletionBatch = 8;
+	static const size_t kPartialBytes = 256 * 1024;
+	// Transfers one shard runs at once when there are several; the rest
+	// wait in its backlog, where idle shards can steal them
+	static const size_t kShardMaxHandles = 4;
+
+	// a_max_handles is where the adaptive limits per host and overall
+	// start; cache_bytes is the budget of the in-memory response cache, 0
+	// disables it
+	RequestManager(size_t a_max_handles,size_t cache_bytes = 0)
+		: coalesced(0),cancels(0),cancel_us_total(0),cancel_us_max(0),curlm(0),curlsh(0),
+		concurrency(a_max_handles,kHostMaxHandles,kGlobalMaxHandles),cache(cache_bytes),disk(0),
+		next_shard(0),completion_batch(kCompletionBatch),step_us(0),over_budget(0),
+		partials(kPartialBytes),received(0),rebalance_due(false)
+	{
+		partials.set_memory(&memory);
+	}
+	~RequestManager()
+	{
+		delete_shards();
+	}
+	// Current global limit of parallel transfers
+	size_t get_max_handles() const { return concurrency.get_global().allowed(); }
+	// Ceilings the adaptive limits may grow to
+	void set_max_handles(size_t per_host,size_t global) {
+		concurrency.set_max(per_host,global);
+	}
+	const ConcurrencyControl &get_concurrency() const { return concurrency; }
+	// Transfers per request, the first included; 1 never retries
+	void set_max_attempts(int n) {
+		retry.set_retries(n,100000,5000000);
+	}
+	// Starts a second transfer for requests running longer than percentile
+	// (0..1) of the transfers to their host did; 0 turns it off
+	void set_hedging(double percentile) {
+		retry.set_hedging(percentile);
+	}
+	const RetryPolicy &get_retry() const { return retry; }
+	// Capacity of the link the traffic classes share, in bytes per second;
+	// 0, the default, estimates it from the transfers
+	void set_bandwidth(curl_off_t bytes_per_second) {
+		bandwidth.set_bandwidth(bytes_per_second);
+	}
+	const BandwidthScheduler &get_bandwidth() const { return bandwidth; }
+	// Most bytes the bodies of all requests may take before transfers are
+	// paused, and where they resume; 0 for no limit. With a spill
+	// directory, finished bodies go to files there first.
+	void set_memory_limits(size_t high_water,size_t low_water = 0) {
+		memory.set_limits(high_water,low_water);
+	}
+	void set_spill_dir(const std::string &dir) {
+		memory.set_spill_dir(dir);
+	}
+	const MemoryGovernor &get_memory() const { return memory; }
+	// Budget of the partial bodies canceled and failed transfers leave
+	// behind, which a later request for the same URL continues with a
+	// Range request instead of downloading them again; 0 keeps none. They
+	// count against the memory limits and are the first thing given up
+	// past the high-water mark. A retry continues its own partial body
+	// regardless.
+	void set_partial_bytes(size_t bytes) {
+		partials.set_max_bytes(bytes);
+	}
+	const PartialStore &get_partials() const { return partials; }
+	const AdaptiveTimeouts &get_timeouts() const { return timeouts; }
+	// Requests waiting out the backoff before a retry
+	size_t get_delayed() const { return delayed.size(); }
+	const CurlShare &get_share() const { return share; }
+	// Latency histograms of the transfers to each host
+	const std::map<std::string,HostTiming> &get_timings() const { return timings; }
+	// p-th percentile (0..1) of the total transfer time to host, in us
+	int64_t get_latency_us(const std::string &host,double p) const {
+		std::map<std::string,HostTiming>::const_iterator f = timings.find(host);
+		return f == timings.end() ? 0 : f->second.total.percentile(p);
+	}
+	// With threads set, transfers run on that many NetworkThreads and
+	// step() only hands requests over and collects their completions; the
+	// multi handles then belong to the threads and 0 is returned. Requests
+	// go to the shard their host hashes to, so connections to a host are
+	// reused, and a shard with free slots steals from the others. In both
+	// modes DNS and cookies are shared through a share handle with lock
+	// callbacks.
+	CURLM *start(size_t threads = 0)
+	{
+		curlsh = share.init();
+		if( threads ) {
+			if( shards.size() != threads ) {
+				delete_shards();
+				for( size_t i = 0; i < threads; i++ )
+					shards.push_back(new NetworkThread(2 * kGlobalMaxHandles,threads > 1 ? kShardMaxHandles : 0));
+			}
+			bool started = true;
+			for( size_t i = 0; i < shards.size(); i++ ) {
+				shards[i]->set_peers(shards);
+				started = started && shards[i]->start();
+			}
+			if( started )
+				return 0;
+			printf("FALLING BACK TO STEPPING THE TRANSFERS IN THE GAME THREAD\n");
+			stop_shards();
+		}
+		return curlm = curl_multi_init();
+	}
+	CURLM *get_curlm() const {
+		return curlm;
+	}
+	bool is_threaded() const { return !shards.empty() && shards[0]->is_running(); }
+	const std::vector<NetworkThread *> &get_shards() const { return shards; }
+	// Most completions one step() takes from the shards, the rest wait for
+	// the next frame
+	void set_completion_batch(size_t n) {
+		completion_batch = n ? n : 1;
+	}
+	// Completions the shards have delivered which no step() took yet
+	size_t get_completion_backlog() const {
+		size_t n = 0;
+		for( size_t i = 0; is_threaded() && i < shards.size(); i++ )
+			n += shards[i]->get_backlog();
+		return n;
+	}
+	// traffic is the TrafficClass the transfer shares the link in. With a
+	// consumer, a 2xx body streams to it as it arrives and is kept nowhere,
+	// the caches included; such a request has a transfer of its own, as
+	// nobody could share a body which is not kept, and it always downloads
+	// the whole body, as there is no partial one to continue.
+	Request *get(const char *url,double score = 0,int traffic = kTrafficNormal,BodyConsumer *consumer = 0) {
+		Request *r = new Request(url);
+		r->set_traffic(traffic);
+		r->set_memory(&memory);
+		if( consumer ) {
+			r->set_consumer(consumer);
+			streams.insert(r);
+		}
+		queue.push_back(r);
+		std::string body;
+		if( cache.get_max_bytes() && cache.get(r->get_url(),&body) ) {
+			r->got_cached(body);
+			return r;
+		}
+		std::map<std::string,Request *>::iterator l = consumer ? leaders.end() : leaders.find(r->get_url());
+		if( l != leaders.end() ) {
+			// same URL already queued or downloading, share its transfer
+			r->follow(l->second);
+			double old;
+			if( pending.score_of(l->second,&old) && score < old )
+				pending.update(l->second,score);
+			if( traffic < l->second->get_traffic() ) {
+				l->second->set_traffic(traffic);
+				rebalance_due = true;
+			}
+			coalesced++;
+			return r;
+		}
+		if( disk && disk->is_open() ) {
+			CacheMeta meta;
+			switch( disk->lookup(r->get_url(),&meta) ) {
+			case DiskCache::kFresh:
+				if( disk->read(r->get_url(),&body) ) {
+					disk->got_fresh_hit();
+					cache.put(r->get_url(),body);
+					r->got_cached(body);
+					return r;
+				}
+				break;
+			case DiskCache::kStale:
+				if( meta.has_validators() )
+					r->set_conditions(meta);
+				break;
+			case DiskCache::kMiss:
+				break;
+			}
+		}
+		PartialStore::Partial partial;
+		if( !consumer && partials.take(r->get_url(),&partial) )
+			r->set_partial(partial.body,partial.validator);
+		if( !consumer )
+			leaders[r->get_url()] = r;
+		pending.push(r,score);
+		retry.got_request();
+		return r;
+	}
+	// A request for the bytes first..last of url, up to the end when last is
+	// negative, whose body streams to consumer; with a validator, only while
+	// the body is still that one (see Request::set_byte_range()). Segments
+	// of a body never come from the caches nor go to them.
+	Request *get_segment(const char *url,long first,long last,const std::string &validator,
+		BodyConsumer *consumer,double score = 0,int traffic = kTrafficNormal) {
+		Request *r = new Request(url);
+		r->set_traffic(traffic);
+		r->set_memory(&memory);
+		r->set_consumer(consumer);
+		r->set_byte_range(first,last,validator);
+		streams.insert(r);
+		queue.push_back(r);
+		pending.push(r,score);
+		retry.got_request();
+		return r;
+	}
+	// How many requests shared the transfer of another one
+	size_t get_coalesced() const { return coalesced; }
+	const RedirectMemo &get_redirects() const { return redirects; }
+	// Cancels a request right away. A queued request leaves the queue and a
+	// running transfer is removed from the multi handle, which frees its
+	// slot and buffers at once; libcurl keeps the connection if the
+	// response was complete and closes it otherwise. A transfer other
+	// requests are still waiting for keeps running for them. Returns false
+	// if r still has to wait for such a transfer to end.
+	bool cancel(Request *r) {
+		r->cancel();
+		switch( r->get_state() ) {
+		case kNone:
+			dequeue(r);
+			r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled while queued");
+			return true;
+		case kStarting:
+		case kDownloading:
+			if( Request *l = r->get_leader() ) {
+				r->leave();
+				r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled");
+				if( !l->waiters() && (l->get_curl() || l->get_hedge()) )
+					abort_transfer(l);
+				return true;
+			}
+			if( r->waiters() || r->get_aborted() )
+				return false;
+			{
+				// the worker still owns a running handle until it confirms
+				bool running = r->get_curl() != 0;
+				abort_transfer(r);
+				return !is_threaded() || !running;
+			}
+		case kOK:
+		case kError:
+			break;
+		}
+		return true;
+	}
+	size_t get_cancels() const { return cancels; }
+	// Mean and worst time from cancel() to the transfer's slot being free
+	int64_t get_cancel_us_mean() const { return cancels ? cancel_us_total / cancels : 0; }
+	int64_t get_cancel_us_max() const { return cancel_us_max; }
+	const ResponseCache &get_cache() const { return cache; }
+	// Persistent cache under the in-memory one, owned by the caller
+	void set_disk_cache(DiskCache *a_disk) {
+		disk = a_disk;
+	}
+	const DiskCache *get_disk_cache() const { return disk; }
+	// Changes the score of a request which has not been started yet
+	bool reprioritize(Request *r,double score) {
+		return pending.update(r,score);
+	}
+	// Re-scores every queued request, e.g. after the view has changed.
+	// Requests the callback gives a negative score are canceled; returns
+	// how many were canceled.
+	size_t rescore(RequestScoreFunc func,void *userdata) {
+		// scores change heap slots, so collect first and apply after the walk
+		std::list<std::pair<Request *,double> > scores;
+		for( size_t i = 0; i < pending.size(); i++ ) {
+			Request *r = pending.at(i);
+			scores.push_back(std::make_pair(r,func(r,userdata)));
+		}
+		size_t dropped = 0;
+		std::list<std::pair<Request *,double> >::iterator e = scores.end();
+		std::list<std::pair<Request *,double> >::iterator i = scores.begin();
+		for( ; i != e; i++ ) {
+			if( i->second < 0 ) {
+				pending.remove(i->first);
+				i->first->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled while queued");
+				finish_followers(i->first);
+				dropped++;
+			} else {
+				pending.update(i->first,i->second);
+			}
+		}
+		return dropped;
+	}
+	size_t queued_requests() const {
+		return pending.size();
+	}
+	// Runs one round of the transfers. With a budget in microseconds,
+	// finished transfers are handed out and queued requests started only
+	// until it is used up, and the rest waits for the next call; one of
+	// each always goes, so even a tiny budget makes progress. Polling the
+	// transfers and aborting abandoned ones is never deferred. Returns the
+	// microseconds spent.
+	int64_t step(int64_t budget_us = 0) {
+		int64_t begin = TimeUs();
+		if( !curlm && !is_threaded() ) {
+			printf("CURLM SHOULD BE INITIALIZED, call start() before!!!\n");
+			return 0;
+		}
+		{
+			// transfers nobody waits for anymore go now, not at the next
+			// progress callback
+			std::list<Request *> aborts;
+			std::map<CURL *,Request *>::iterator e = request_map.end();
+			std::map<CURL *,Request *>::iterator i = request_map.begin();
+			for( ; i != e; i++ ) {
+				// a hedge goes with the transfer it races, if that still runs
+				Request *o = i->second->get_hedge_of();
+				if( o && o->get_curl() )
+					continue;
+				if( !i->second->waiters() && !i->second->get_aborted() )
+					aborts.push_back(i->second);
+			}
+			std::list<Request *>::iterator ae = aborts.end();
+			std::list<Request *>::iterator ai = aborts.begin();
+			for( ; ai != ae; ai++ ) {
+				abort_transfer(*ai);
+			}
+		}
+		if( is_threaded() ) {
+			// round robin, so a busy shard cannot starve the others
+			NetworkThread::Completion c;
+			size_t idle = 0;
+			while( done.size() < completion_batch && idle < shards.size() ) {
+				NetworkThread *shard = shards[next_shard];
+				next_shard = (next_shard + 1) % shards.size();
+				if( !shard->poll(&c) ) {
+					idle++;
+					continue;
+				}
+				idle = 0;
+				ForDone d = { c.handle,c.result };
+				done.push_back(d);
+			}
+		} else {
+			int handles = 0;
+			CURLMcode code = CURLM_OK;
+			while( (code = curl_multi_perform(curlm, &handles)) == CURLM_CALL_MULTI_PERFORM )
+				;
+			if( code != CURLM_OK ) {
+				printf("SOMETHING BAD HAPPENS: %d!!!\n",code);
+				return TimeUs() - begin;
+			}
+
+			CURLMsg *msg; /* for picking up messages with the transfer status */
+			int msgs_left; /* how many messages are left */
+
+			while ((msg = curl_multi_info_read(curlm, &msgs_left))) {
+				if (msg->msg == CURLMSG_DONE) {
+					ForDone d = { msg->easy_handle,msg->data.result };
+					done.push_back(d);
+				}
+				if( msgs_left == 0 )
+					break;
+			}
+		}
+		for( size_t n = 0; !done.empty() && (!n || !expired(begin,budget_us)); n++ ) {
+			ForDone d = done.front();
+			done.pop_front();
+			finish_transfer(d.handle,d.result);
+		}
+
+		// retries whose backoff is over queue up again
+		int64_t now = TimeUs();
+		while( !delayed.empty() && delayed.begin()->first <= now ) {
+			Request *r = delayed.begin()->second;
+			delayed.erase(delayed.begin());
+			pending.push(r,r->get_score());
+		}
+		// hedges of slow transfers go first, those requests waited longest
+		if( retry.get_hedge_percentile() > 0 && !memory.over_high() )
+			start_hedges();
+
+		// start the most urgent requests while there are free handles and
+		// memory, requests for hosts at their limit keep their place in the
+		// queue. Past the high-water mark, one transfer still runs at a time.
+		std::list<std::pair<Request *,double> > held;
+		size_t started = 0;
+		while( !concurrency.global_full() && (!memory.over_high() || request_map.empty()) &&
+			!pending.empty() && (!started || !expired(begin,budget_us)) ) {
+			Request *r = pending.top();
+			double score = 0;
+			pending.score_of(r,&score);
+			pending.pop();
+			if( !r->waiters() ) {
+				r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled while queued");
+				finish_followers(r);
+				continue;
+			}
+			const std::string &host = r->get_host();
+			if( !concurrency.can_start(host) ) {
+				held.push_back(std::make_pair(r,score));
+				continue;
+			}
+			std::string target;
+			int hops = 0;
+			if( !r->is_direct() && redirects.rewrite(r->get_url(),&target,&hops) )
+				r->set_target(target,hops);
+			r->set_score(score);
+			launch(r);
+			started++;
+		}
+		std::list<std::pair<Request *,double> >::iterator he = held.end();
+		std::list<std::pair<Request *,double> >::iterator hi = held.begin();
+		for( ; hi != he; hi++ ) {
+			pending.push(hi->first,hi->second);
+		}
+		govern();
+		if( bandwidth.got_bytes(AtomicGet(&received),TimeUs()) || rebalance_due )
+			rebalance();
+		end_streams();
+		step_us = TimeUs() - begin;
+		if( budget_us && step_us > budget_us )
+			over_budget++;
+		return step_us;
+	}
+	int64_t get_step_us() const { return step_us; }
+	size_t get_over_budget() const { return over_budget; }
+	// Finished transfers waiting for a step() with budget left
+	size_t get_carried() const { return done.size(); }
+	const std::list<Request *> &get_queue() const { return queue; }
+	bool clean(Request *r) {
+		switch(r->get_state()) {
+		case kStarting:
+		case kDownloading:
+			if( !cancel(r) )
+				return false; // others wait for its transfer, it goes when done
+			// fall through
+		case kNone:
+		case kOK:
+		case kError:
+			{
+				std::list<Request *>::iterator e = queue.end();
+				std::list<Request *>::iterator i = queue.begin();
+				for( ; i != e; i++) {
+					if( (*i) == r ) {
+						break;
+					}
+				}
+				if( i == e ) {
+					printf("REQUEST LIST BAD FOR REQUEST %p WHILE CLEAN\n",r);
+					break;
+				}
+				dequeue(r);
+				if( streams.erase(r) )
+					r->end_stream();
+				if( r->get_state() == kError )
+					keep_partial(r);
+				delete r;
+				queue.erase(i);
+			}
+			break;
+		}
+		return true;
+	}
+	size_t active_requests() const {
+		return request_map.size();
+	}
+private:
+	// Takes a request out of the queue or the retries waiting for their
+	// backoff; if others follow it, the first of them takes its place
+	void dequeue(Request *r) {
+		double score = r->get_score();
+		if( pending.score_of(r,&score) )
+			pending.remove(r);
+		else if( !undelay(r) )
+			return;
+		if( r->has_followers() ) {
+			std::list<Request *> f = r->take_followers();
+			Request *n = f.front();
+			f.pop_front();
+			n->take_lead(f);
+			leaders[n->get_url()] = n;
+			pending.push(n,score);
+		} else {
+			std::map<std::string,Request *>::iterator l = leaders.find(r->get_url());
+			if( l != leaders.end() && l->second == r )
+				leaders.erase(l);
+		}
+	}
+	bool undelay(Request *r) {
+		std::multimap<int64_t,Request *>::iterator e = delayed.end();
+		std::multimap<int64_t,Request *>::iterator i = delayed.begin();
+		for( ; i != e; i++ ) {
+			if( i->second == r ) {
+				delayed.erase(i);
+				return true;
+			}
+		}
+		return false;
+	}
+	static bool expired(int64_t begin,int64_t budget_us) {
+		return budget_us && TimeUs() - begin >= budget_us;
+	}
+	// Hands a request's transfer to the multi handle or a shard
+	void launch(Request *r) {
+		r->set_timeouts(timeouts.get(r->get_host()));
+		CURL *handle = r->start(curlsh);
+		r->set_meter(&received);
+		request_map[handle] = r;
+		rebalance_due = true;
+		if( is_threaded() )
+			shards[shard_of(r->get_host())]->submit(handle);
+		else
+			curl_multi_add_handle(curlm, handle);
+		concurrency.started(r->get_host());
+		r->got_started();
+	}
+	// Starts a hedge for every transfer which has run longer than the
+	// hedging percentile of its host, while the ceilings and the budget
+	// allow. A hedge which is that slow itself is replaced by a new one.
+	void start_hedges() {
+		int64_t now = TimeUs();
+		std::list<Request *> slow;
+		std::map<CURL *,Request *>::iterator e = request_map.end();
+		std::map<CURL *,Request *>::iterator i = request_map.begin();
+		for( ; i != e; i++ ) {
+			Request *t = i->second;
+			Request *r = t->get_hedge_of() ? t->get_hedge_of() : t;
+			if( (t == r && r->get_hedge()) || t->get_aborted() || r->get_aborted() || !r->waiters() )
+				continue;
+			std::map<std::string,HostTiming>::const_iterator h = timings.find(r->get_host());
+			int64_t after = retry.hedge_after_us(h == timings.end() ? LatencyHistogram() : h->second.total);
+			if( now - t->get_started_at() >= after )
+				slow.push_back(r);
+		}
+		std::list<Request *>::iterator se = slow.end();
+		std::list<Request *>::iterator si = slow.begin();
+		for( ; si != se; si++ ) {
+			if( !concurrency.can_hedge((*si)->get_host()) )
+				continue;
+			if( !retry.may_hedge() )
+				break;
+			drop_hedge(*si);
+			Request *h = (*si)->make_hedge();
+			hedges.insert(h);
+			launch(h);
+		}
+	}
+	// Queues a failed request again after its backoff, if the policy and
+	// the budget allow another attempt
+	bool schedule_retry(Request *r) {
+		if( !retry.may_retry(r->get_attempts()) )
+			return false;
+		r->retry();
+		delayed.insert(std::make_pair(TimeUs() + retry.backoff_us(r->get_attempts()),r));
+		return true;
+	}
+	// Hands out the result of a transfer which left the multi handle
+	void finish_transfer(CURL *handle,CURLcode result) {
+		std::map<CURL *,Request *>::iterator f = request_map.find(handle);
+		if( f == request_map.end() ) {
+			printf("REQUEST NOT FOUND FOR HANDLE %p\n",handle);
+			return;
+		}
+		Request *r = f->second;
+		request_map.erase(f);
+		rebalance_due = true;
+		if( r->get_aborted() ) {
+			// the worker let go of a transfer abort_transfer() took down
+			got_aborted(r);
+			return;
+		}
+		if( !is_threaded() )
+			curl_multi_remove_handle(curlm, handle);
+		if( hedges.count(r) ) {
+			finish_hedge(r,result);
+			return;
+		}
+		if( !r->waiters() )
+			got_released(r);
+		if( result != CURLE_OK )
+			r->got_error(result,curl_easy_strerror(result));
+		else
+			r->got_done();
+		got_finished(r,result);
+		record_timing(r,result);
+		// a segment which is refused is up to whoever asked for it
+		bool refused = false;
+		if( r->get_range_first() < 0 ) {
+			if( r->get_range() == kRangeResumed )
+				partials.got_resume(r->get_resume_from());
+			else if( r->get_range() != kRangeNone )
+				partials.got_refusal();
+			refused = r->get_range() == kRangeRefused;
+		}
+		// a rewrite which led nowhere is no fault of the request
+		bool misrouted = r->get_target().size() && (result != CURLE_OK || r->get_response_code() >= 400);
+		if( r->waiters() && (refused || misrouted || RetryPolicy::retryable(result,r->get_response_code())) ) {
+			// a running hedge may still answer, otherwise try again later
+			if( r->get_hedge() ) {
+				r->wait_for_hedge();
+				return;
+			}
+			if( refused ) {
+				// the partial body is gone, so this cannot happen twice
+				r->retry();
+				pending.push(r,r->get_score());
+				return;
+			}
+			if( misrouted ) {
+				// once, to its own URL, which is never rewritten again
+				got_redirects(r,result);
+				r->retry();
+				r->go_direct();
+				pending.push(r,r->get_score());
+				return;
+			}
+			if( schedule_retry(r) )
+				return;
+		}
+		drop_hedge(r);
+		if( result == CURLE_OK )
+			got_response(r);
+		got_redirects(r,result);
+		finish_followers(r);
+	}
+	// A hedge finished. A usable response completes the request it raced
+	// for, taking the other transfer down; a failure leaves the request to
+	// its own transfer, or to a retry when that failed already.
+	void finish_hedge(Request *h,CURLcode result) {
+		if( result != CURLE_OK )
+			h->got_error(result,curl_easy_strerror(result));
+		else
+			h->got_done();
+		got_finished(h,result);
+		record_timing(h,result);
+		Request *r = h->get_hedge_of();
+		if( !r ) {
+			delete_hedge(h);
+			return;
+		}
+		bool failed = RetryPolicy::retryable(result,h->get_response_code());
+		if( r->get_curl() ) {
+			if( failed ) {
+				r->unlink_hedge();
+				delete_hedge(h);
+			} else if( !r->get_aborted() ) {
+				// got_aborted() completes r with the hedge's response
+				abort_transfer(r);
+			}
+			return;
+		}
+		if( failed && r->waiters() && schedule_retry(r) ) {
+			r->unlink_hedge();
+			delete_hedge(h);
+			return;
+		}
+		got_hedge_response(r);
+	}
+	// Completes a request whose transfer is over with the response of its
+	// hedge
+	void got_hedge_response(Request *r) {
+		Request *h = r->get_hedge();
+		r->unlink_hedge();
+		r->got_shared(h);
+		if( r->get_state() == kOK ) {
+			retry.got_hedge_won();
+			got_response(r);
+		}
+		got_redirects(h,h->get_errcode());
+		delete_hedge(h);
+		finish_followers(r);
+	}
+	// Takes down the hedge of a request which does not need it anymore
+	void drop_hedge(Request *r) {
+		Request *h = r->get_hedge();
+		if( !h )
+			return;
+		r->unlink_hedge();
+		if( h->get_curl() )
+			abort_transfer(h);
+		else
+			delete_hedge(h);
+	}
+	void delete_hedge(Request *h) {
+		hedges.erase(h);
+		delete h;
+	}
+	// Remembers where permanent redirects led, and forgets it again when a
+	// request sent there directly fails
+	void got_redirects(const Request *r,CURLcode result) {
+		bool failed = result != CURLE_OK || r->get_response_code() >= 400;
+		if( r->get_target().size() && failed )
+			redirects.forget(r->get_url());
+		else if( !failed && r->get_moved_hops() )
+			redirects.learn(r->get_url(),r->get_moved_to(),r->get_target_hops() + r->get_moved_hops());
+	}
+	// Takes a running transfer down. In threaded mode the handle stays with
+	// the worker until it confirms, and the rest happens in step().
+	void abort_transfer(Request *r) {
+		CURL *handle = r->get_curl();
+		r->abort();
+		if( !handle ) {
+			// waiting for its hedge, nothing of its own runs
+			got_aborted(r);
+			return;
+		}
+		if( is_threaded() ) {
+			// it may have been stolen by another shard
+			for( size_t i = 0; i < shards.size(); i++ )
+				shards[i]->remove(handle);
+			return;
+		}
+		curl_multi_remove_handle(curlm, handle);
+		request_map.erase(handle);
+		rebalance_due = true;
+		// a carried result must not outlive the handle, whose address the
+		// next transfer may get
+		std::list<ForDone>::iterator e = done.end();
+		std::list<ForDone>::iterator i = done.begin();
+		while( i != e ) {
+			if( i->handle == handle )
+				i = done.erase(i);
+			else
+				i++;
+		}
+		got_aborted(r);
+	}
+	void got_aborted(Request *r) {
+		if( hedges.count(r) ) {
+			got_finished(r,CURLE_ABORTED_BY_CALLBACK);
+			Request *o = r->get_hedge_of();
+			if( o )
+				o->unlink_hedge();
+			delete_hedge(r);
+			// nobody wants the request which waited for this hedge
+			if( o && !o->get_curl() )
+				got_aborted(o);
+			return;
+		}
+		got_released(r);
+		bool had_transfer = r->get_curl() != 0;
+		r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled");
+		Request *h = r->get_hedge();
+		bool answered = h && (h->get_state() == kOK || h->get_state() == kError);
+		if( !answered )
+			keep_partial(r);
+		r->release_content();
+		if( had_transfer )
+			got_finished(r,CURLE_ABORTED_BY_CALLBACK);
+		if( answered ) {
+			// taken down because the hedge answered first
+			got_hedge_response(r);
+			return;
+		}
+		drop_hedge(r);
+		finish_followers(r);
+	}
+	// Feeds the outcome of a transfer to the concurrency control; only
+	// failures which say something about the path count as errors
+	void got_finished(const Request *r,CURLcode result) {
+		const std::string &host = r->get_host();
+		switch( result ) {
+		case CURLE_OK:
+			concurrency.finished(host,r->get_response_code() < 500,
+				r->get_rtt(),r->get_throttled() ? 0 : r->get_downloaded(),r->get_total_time());
+			break;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_RECV_ERROR:
+		case CURLE_SEND_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			concurrency.finished(host,false,0,0,0);
+			break;
+		default:
+			concurrency.stopped(host);
+			break;
+		}
+	}
+	// Folds the timing of a finished transfer into the histograms and the
+	// timeout estimates of its host; failures are only counted
+	void record_timing(const Request *r,CURLcode result) {
+		HostTiming &t = timings[r->get_host()];
+		if( result == CURLE_OK && r->get_response_code() < 500 ) {
+			t.add(r->get_timing());
+			timeouts.got_transfer(r->get_host(),r->get_timing(),!r->get_throttled());
+		} else {
+			t.add_error();
+			if( result == CURLE_OPERATION_TIMEDOUT )
+				timeouts.got_timeout(r->get_host());
+		}
+	}
+	// Tells the consumers of requests which finished for good; a request
+	// waiting for a retry or its hedge is not done yet
+	void end_streams() {
+		std::set<Request *>::iterator e = streams.end();
+		std::set<Request *>::iterator i = streams.begin();
+		while( i != e ) {
+			Request *r = *i;
+			if( r->get_state() == kOK || r->get_state() == kError ) {
+				r->end_stream();
+				streams.erase(i++);
+			} else {
+				i++;
+			}
+		}
+	}
+	// Shares the link out again among the running transfers and tells those
+	// whose grant changed; a handle in threaded mode may have been stolen,
+	// so every shard hears of it
+	void rebalance() {
+		rebalance_due = false;
+		std::vector<BandwidthScheduler::Flow *> flows;
+		std::vector<Request *> running;
+		std::map<CURL *,Request *>::iterator e = request_map.end();
+		std::map<CURL *,Request *>::iterator i = request_map.begin();
+		for( ; i != e; i++ ) {
+			if( i->second->get_aborted() )
+				continue;
+			flows.push_back(&i->second->get_flow());
+			running.push_back(i->second);
+		}
+		bandwidth.rebalance(flows,TimeUs());
+		for( size_t n = 0; n < running.size(); n++ ) {
+			if( flows[n]->changed )
+				throttle(running[n]);
+		}
+	}
+	// Applies the grant of a running transfer, paused as well while the
+	// memory governor holds it
+	void throttle(Request *r) {
+		const BandwidthScheduler::Flow &f = r->get_flow();
+		bool paused = f.paused || r->get_hold_applied();
+		if( f.rate || paused )
+			r->got_throttled();
+		// a handle still in a backlog cannot be paused, it trickles
+		curl_off_t rate = paused ? BandwidthScheduler::kMinRate : f.rate;
+		const Timeouts &t = r->get_timeouts();
+		if( is_threaded() ) {
+			for( size_t s = 0; s < shards.size(); s++ )
+				shards[s]->throttle(r->get_curl(),rate,paused,t.low_speed_limit,t.low_speed_time);
+		} else {
+			ThrottleTransfer(r->get_curl(),rate,paused,t.low_speed_limit,t.low_speed_time);
+		}
+	}
+	// Keeps the bodies within the memory budget: drops kept partial bodies,
+	// spills finished ones when there is a directory for them, keeps
+	// transfers whose write callback paused them paused, low speed check
+	// off, until enough was cleaned, and lets the one with the most
+	// received go on meanwhile
+	void govern() {
+		if( !memory.get_high_water() )
+			return;
+		while( memory.over_high() && partials.drop_oldest() )
+			;
+		if( memory.excess() && memory.get_spill_dir().size() )
+			spill();
+		bool over = memory.over_low();
+		Request *exempt = 0;
+		Request *next = 0;
+		std::map<CURL *,Request *>::iterator e = request_map.end();
+		std::map<CURL *,Request *>::iterator i = request_map.begin();
+		for( ; i != e; i++ ) {
+			Request *r = i->second;
+			if( r->get_aborted() )
+				continue;
+			if( r->get_exempt() )
+				exempt = r;
+			if( !r->get_held() )
+				continue;
+			if( !over ) {
+				r->release_hold();
+				throttle(r);
+				continue;
+			}
+			if( !r->get_hold_applied() ) {
+				memory.got_hold();
+				r->got_hold();
+				throttle(r);
+			}
+			if( !next || r->get_content_length() > next->get_content_length() )
+				next = r;
+		}
+		if( exempt && !over ) {
+			exempt->set_exempt(false);
+		} else if( !exempt && next ) {
+			next->set_exempt(true);
+			next->release_hold();
+			throttle(next);
+		}
+	}
+	// Writes finished bodies to files, largest first, until the rest fits
+	// under the low-water mark
+	void spill() {
+		std::multimap<size_t,Request *> bodies;
+		std::list<Request *>::iterator e = queue.end();
+		std::list<Request *>::iterator i = queue.begin();
+		for( ; i != e; i++ ) {
+			Request *r = *i;
+			if( r->get_state() == kOK && !r->get_spilled() && r->get_content_length() )
+				bodies.insert(std::make_pair(r->get_content_length(),r));
+		}
+		long excess = memory.excess();
+		std::multimap<size_t,Request *>::reverse_iterator be = bodies.rend();
+		std::multimap<size_t,Request *>::reverse_iterator bi = bodies.rbegin();
+		for( ; bi != be && excess > 0; bi++ ) {
+			std::string path = memory.spill_path();
+			if( !bi->second->spill_content(path) ) {
+				printf("CAN'T SPILL A BODY TO %s\n",path.c_str());
+				return;
+			}
+			memory.got_spill(bi->first);
+			excess -= (long)bi->first;
+		}
+	}
+	// Keeps what a transfer nobody waits for anymore received, if a later
+	// one can continue it
+	void keep_partial(const Request *r) {
+		std::string validator = r->get_partial_validator();
+		if( validator.size() )
+			partials.put(r->get_url(),validator,r->get_content());
+	}
+	void got_released(const Request *r) {
+		if( !r->get_cancel_at() )
+			return;
+		int64_t us = TimeUs() - r->get_cancel_at();
+		cancels++;
+		cancel_us_total += us;
+		if( us > cancel_us_max )
+			cancel_us_max = us;
+	}
+	// Hands the result of a finished leader on to the requests waiting for it
+	void finish_followers(Request *r) {
+		std::map<std::string,Request *>::iterator l = leaders.find(r->get_url());
+		if( l != leaders.end() && l->second == r )
+			leaders.erase(l);
+		std::list<Request *> f = r->take_followers();
+		std::list<Request *>::iterator e = f.end();
+		std::list<Request *>::iterator i = f.begin();
+		for( ; i != e; i++ ) {
+			(*i)->got_shared(r);
+		}
+	}
+	// Feeds a finished response to the caches, a 304 takes the body of the
+	// revalidated disk copy
+	void got_response(Request *r) {
+		std::string body;
+		switch( r->get_response_code() ) {
+		case 200:
+			if( r->get_streamed() )
+				break; // there is no body to keep
+			cache.put(r->get_url(),r->get_content());
+			if( disk && disk->is_open() )
+				disk->put(r->get_url(),r->get_meta(),r->get_content());
+			break;
+		case 304:
+			if( disk && disk->read(r->get_url(),&body) ) {
+				disk->refresh(r->get_url(),r->get_meta());
+				cache.put(r->get_url(),body);
+				r->got_cached(body);
+			} else {
+				printf("NOT MODIFIED BUT NO CACHED BODY FOR %s\n",r->get_url().c_str());
+			}
+			break;
+		}
+	}
+public:
+	void stop() {
+		if( disk )
+			disk->flush();
+		{
+			std::list<Request *>::iterator e = queue.end();
+			std::list<Request *>::iterator i = queue.begin();
+			for( ; i != e; i++ ) {
+				(*i)->cancel();
+			}
+		}
+		while( !pending.empty() ) {
+			Request *r = pending.pop();
+			r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled while queued");
+			finish_followers(r);
+		}
+		while( !delayed.empty() ) {
+			Request *r = delayed.begin()->second;
+			delayed.erase(delayed.begin());
+			r->got_error(CURLE_ABORTED_BY_CALLBACK,"Canceled while queued");
+			finish_followers(r);
+		}
+		while( active_requests() ) {
+			step();
+		}
+		if( curlm )
+			curl_multi_cleanup(curlm);
+		curlm = 0;
+		stop_shards();
+		share.cleanup();
+		curlsh = 0;
+	}
+private:
+	// FNV-1a of the host, the same host always lands on the same shard
+	size_t shard_of(const std::string &host) const {
+		unsigned long h = 2166136261u;
+		for( size_t i = 0; i < host.size(); i++ ) {
+			h ^= (unsigned char)host[i];
+			h *= 16777619u;
+		}
+		return (size_t)(h % shards.size());
+	}
+	// Peers steal from each other, so all of them stop before any goes
+	void stop_shards() {
+		for( size_t i = 0; i < shards.size(); i++ )
+			shards[i]->stop();
+	}
+	void delete_shards() {
+		stop_shards();
+		for( size_t i = 0; i < shards.size(); i++ )
+			delete shards[i];
+		shards.clear();
+	}
+};
+
+#endif /* !REQUEST_MANAGER_H */
@@ -0,0 +1,85 @@
+// Where the time of a transfer went, per request and per host
+//-----------------------------------------------------------------------------
+
+#ifndef REQUEST_TIMING_H
+#define REQUEST_TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+#include "LatencyHistogram.h"
+
+// The CURLINFO times of one finished transfer. libcurl reports them as
+// seconds from the start of the transfer, each including the phases
+// before it; the accessors return the phases themselves in microseconds.
+// A transfer which reused a connection has no lookup and connect time.
+struct RequestTiming {
+	double namelookup;
+	double connect;
+	double pretransfer;
+	double starttransfer;
+	double total;
+	double downloaded;  // body bytes
+	long connects;      // new connections this transfer opened
+
+	RequestTiming()
+		: namelookup(0),connect(0),pretransfer(0),starttransfer(0),total(0),downloaded(0),connects(0)
+	{
+	}
+	void read(CURL *curl) {
+		curl_easy_getinfo(curl,CURLINFO_NAMELOOKUP_TIME,&namelookup);
+		curl_easy_getinfo(curl,CURLINFO_CONNECT_TIME,&connect);
+		curl_easy_getinfo(curl,CURLINFO_PRETRANSFER_TIME,&pretransfer);
+		curl_easy_getinfo(curl,CURLINFO_STARTTRANSFER_TIME,&starttransfer);
+		curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME,&total);
+		curl_easy_getinfo(curl,CURLINFO_SIZE_DOWNLOAD,&downloaded);
+		curl_easy_getinfo(curl,CURLINFO_NUM_CONNECTS,&connects);
+	}
+	int64_t dns_us() const { return us(namelookup); }
+	int64_t connect_us() const { return us(connect - namelookup); }
+	// request sent to first byte
+	int64_t wait_us() const { return us(starttransfer - pretransfer); }
+	// first byte to last
+	int64_t receive_us() const { return us(total - starttransfer); }
+	int64_t total_us() const { return us(total); }
+private:
+	static int64_t us(double seconds) {
+		return seconds > 0 ? (int64_t)(seconds * 1000000 + 0.5) : 0;
+	}
+};
+
+// Aggregate timings of the transfers to one host
+struct HostTiming {
+	LatencyHistogram dns;     // transfers which opened a connection only
+	LatencyHistogram connect; // the same
+	LatencyHistogram wait;
+	LatencyHistogram total;
+	size_t requests;
+	size_t errors;
+	size_t connects;
+	double bytes;
+
+	HostTiming()
+		: requests(0),errors(0),connects(0),bytes(0)
+	{
+	}
+	void add(const RequestTiming &t) {
+		if( t.connects > 0 ) {
+			dns.record(t.dns_us());
+			connect.record(t.connect_us());
+			connects += t.connects;
+		}
+		wait.record(t.wait_us());
+		total.record(t.total_us());
+		bytes += t.downloaded;
+		requests++;
+	}
+	void add_error() {
+		errors++;
+	}
+	double connects_per_request() const {
+		return requests ? (double)connects / requests : 0.0;
+	}
+};
+
+#endif /* !REQUEST_TIMING_H */
@@ -0,0 +1,157 @@
+// In-memory response cache with a byte budget
+//-----------------------------------------------------------------------------
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Response bodies keyed by URL, evicted least recently used first once the
+// byte budget is exceeded. The budget counts the URL, the body and a fixed
+// per-entry overhead, so it can be sized against the device heap
+// (Memsize0 in app.icf). A hash index over the LRU list keeps lookups,
+// inserts and evictions O(1).
+class ResponseCache {
+	struct Entry {
+		std::string url;
+		std::string body;
+		size_t hash;
+	};
+	typedef std::list<Entry> Lru; // most recently used first
+	Lru lru;
+	std::vector<std::vector<Lru::iterator> > buckets;
+	size_t max_bytes;
+	size_t bytes;
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t bytes_saved;
+
+	// Forbid copying
+	ResponseCache(const ResponseCache &);
+	ResponseCache &operator=(const ResponseCache &);
+public:
+	// Rough cost of the list node, the index slot and two string headers
+	static const size_t kEntryOverhead = 64;
+
+	ResponseCache(size_t a_max_bytes)
+		: buckets(16),max_bytes(a_max_bytes),bytes(0),
+		hits(0),misses(0),evictions(0),bytes_saved(0)
+	{
+	}
+	// Copies the cached body of url into *body and marks it recently used
+	bool get(const std::string &url,std::string *body) {
+		Lru::iterator *slot = find(url,hash_of(url));
+		if( !slot ) {
+			misses++;
+			return false;
+		}
+		lru.splice(lru.begin(),lru,*slot);
+		*body = (*slot)->body;
+		hits++;
+		bytes_saved += body->size();
+		return true;
+	}
+	bool put(const std::string &url,const std::string &body) {
+		size_t cost = cost_of(url,body);
+		// the old body is stale either way
+		erase(url);
+		if( cost > max_bytes )
+			return false;
+		while( bytes + cost > max_bytes && !lru.empty() ) {
+			evict_last();
+		}
+		Entry n;
+		n.url = url;
+		n.hash = hash_of(url);
+		lru.push_front(n);
+		lru.front().body = body;
+		bucket(n.hash).push_back(lru.begin());
+		bytes += cost;
+		if( lru.size() > buckets.size() * 2 )
+			rehash(buckets.size() * 2);
+		return true;
+	}
+	bool erase(const std::string &url) {
+		size_t h = hash_of(url);
+		std::vector<Lru::iterator> &b = bucket(h);
+		for( size_t i = 0; i < b.size(); i++ ) {
+			if( b[i]->hash == h && b[i]->url == url ) {
+				bytes -= cost_of(b[i]->url,b[i]->body);
+				lru.erase(b[i]);
+				b[i] = b.back();
+				b.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+	void clear() {
+		lru.clear();
+		for( size_t i = 0; i < buckets.size(); i++ )
+			buckets[i].clear();
+		bytes = 0;
+	}
+	size_t get_entries() const { return lru.size(); }
+	size_t get_bytes() const { return bytes; }
+	size_t get_max_bytes() const { return max_bytes; }
+	size_t get_hits() const { return hits; }
+	size_t get_misses() const { return misses; }
+	size_t get_evictions() const { return evictions; }
+	size_t get_bytes_saved() const { return bytes_saved; }
+	double hit_ratio() const {
+		size_t lookups = hits + misses;
+		return lookups ? (double)hits / lookups : 0.0;
+	}
+private:
+	static size_t cost_of(const std::string &url,const std::string &body) {
+		return url.size() + body.size() + kEntryOverhead;
+	}
+	// 32-bit FNV-1a, whatever the width of size_t
+	static size_t hash_of(const std::string &s) {
+		uint32_t h = 2166136261u;
+		for( size_t i = 0; i < s.size(); i++ ) {
+			h ^= (unsigned char)s[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+	std::vector<Lru::iterator> &bucket(size_t h) {
+		return buckets[h % buckets.size()];
+	}
+	Lru::iterator *find(const std::string &url,size_t h) {
+		std::vector<Lru::iterator> &b = bucket(h);
+		for( size_t i = 0; i < b.size(); i++ ) {
+			if( b[i]->hash == h && b[i]->url == url )
+				return &b[i];
+		}
+		return 0;
+	}
+	void evict_last() {
+		Lru::iterator last = lru.end();
+		--last;
+		std::vector<Lru::iterator> &b = bucket(last->hash);
+		for( size_t i = 0; i < b.size(); i++ ) {
+			if( b[i] == last ) {
+				b[i] = b.back();
+				b.pop_back();
+				break;
+			}
+		}
+		bytes -= cost_of(last->url,last->body);
+		lru.erase(last);
+		evictions++;
+	}
+	void rehash(size_t n) {
+		std::vector<std::vector<Lru::iterator> > old(n);
+		old.swap(buckets);
+		for( Lru::iterator i = lru.begin(); i != lru.end(); i++ )
+			bucket(i->hash).push_back(i);
+	}
+};
+
+#endif /* !RESPONSE_CACHE_H */
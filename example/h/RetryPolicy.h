@@ -0,0 +1,167 @@
+// Retries with backoff, hedged requests, and the budget they share
+//-----------------------------------------------------------------------------
+
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+#include "TimeUs.h"
+#include "LatencyHistogram.h"
+
+// Decides whether a failed transfer is tried again and when, and whether a
+// slow one gets a duplicate racing it.
+//
+// Only failures another attempt may fix are retried: resolve, connect,
+// send and receive errors, timeouts, and the statuses 429, 502, 503 and
+// 504. The n-th retry waits a random time between 0 and
+// min(cap, base * 2^(n-1)), the "full jitter" backoff, so requests which
+// failed together do not all come back together.
+//
+// A hedge is a second transfer for the same URL, started once the first
+// has run longer than a percentile of the latencies seen on its host. The
+// first usable response wins and the other transfer is taken down. At the
+// 95th percentile that costs about 5% more transfers and cuts off the
+// tail beyond it. Until the host has kHedgeMinSamples latencies, a
+// transfer is hedged after a fixed second instead. Hedging is off until
+// set_hedging() is called.
+//
+// Retries and hedges are paid for from a budget: every new request adds
+// budget_ratio of a token, up to budget_max, and each retry or hedge
+// takes a whole one. When everything fails, the transfers are thus at most
+// 1 + budget_ratio times the requests, and an outage is not made worse by
+// the retries it causes.
+class RetryPolicy {
+public:
+	// Latencies of a host needed before its percentile means anything
+	static const size_t kHedgeMinSamples = 20;
+private:
+	int max_attempts;       // transfers per request, the first included
+	int64_t base_us;
+	int64_t cap_us;
+	double budget_ratio;
+	double budget_max;
+	double tokens;
+	double hedge_percentile; // 0..1, 0 is off
+	int64_t hedge_min_us;   // never hedge sooner
+	int64_t hedge_cold_us;  // while the percentile is not known yet
+	uint32_t seed;
+	size_t retries;
+	size_t retries_denied;  // by the budget
+	size_t hedges;
+	size_t hedges_won;
+public:
+	RetryPolicy()
+		: max_attempts(3),base_us(100000),cap_us(5000000),
+		budget_ratio(0.1),budget_max(10),tokens(10),
+		hedge_percentile(0),hedge_min_us(50000),hedge_cold_us(1000000),
+		seed((uint32_t)TimeUs() | 1),
+		retries(0),retries_denied(0),hedges(0),hedges_won(0)
+	{
+	}
+	// max_attempts 1 never retries
+	void set_retries(int a_max_attempts,int64_t a_base_us,int64_t a_cap_us) {
+		max_attempts = a_max_attempts < 1 ? 1 : a_max_attempts;
+		base_us = a_base_us;
+		cap_us = a_cap_us;
+	}
+	void set_budget(double ratio,double max) {
+		budget_ratio = ratio;
+		budget_max = max;
+		if( tokens > max )
+			tokens = max;
+	}
+	// Hedges transfers running longer than percentile (0..1) of those to
+	// their host did, and min_us at least; 0 turns hedging off
+	void set_hedging(double percentile,int64_t min_us = 50000) {
+		hedge_percentile = percentile;
+		hedge_min_us = min_us;
+	}
+	double get_hedge_percentile() const { return hedge_percentile; }
+
+	// Failures which may go away when tried again
+	static bool retryable(CURLcode result,long status) {
+		switch( result ) {
+		case CURLE_OK:
+			return status == 429 || status == 502 || status == 503 || status == 504;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			return true;
+		default:
+			return false;
+		}
+	}
+	// A new request, which pays into the budget
+	void got_request() {
+		tokens += budget_ratio;
+		if( tokens > budget_max )
+			tokens = budget_max;
+	}
+	// Whether a request whose attempts failed may have another one; takes
+	// a token if so
+	bool may_retry(int attempts) {
+		if( attempts >= max_attempts )
+			return false;
+		if( !take() ) {
+			retries_denied++;
+			return false;
+		}
+		retries++;
+		return true;
+	}
+	// Random wait before the retry-th retry, in us
+	int64_t backoff_us(int retry) {
+		int64_t ceiling = base_us;
+		for( int i = 1; i < retry && ceiling < cap_us; i++ )
+			ceiling *= 2;
+		if( ceiling > cap_us )
+			ceiling = cap_us;
+		return ceiling > 0 ? (int64_t)(next_random() % (uint32_t)(ceiling + 1)) : 0;
+	}
+	// How long a transfer runs before it is hedged, given the latencies of
+	// its host
+	int64_t hedge_after_us(const LatencyHistogram &latencies) const {
+		if( latencies.count() < kHedgeMinSamples )
+			return hedge_cold_us;
+		int64_t p = latencies.percentile(hedge_percentile);
+		return p > hedge_min_us ? p : hedge_min_us;
+	}
+	// Takes a token for a hedge if there is one
+	bool may_hedge() {
+		if( !take() )
+			return false;
+		hedges++;
+		return true;
+	}
+	void got_hedge_won() {
+		hedges_won++;
+	}
+	size_t get_retries() const { return retries; }
+	size_t get_retries_denied() const { return retries_denied; }
+	size_t get_hedges() const { return hedges; }
+	// Hedges which answered first
+	size_t get_hedges_won() const { return hedges_won; }
+	double get_tokens() const { return tokens; }
+private:
+	bool take() {
+		if( tokens < 1 )
+			return false;
+		tokens -= 1;
+		return true;
+	}
+	// xorshift32, the jitter needs no more
+	uint32_t next_random() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+};
+
+#endif /* !RETRY_POLICY_H */
@@ -0,0 +1,416 @@
+// Downloads one large object as byte ranges in parallel into a file
+//-----------------------------------------------------------------------------
+
+#ifndef SEGMENTED_DOWNLOAD_H
+#define SEGMENTED_DOWNLOAD_H
+
+#include <string>
+#include <list>
+#include <stdio.h>
+#include <stdint.h>
+#include "RequestManager.h"
+#include "BodyConsumer.h"
+#include "Atomic.h"
+#include "TimeUs.h"
+
+// Writes the body of one segment at its offset in the output file. The
+// file is opened at the first byte, so a segment which never starts costs
+// no handle; a retry starts the segment over.
+class SegmentWriter : public BodyConsumer {
+	std::string path;
+	long offset;
+	FILE *f;
+	volatile long written;  // bytes of the segment in the file so far
+	volatile long *meter;   // bytes written by all segments
+	bool ended;
+	bool ok;
+
+	// Forbid copying
+	SegmentWriter(const SegmentWriter &);
+	SegmentWriter &operator=(const SegmentWriter &);
+public:
+	SegmentWriter(const std::string &a_path,long a_offset,volatile long *a_meter)
+		: path(a_path),offset(a_offset),f(0),written(0),meter(a_meter),ended(false),ok(false)
+	{
+	}
+	~SegmentWriter()
+	{
+		if( f )
+			fclose(f);
+	}
+	bool got_chunk(const char *data,size_t size) {
+		if( !f ) {
+			f = fopen(path.c_str(),"r+b");
+			if( !f || fseek(f,offset + AtomicGet(&written),SEEK_SET) != 0 )
+				return false;
+		}
+		if( fwrite(data,1,size,f) != size )
+			return false;
+		AtomicAdd(&written,(long)size);
+		AtomicAdd(meter,(long)size);
+		return true;
+	}
+	void got_reset() {
+		if( f )
+			fclose(f);
+		f = 0;
+		AtomicSet(&written,0);
+	}
+	void got_end(bool a_ok) {
+		ok = a_ok;
+		if( f && fclose(f) != 0 )
+			ok = false;
+		f = 0;
+		ended = true;
+	}
+	long get_offset() const { return offset; }
+	long get_written() const { return AtomicGet((volatile long *)&written); }
+	bool get_ended() const { return ended; }
+	bool get_ok() const { return ok; }
+};
+
+// A large object, a map pack say, fetched as segments running in parallel
+// on the request manager, so a high-latency link carries more than one
+// connection's window at a time. The first segment asks for kFirstBytes;
+// once its Content-Range tells the size of the object, the file is
+// preallocated and the rest is split into segments, which later ones ask
+// for with the validator of the first as If-Range, so they are all of the
+// same object. A server which answers the first segment with the whole
+// body gets to send it that way.
+//
+// How many segments run at once adapts to the throughput: every
+// kWindowUs with segments still waiting, one more is let in for as long
+// as that raised the throughput by kGainPercent, and one taken back once
+// it did not. Every kProbeWindows windows after that it tries one more
+// again, in case the link changed.
+//
+// A segment which failed for good is asked for again from where its bytes
+// in the file end, up to kMaxFailures times in all; if the object changed
+// meanwhile, it starts over once. step() goes after every
+// RequestManager::step(), on the same thread; the download has to be
+// finished or canceled and stepped until get_idle() before the manager
+// stops or it is deleted.
+class SegmentedDownload {
+public:
+	enum State {
+		kIdle,                // not started
+		kRunning,
+		kDone,
+		kFailed,
+	};
+	static const long kFirstBytes = 256 * 1024;
+	static const long kMinSegmentBytes = 256 * 1024;
+	static const long kMaxSegmentBytes = 4 * 1024 * 1024;
+	static const int kInitialWidth = 2;
+	static const int kMaxWidth = 8;
+	static const int64_t kWindowUs = 1000000;
+	static const int kGainPercent = 10;
+	static const int kProbeWindows = 5;
+	static const int kMaxFailures = 8;
+private:
+	struct Segment {
+		long first;
+		long last;            // -1 for up to the end
+		Request *request;
+		SegmentWriter *writer;
+	};
+	RequestManager *manager;
+	std::string url;
+	std::string path;
+	double score;
+	int traffic;
+	State state;
+	std::string errmsg;
+	long total;               // bytes of the object, -1 until known
+	std::string validator;    // of the object, for the If-Range of the segments
+	bool planned;             // the object is split up
+	std::list<Segment> running;
+	std::list<std::pair<long,long> > waiting; // ranges no segment asks for yet
+	std::list<Segment> dying; // canceled, until the manager lets go of them
+	volatile long received;   // bytes all writers wrote, retries included
+	long done_bytes;          // of the segments which finished
+	int width;                // segments allowed to run at once
+	int best_width;
+	double base_rate;         // bytes per second before width last grew
+	bool probing;             // width just grew, the next window tells if it paid off
+	int quiet;                // windows since width last changed
+	int64_t window_at;
+	long window_bytes;
+	int failures;
+	bool restarted;
+	size_t segments;          // requests made
+	int64_t started_at;
+	int64_t finished_at;
+
+	// Forbid copying
+	SegmentedDownload(const SegmentedDownload &);
+	SegmentedDownload &operator=(const SegmentedDownload &);
+public:
+	SegmentedDownload(RequestManager *a_manager,const std::string &a_url,const std::string &a_path,
+		double a_score = 0,int a_traffic = kTrafficBackground)
+		: manager(a_manager),url(a_url),path(a_path),score(a_score),traffic(a_traffic),
+		state(kIdle),total(-1),planned(false),received(0),done_bytes(0),
+		width(kInitialWidth),best_width(kInitialWidth),base_rate(0),probing(false),quiet(0),
+		window_at(0),window_bytes(0),failures(0),restarted(false),segments(0),started_at(0),finished_at(0)
+	{
+	}
+	virtual ~SegmentedDownload()
+	{
+		cancel();
+		while( !get_idle() ) {
+			manager->step();
+			reap();
+		}
+	}
+	// Creates the output file and asks for the first segment; false if the
+	// file can't be written
+	bool start() {
+		FILE *f = fopen(path.c_str(),"wb");
+		if( !f || fclose(f) != 0 ) {
+			errmsg = "Can't create " + path;
+			state = kFailed;
+			return false;
+		}
+		state = kRunning;
+		started_at = TimeUs();
+		window_at = started_at;
+		launch(0,kFirstBytes - 1);
+		return true;
+	}
+	void step() {
+		reap();
+		if( state != kRunning )
+			return;
+		std::list<Segment>::iterator e = running.end();
+		std::list<Segment>::iterator i = running.begin();
+		for( ; i != e && !planned; i++ ) {
+			plan(i->request);
+		}
+		finish_segments();
+		if( state != kRunning )
+			return;
+		adapt();
+		while( !waiting.empty() && (int)running.size() < width ) {
+			std::pair<long,long> r = waiting.front();
+			waiting.pop_front();
+			launch(r.first,r.second);
+		}
+		if( running.empty() && waiting.empty() ) {
+			state = kDone;
+			finished_at = TimeUs();
+		}
+	}
+	// Stops all segments; the file stays as far as it got
+	void cancel() {
+		if( state == kRunning ) {
+			state = kFailed;
+			errmsg = "Canceled";
+			finished_at = TimeUs();
+		}
+		drop_all();
+	}
+	State get_state() const { return state; }
+	const std::string &get_errmsg() const { return errmsg; }
+	// Nothing of the download is left with the manager
+	bool get_idle() const { return running.empty() && dying.empty(); }
+	// -1 until the first segment told it
+	long get_total() const { return total; }
+	// Bytes in the file so far
+	long get_bytes() const {
+		long n = done_bytes;
+		std::list<Segment>::const_iterator e = running.end();
+		std::list<Segment>::const_iterator i = running.begin();
+		for( ; i != e; i++ ) {
+			n += i->writer->get_written();
+		}
+		return n;
+	}
+	int get_width() const { return width; }
+	int get_running() const { return (int)running.size(); }
+	size_t get_segments() const { return segments; }
+	int get_failures() const { return failures; }
+	double get_seconds() const {
+		return ((finished_at ? finished_at : TimeUs()) - started_at) / 1000000.0;
+	}
+private:
+	void launch(long first,long last) {
+		Segment s;
+		s.first = first;
+		s.last = last;
+		s.writer = new SegmentWriter(path,first,&received);
+		s.request = manager->get_segment(url.c_str(),first,last,first ? validator : "",s.writer,score,traffic);
+		running.push_back(s);
+		segments++;
+	}
+	// Splits the object up as soon as the headers of a first segment are
+	// in, while its body is still coming
+	void plan(const Request *r) {
+		if( !r->get_body_started() && r->get_state() != kOK )
+			return;
+		long status = r->get_body_status();
+		if( r->get_range() == kRangeReplaced && status >= 200 && status < 300 ) {
+			// the whole body comes with the first segment
+			planned = true;
+			return;
+		}
+		if( r->get_range() != kRangeResumed )
+			return;
+		planned = true;
+		const CacheMeta &meta = r->get_meta();
+		validator = meta.etag.size() && meta.etag.compare(0,2,"W/") ? meta.etag : meta.last_modified;
+		total = r->get_range_total();
+		long from = kFirstBytes;
+		if( total < 0 ) {
+			waiting.push_back(std::make_pair(from,-1L));
+			return;
+		}
+		if( total <= kFirstBytes )
+			return;
+		// room for the whole object up front, so segments only overwrite
+		FILE *f = fopen(path.c_str(),"r+b");
+		bool ok = f && fseek(f,total - 1,SEEK_SET) == 0 && fputc(0,f) != EOF;
+		if( f && fclose(f) != 0 )
+			ok = false;
+		if( !ok )
+			printf("CAN'T PREALLOCATE %ld BYTES FOR %s\n",total,path.c_str());
+		long size = (total - from) / (kMaxWidth * 2);
+		if( size < kMinSegmentBytes )
+			size = kMinSegmentBytes;
+		if( size > kMaxSegmentBytes )
+			size = kMaxSegmentBytes;
+		for( long p = from; p < total; p += size ) {
+			waiting.push_back(std::make_pair(p,p + size < total ? p + size - 1 : total - 1));
+		}
+	}
+	// Takes the segments which ended out; failed ones are asked for again
+	// from where their bytes end
+	void finish_segments() {
+		std::list<Segment>::iterator e = running.end();
+		std::list<Segment>::iterator i = running.begin();
+		while( i != e && state == kRunning ) {
+			Request *r = i->request;
+			if( r->get_state() != kOK && r->get_state() != kError ) {
+				i++;
+				continue;
+			}
+			if( r->get_range() == kRangeRefused ) {
+				restart();
+				return;
+			}
+			// a segment may ask for more than there is
+			long last = i->last;
+			if( total >= 0 && (last < 0 || last >= total) )
+				last = total - 1;
+			long length = last >= 0 ? last - i->first + 1 : -1;
+			long written = i->writer->get_written();
+			bool whole = i->first == 0 && r->get_range() == kRangeReplaced;
+			bool ok = r->get_state() == kOK && r->get_response_code() >= 200 && r->get_response_code() < 300 &&
+				(whole || length < 0 || written == length);
+			if( !ok && r->get_state() == kOK && r->get_response_code() >= 400 && r->get_response_code() < 500 ) {
+				fail(r->get_response_code() == 416 ? "Range not satisfiable" : "Client error");
+				return;
+			}
+			std::string error = r->get_errmsg();
+			done_bytes += written;
+			manager->clean(r);
+			if( !ok ) {
+				failures++;
+				if( failures > kMaxFailures ) {
+					delete i->writer;
+					running.erase(i);
+					fail("Too many failed segments, the last with '" + error + "'");
+					return;
+				}
+				long from = i->first + written;
+				if( length < 0 || written < length )
+					waiting.push_front(std::make_pair(from,last));
+			} else if( whole ) {
+				total = written;
+			}
+			delete i->writer;
+			i = running.erase(i);
+		}
+	}
+	// The object changed under the segments, so they are of no use
+	void restart() {
+		drop_all();
+		if( restarted ) {
+			fail("Object keeps changing");
+			return;
+		}
+		restarted = true;
+		planned = false;
+		total = -1;
+		validator = "";
+		waiting.clear();
+		done_bytes = 0;
+		FILE *f = fopen(path.c_str(),"wb");
+		if( !f || fclose(f) != 0 ) {
+			fail("Can't truncate " + path);
+			return;
+		}
+		launch(0,kFirstBytes - 1);
+	}
+	void fail(const std::string &msg) {
+		state = kFailed;
+		errmsg = msg;
+		finished_at = TimeUs();
+		drop_all();
+	}
+	// Hands every running segment back to the manager
+	void drop_all() {
+		dying.splice(dying.end(),running);
+		waiting.clear();
+		reap();
+	}
+	// Deletes the writers of the segments the manager let go of
+	void reap() {
+		std::list<Segment>::iterator e = dying.end();
+		std::list<Segment>::iterator i = dying.begin();
+		while( i != e ) {
+			if( manager->clean(i->request) ) {
+				delete i->writer;
+				i = dying.erase(i);
+			} else {
+				i++;
+			}
+		}
+	}
+	// Hill climbing on the segment count, only while there is work beyond
+	// what runs, as the tail end says nothing about the link
+	void adapt() {
+		int64_t now = TimeUs();
+		if( now - window_at < kWindowUs )
+			return;
+		long bytes = AtomicGet(&received);
+		double rate = (bytes - window_bytes) * 1000000.0 / (now - window_at);
+		window_at = now;
+		window_bytes = bytes;
+		if( waiting.empty() || !planned )
+			return;
+		quiet++;
+		if( probing ) {
+			probing = false;
+			if( rate * 100 >= base_rate * (100 + kGainPercent) ) {
+				best_width = width;
+				grow(rate);
+			} else {
+				width = best_width;
+				base_rate = rate;
+				quiet = 0;
+			}
+		} else if( !base_rate || quiet >= kProbeWindows ) {
+			grow(rate);
+		}
+	}
+	void grow(double rate) {
+		base_rate = rate;
+		quiet = 0;
+		if( width >= kMaxWidth )
+			return;
+		width++;
+		probing = true;
+	}
+};
+
+#endif /* !SEGMENTED_DOWNLOAD_H */
@@ -0,0 +1,273 @@
+// Size-class pools for libcurl's small allocations
+//-----------------------------------------------------------------------------
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "Atomic.h"
+
+// Most of what libcurl allocates per transfer is small and short lived:
+// header lines, cookie and URL strings, slist nodes, hash entries. On a
+// device with a fixed Memsize0 those scattered through the general heap
+// leave it fragmented long after the transfers are gone. Here every
+// allocation up to kMaxBlock bytes is rounded up to one of kClasses block
+// sizes and carved from kSlabBytes slabs kept per size class, so the small
+// blocks of a class reuse each other and stay packed together. Larger
+// allocations, like the receive buffers, go to the system heap.
+//
+// Each block starts with a header holding its size, which is what tells
+// dealloc() where it came from. A class has its own lock, since the network
+// threads allocate too. Slabs are only given back by release(), once
+// nothing is in use.
+//
+// Install() makes libcurl use the allocator, in place of curl_global_init().
+class SlabAllocator {
+public:
+	static const int kClasses = 12;
+	static const size_t kMaxBlock = 1024;
+	static const size_t kSlabBytes = 16 * 1024;
+
+	struct ClassStats {
+		long allocs;           // since the start
+		long in_use;           // blocks
+		long peak;             // blocks
+		long slabs;
+	};
+	struct LargeStats {
+		volatile long allocs;
+		volatile long in_use;
+		volatile long bytes;   // in use
+		volatile long peak_bytes;
+	};
+private:
+	union Header {
+		size_t size;           // of the block, header included
+		double align;
+	};
+	struct Slab {
+		Slab *next;
+	};
+	struct Class {
+		size_t size;
+		Header *free_list;     // chained through the first word of a block
+		Slab *slabs;
+		pthread_mutex_t lock;
+		ClassStats stats;      // under the lock as well
+	};
+	static const size_t kHeader = sizeof(Header);
+	static const size_t kSlabHeader = (sizeof(Slab) + kHeader - 1) / kHeader * kHeader;
+
+	mutable Class classes[kClasses]; // locked by the const getters too
+	unsigned char class_of[kMaxBlock / 16 + 1]; // by block size / 16, rounded up
+	LargeStats large;
+
+	// Forbid copying
+	SlabAllocator(const SlabAllocator &);
+	SlabAllocator &operator=(const SlabAllocator &);
+public:
+	SlabAllocator()
+	{
+		static const size_t sizes[kClasses] = { 16,32,48,64,96,128,192,256,384,512,768,1024 };
+		int c = 0;
+		for( size_t i = 0; i <= kMaxBlock / 16; i++ ) {
+			while( sizes[c] < i * 16 )
+				c++;
+			class_of[i] = (unsigned char)c;
+		}
+		for( int i = 0; i < kClasses; i++ ) {
+			classes[i].size = sizes[i];
+			classes[i].free_list = 0;
+			classes[i].slabs = 0;
+			pthread_mutex_init(&classes[i].lock,0);
+			ClassStats s = { 0,0,0,0 };
+			classes[i].stats = s;
+		}
+		LargeStats l = { 0,0,0,0 };
+		large = l;
+	}
+	~SlabAllocator()
+	{
+		release();
+		for( int i = 0; i < kClasses; i++ )
+			pthread_mutex_destroy(&classes[i].lock);
+	}
+	// The instance the libcurl callbacks use
+	static SlabAllocator &instance() {
+		static SlabAllocator allocator;
+		return allocator;
+	}
+	static CURLcode Install(long flags) {
+		instance();
+		return curl_global_init_mem(flags,SlabAllocator::Malloc,SlabAllocator::Free,
+			SlabAllocator::Realloc,SlabAllocator::Strdup,SlabAllocator::Calloc);
+	}
+
+	void *alloc(size_t size) {
+		size_t block = size + kHeader;
+		Header *h;
+		if( block > kMaxBlock ) {
+			h = (Header *)::malloc(block);
+			if( !h )
+				return 0;
+			long bytes = AtomicAdd(&large.bytes,(long)block);
+			long peak = AtomicGet(&large.peak_bytes);
+			while( bytes > peak && !AtomicCas(&large.peak_bytes,peak,bytes) )
+				peak = AtomicGet(&large.peak_bytes);
+			AtomicAdd(&large.allocs,1);
+			AtomicAdd(&large.in_use,1);
+		} else {
+			Class &c = classes[class_of[(block + 15) / 16]];
+			pthread_mutex_lock(&c.lock);
+			if( !c.free_list && !grow(c) ) {
+				pthread_mutex_unlock(&c.lock);
+				return 0;
+			}
+			h = c.free_list;
+			c.free_list = *(Header **)h;
+			c.stats.allocs++;
+			if( ++c.stats.in_use > c.stats.peak )
+				c.stats.peak = c.stats.in_use;
+			pthread_mutex_unlock(&c.lock);
+			block = c.size;
+		}
+		h->size = block;
+		return h + 1;
+	}
+	void dealloc(void *p) {
+		if( !p )
+			return;
+		Header *h = (Header *)p - 1;
+		size_t block = h->size;
+		if( block > kMaxBlock ) {
+			AtomicAdd(&large.in_use,-1);
+			AtomicAdd(&large.bytes,-(long)block);
+			::free(h);
+			return;
+		}
+		Class &c = classes[class_of[block / 16]];
+		pthread_mutex_lock(&c.lock);
+		*(Header **)h = c.free_list;
+		c.free_list = h;
+		c.stats.in_use--;
+		pthread_mutex_unlock(&c.lock);
+	}
+	// A block stays in place while the new size is of the same class
+	void *resize(void *p,size_t size) {
+		if( !p )
+			return alloc(size);
+		Header *h = (Header *)p - 1;
+		size_t block = h->size;
+		size_t want = size + kHeader;
+		if( block <= kMaxBlock && want <= block && class_of[(want + 15) / 16] == class_of[block / 16] )
+			return p;
+		if( block > kMaxBlock && want > kMaxBlock ) {
+			Header *n = (Header *)::realloc(h,want);
+			if( !n )
+				return 0;
+			long bytes = AtomicAdd(&large.bytes,(long)want - (long)block);
+			long peak = AtomicGet(&large.peak_bytes);
+			while( bytes > peak && !AtomicCas(&large.peak_bytes,peak,bytes) )
+				peak = AtomicGet(&large.peak_bytes);
+			n->size = want;
+			return n + 1;
+		}
+		void *n = alloc(size);
+		if( !n )
+			return 0;
+		size_t capacity = block - kHeader;
+		memcpy(n,p,size < capacity ? size : capacity);
+		dealloc(p);
+		return n;
+	}
+	char *dup(const char *s) {
+		size_t n = strlen(s) + 1;
+		char *p = (char *)alloc(n);
+		if( p )
+			memcpy(p,s,n);
+		return p;
+	}
+	void *zalloc(size_t n,size_t size) {
+		if( size && n > (size_t)-1 / size )
+			return 0;
+		void *p = alloc(n * size);
+		if( p )
+			memset(p,0,n * size);
+		return p;
+	}
+	// Gives the slabs back to the system heap when no block is in use, after
+	// curl_global_cleanup(); false leaves everything as it is
+	bool release() {
+		for( int i = 0; i < kClasses; i++ ) {
+			if( get_class_stats(i).in_use )
+				return false;
+		}
+		for( int i = 0; i < kClasses; i++ ) {
+			Class &c = classes[i];
+			pthread_mutex_lock(&c.lock);
+			while( c.slabs ) {
+				Slab *s = c.slabs;
+				c.slabs = s->next;
+				::free(s);
+			}
+			c.free_list = 0;
+			c.stats.slabs = 0;
+			pthread_mutex_unlock(&c.lock);
+		}
+		return true;
+	}
+
+	static int get_classes() { return kClasses; }
+	size_t get_class_size(int i) const { return classes[i].size; }
+	ClassStats get_class_stats(int i) const {
+		Class &c = classes[i];
+		pthread_mutex_lock(&c.lock);
+		ClassStats s = c.stats;
+		pthread_mutex_unlock(&c.lock);
+		return s;
+	}
+	const LargeStats &get_large_stats() const { return large; }
+	// Bytes held in slabs, used or not
+	size_t get_slab_bytes() const {
+		size_t n = 0;
+		for( int i = 0; i < kClasses; i++ )
+			n += get_class_stats(i).slabs * kSlabBytes;
+		return n;
+	}
+	// Bytes of slab blocks handed out
+	size_t get_used_bytes() const {
+		size_t n = 0;
+		for( int i = 0; i < kClasses; i++ )
+			n += get_class_stats(i).in_use * classes[i].size;
+		return n;
+	}
+
+	static void *Malloc(size_t size) { return instance().alloc(size); }
+	static void Free(void *p) { instance().dealloc(p); }
+	static void *Realloc(void *p,size_t size) { return instance().resize(p,size); }
+	static char *Strdup(const char *s) { return instance().dup(s); }
+	static void *Calloc(size_t n,size_t size) { return instance().zalloc(n,size); }
+private:
+	// Called with the class locked
+	bool grow(Class &c) {
+		Slab *s = (Slab *)::malloc(kSlabBytes);
+		if( !s )
+			return false;
+		s->next = c.slabs;
+		c.slabs = s;
+		c.stats.slabs++;
+		char *p = (char *)s + kSlabHeader;
+		char *end = (char *)s + kSlabBytes;
+		for( ; p + c.size <= end; p += c.size ) {
+			*(Header **)p = c.free_list;
+			c.free_list = (Header *)p;
+		}
+		return true;
+	}
+};
+
+#endif /* !SLAB_ALLOCATOR_H */
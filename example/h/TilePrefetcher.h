@@ -0,0 +1,216 @@
+// Predictive tile prefetcher driven by the movement of the view
+//-----------------------------------------------------------------------------
+
+#ifndef TILE_PREFETCHER_H
+#define TILE_PREFETCHER_H
+
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stddef.h>
+
+// Visible tiles at zoom z: x in [x_min,x_max), y in [y_min,y_max)
+struct TileRect {
+	int z;
+	int x_min,y_min;
+	int x_max,y_max;
+	bool contains(int tz,int tx,int ty) const {
+		return tz == z && tx >= x_min && tx < x_max && ty >= y_min && ty < y_max;
+	}
+};
+
+struct TileKey {
+	int z,x,y;
+	bool operator<(const TileKey &a) const {
+		if( z != a.z )
+			return z < a.z;
+		if( y != a.y )
+			return y < a.y;
+		return x < a.x;
+	}
+};
+
+// Tracks how fast the view pans and which way it zooms, and predicts the
+// tiles which will become visible next. Prefetches score above
+// kPrefetchScore so they always queue behind visible tiles, and the number
+// and estimated size of outstanding prefetches are capped by a budget.
+//
+// The owner calls update() once per frame with the current view, asks
+// next() for tiles worth requesting, and reports back with started() and
+// finished(). wanted() tells whether a queued or running prefetch is still
+// useful.
+class TilePrefetcher {
+	TileRect view;
+	TileRect predicted;
+	bool have_view;
+	long last_ms;
+	double vx,vy;      // pan speed, tiles per second
+	double vz;         // zoom speed, levels per second
+	std::set<TileKey> outstanding;
+	size_t max_tiles;
+	size_t max_bytes;
+	double avg_tile_bytes;
+
+	// Forbid copying
+	TilePrefetcher(const TilePrefetcher &);
+	TilePrefetcher &operator=(const TilePrefetcher &);
+public:
+	static const int kPrefetchScore = 1000;
+
+	TilePrefetcher(size_t a_max_tiles,size_t a_max_bytes)
+		: have_view(false),last_ms(0),vx(0),vy(0),vz(0),
+		max_tiles(a_max_tiles),max_bytes(a_max_bytes),avg_tile_bytes(16 * 1024)
+	{
+	}
+	void update(const TileRect &a_view,long now_ms) {
+		if( have_view && now_ms > last_ms ) {
+			// work in the tile units of the new zoom level
+			double f = scale(view.z,a_view.z);
+			double dt = (now_ms - last_ms) / 1000.0;
+			double sx = centre_x(a_view) - centre_x(view) * f;
+			double sy = centre_y(a_view) - centre_y(view) * f;
+			double a = dt / (kSmoothingMs / 1000.0 + dt);
+			vx = vx * f + (sx / dt - vx * f) * a;
+			vy = vy * f + (sy / dt - vy * f) * a;
+			vz = vz + ((a_view.z - view.z) / dt - vz) * a;
+		}
+		view = a_view;
+		last_ms = now_ms;
+		have_view = true;
+		predict();
+	}
+	// Prefetch score for a tile, or -1 if it is neither visible nor predicted
+	double score(int z,int x,int y) const {
+		if( !have_view || !wanted(z,x,y) )
+			return -1;
+		double dx = (x + 0.5) - centre_x(predicted);
+		double dy = (y + 0.5) - centre_y(predicted);
+		double dz = z > predicted.z ? z - predicted.z : predicted.z - z;
+		return kPrefetchScore + sqrt(dx * dx + dy * dy) + dz * kZoomPenalty;
+	}
+	bool wanted(int z,int x,int y) const {
+		if( !have_view || view.contains(z,x,y) )
+			return false;
+		if( predicted.contains(z,x,y) )
+			return true;
+		if( zooming() ) {
+			// the central tiles of the next zoom level in the zoom direction
+			int nz = view.z + (vz > 0 ? 1 : -1);
+			if( z != nz )
+				return false;
+			TileRect r = zoom_rect(nz);
+			return r.contains(z,x,y);
+		}
+		return false;
+	}
+	// Appends the predicted tiles which are not yet outstanding, nearest to
+	// the predicted centre first, as long as the budget allows
+	size_t next(std::vector<TileKey> &out) const {
+		if( !have_view )
+			return 0;
+		std::vector<std::pair<double,TileKey> > found;
+		collect(predicted,found);
+		if( zooming() )
+			collect(zoom_rect(view.z + (vz > 0 ? 1 : -1)),found);
+		std::sort(found.begin(),found.end(),ByScore());
+		size_t added = 0;
+		size_t budget = budget_tiles();
+		for( size_t i = 0; i < found.size() && outstanding.size() + added < budget; i++ ) {
+			out.push_back(found[i].second);
+			added++;
+		}
+		return added;
+	}
+	void started(const TileKey &k) {
+		outstanding.insert(k);
+	}
+	// bytes is 0 for prefetches which failed or were dropped
+	void finished(const TileKey &k,size_t bytes) {
+		if( outstanding.erase(k) && bytes ) {
+			avg_tile_bytes += (bytes - avg_tile_bytes) / 8;
+		}
+	}
+	void clear() {
+		outstanding.clear();
+	}
+	bool is_outstanding(const TileKey &k) const {
+		return outstanding.find(k) != outstanding.end();
+	}
+	size_t get_outstanding() const { return outstanding.size(); }
+	double get_vx() const { return vx; }
+	double get_vy() const { return vy; }
+	double get_vz() const { return vz; }
+	const TileRect &get_predicted() const { return predicted; }
+private:
+	static const int kZoomPenalty = 4;
+	static const int kLookaheadMs = 1000;
+	static const int kSmoothingMs = 500;
+
+	struct ByScore {
+		bool operator()(const std::pair<double,TileKey> &a,const std::pair<double,TileKey> &b) const {
+			return a.first < b.first;
+		}
+	};
+	static double centre_x(const TileRect &r) { return (r.x_min + r.x_max) / 2.0; }
+	static double centre_y(const TileRect &r) { return (r.y_min + r.y_max) / 2.0; }
+	// factor which converts tile coordinates at zoom from to zoom to
+	static double scale(int from,int to) {
+		return to >= from ? (double)(1 << (to - from)) : 1.0 / (1 << (from - to));
+	}
+	// speeds below this are treated as standing still
+	static double min_speed() { return 0.25; }
+	bool zooming() const {
+		return vz > min_speed() || vz < -min_speed();
+	}
+	size_t budget_tiles() const {
+		size_t by_bytes = (size_t)(max_bytes / (avg_tile_bytes > 1 ? avg_tile_bytes : 1));
+		return by_bytes < max_tiles ? by_bytes : max_tiles;
+	}
+	// The view moved ahead by the distance covered in the lookahead time,
+	// grown by one ring of tiles on the leading edges
+	void predict() {
+		predicted = view;
+		int sx = (int)floor(vx * kLookaheadMs / 1000 + 0.5);
+		int sy = (int)floor(vy * kLookaheadMs / 1000 + 0.5);
+		predicted.x_min += sx;
+		predicted.x_max += sx;
+		predicted.y_min += sy;
+		predicted.y_max += sy;
+		if( vx > min_speed() )
+			predicted.x_max++;
+		if( vx < -min_speed() )
+			predicted.x_min--;
+		if( vy > min_speed() )
+			predicted.y_max++;
+		if( vy < -min_speed() )
+			predicted.y_min--;
+	}
+	// The tiles at zoom nz which cover the middle of the view
+	TileRect zoom_rect(int nz) const {
+		double f = scale(view.z,nz);
+		double cx = centre_x(view) * f;
+		double cy = centre_y(view) * f;
+		int w = view.x_max - view.x_min;
+		int h = view.y_max - view.y_min;
+		TileRect r;
+		r.z = nz;
+		r.x_min = (int)floor(cx - w / 2.0);
+		r.y_min = (int)floor(cy - h / 2.0);
+		r.x_max = r.x_min + w;
+		r.y_max = r.y_min + h;
+		return r;
+	}
+	void collect(const TileRect &r,std::vector<std::pair<double,TileKey> > &found) const {
+		for( int y = r.y_min; y < r.y_max; y++ ) {
+			for( int x = r.x_min; x < r.x_max; x++ ) {
+				TileKey k = { r.z,x,y };
+				if( !wanted(k.z,k.x,k.y) || is_outstanding(k) )
+					continue;
+				found.push_back(std::make_pair(score(k.z,k.x,k.y),k));
+			}
+		}
+	}
+};
+
+#endif /* !TILE_PREFETCHER_H */
@@ -0,0 +1,20 @@
+// Microsecond clock for latency measurements
+//-----------------------------------------------------------------------------
+
+#ifndef TIME_US_H
+#define TIME_US_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+// Wall clock in microseconds. Only differences are meaningful; the
+// platform has gettimeofday (see HAVE_GETTIMEOFDAY in curl_config.h) but
+// no monotonic clock.
+inline int64_t TimeUs()
+{
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#endif /* !TIME_US_H */
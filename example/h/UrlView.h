@@ -0,0 +1,176 @@
+// Single pass URL parser returning views into the URL
+//-----------------------------------------------------------------------------
+
+#ifndef URL_VIEW_H
+#define URL_VIEW_H
+
+#include <string>
+#include <string.h>
+#include <stddef.h>
+
+// Non-owning piece of a string. A component missing from the URL has no
+// data at all, which tells "http://host" (no query) from "http://host?"
+// (an empty one).
+struct StrView {
+	const char *data;
+	size_t size;
+
+	StrView()
+		: data(0),size(0)
+	{
+	}
+	StrView(const char *a_data,size_t a_size)
+		: data(a_data),size(a_size)
+	{
+	}
+	bool present() const { return data != 0; }
+	bool empty() const { return size == 0; }
+	std::string str() const { return data ? std::string(data,size) : std::string(); }
+	bool operator==(const char *s) const {
+		return strlen(s) == size && (!size || !memcmp(data,s,size));
+	}
+	bool operator!=(const char *s) const { return !(*this == s); }
+	bool equals_nocase(const char *s) const {
+		if( strlen(s) != size )
+			return false;
+		for( size_t i = 0; i < size; i++ ) {
+			if( lower(data[i]) != lower(s[i]) )
+				return false;
+		}
+		return true;
+	}
+private:
+	static char lower(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+};
+
+// scheme://userinfo@host:port/path?query#fragment, split in one walk over
+// the characters without copying or allocating. The views point into the
+// parsed string, which has to outlive them and stay unchanged.
+//
+// A URL without "://" starts with its authority, the way url_host() always
+// took it. An IPv6 host keeps its brackets. Anything is accepted; valid()
+// is false only when the port is not a number.
+class UrlView {
+public:
+	StrView scheme;
+	StrView userinfo;
+	StrView host;
+	StrView port;
+	StrView path;
+	StrView query;
+	StrView fragment;
+private:
+	bool port_ok;
+public:
+	UrlView()
+		: port_ok(true)
+	{
+	}
+	explicit UrlView(const std::string &url)
+	{
+		parse(url.data(),url.size());
+	}
+	UrlView(const char *url,size_t size)
+	{
+		parse(url,size);
+	}
+	bool parse(const std::string &url) {
+		return parse(url.data(),url.size());
+	}
+	bool parse(const char *s,size_t n) {
+		*this = UrlView();
+		size_t i = 0;
+		// scheme, when the leading scheme characters end in "://"
+		while( i < n && (is_alnum(s[i]) || s[i] == '+' || s[i] == '-' || s[i] == '.') )
+			i++;
+		size_t begin = 0;
+		if( i > 0 && i + 2 < n && s[i] == ':' && s[i + 1] == '/' && s[i + 2] == '/' ) {
+			scheme = StrView(s,i);
+			begin = i + 3;
+		}
+		// authority, remembering the last '@' and the port ':' after it
+		size_t at = (size_t)-1, colon = (size_t)-1;
+		bool bracket = false;
+		for( i = begin; i < n && s[i] != '/' && s[i] != '?' && s[i] != '#'; i++ ) {
+			switch( s[i] ) {
+			case '@':
+				at = i;
+				colon = (size_t)-1;
+				bracket = false;
+				break;
+			case '[':
+				bracket = true;
+				break;
+			case ']':
+				bracket = false;
+				break;
+			case ':':
+				if( !bracket )
+					colon = i;
+				break;
+			}
+		}
+		size_t end = i;
+		size_t host_begin = begin;
+		if( at != (size_t)-1 ) {
+			userinfo = StrView(s + begin,at - begin);
+			host_begin = at + 1;
+		}
+		size_t host_end = end;
+		if( colon != (size_t)-1 ) {
+			host_end = colon;
+			port = StrView(s + colon + 1,end - colon - 1);
+			for( size_t p = 0; p < port.size; p++ ) {
+				if( port.data[p] < '0' || port.data[p] > '9' )
+					port_ok = false;
+			}
+		}
+		host = StrView(s + host_begin,host_end - host_begin);
+		// path up to the query or fragment
+		begin = i;
+		while( i < n && s[i] != '?' && s[i] != '#' )
+			i++;
+		path = StrView(s + begin,i - begin);
+		if( i < n && s[i] == '?' ) {
+			begin = ++i;
+			while( i < n && s[i] != '#' )
+				i++;
+			query = StrView(s + begin,i - begin);
+		}
+		if( i < n && s[i] == '#' ) {
+			begin = ++i;
+			fragment = StrView(s + begin,n - begin);
+		}
+		return port_ok;
+	}
+	bool valid() const { return port_ok; }
+	// host[:port], what per-host state is keyed by
+	StrView host_port() const {
+		if( !host.data )
+			return StrView();
+		return StrView(host.data,port.data ? port.data + port.size - host.data : host.size);
+	}
+	// The port given, or the default one of the scheme; -1 when neither
+	// is known
+	int port_number() const {
+		if( port.size && port_ok ) {
+			int n = 0;
+			for( size_t i = 0; i < port.size && n < 65536; i++ )
+				n = n * 10 + (port.data[i] - '0');
+			return n < 65536 ? n : -1;
+		}
+		if( scheme.equals_nocase("http") )
+			return 80;
+		if( scheme.equals_nocase("https") )
+			return 443;
+		if( scheme.equals_nocase("ftp") )
+			return 21;
+		return -1;
+	}
+private:
+	static bool is_alnum(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+	}
+};
+
+#endif /* !URL_VIEW_H */
@@ -7,6 +7,8 @@
 #include <list>
 #include "s3eMemory.h"
 #include "ExamplesMain.h"
+#include "UrlView.h"
+#include "RedirectMemo.h"
 #include "IwGx.h"
 #include "IwGxPrint.h"
 #include <curl_config.h>
@@ -14,6 +16,7 @@
 #include <ares.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
@@ -43,49 +46,14 @@ const char *HTTPStatusName[] = {
 	0
 };
 
-std::string extract_host(const std::string &url) {
-	size_t p1 = url.find("://");
-	if( p1 == std::string::npos )
+// Dotted quad of a 4 byte address as DnsCache keeps it
+std::string dotted_ip(const std::string &ent) {
+	if( ent.size() < 4 )
 		return "";
-	p1 += 3;
-	size_t p2 = url.find(":",p1);
-	size_t p3 = url.find("/",p1);
-	if( p2 != std::string::npos && (p3 == std::string::npos || p2 < p3) ) {
-		p3 = p2;
-	}
-	if( p3 == std::string::npos )
-		return url.substr(p1);
-	return url.substr(p1,p3 - p1);
-}
-
-std::string extract_port(const std::string &url) {
-	size_t p1 = url.find("://");
-	if( p1 == std::string::npos )
-		return "";
-	p1 += 3;
-	size_t p2 = url.find(":",p1);
-	size_t p3 = url.find("/",p1);
-	if( p2 == std::string::npos )
-		return "";
-	return url.substr(p2,p3);
-}
-
-std::string extract_path(const std::string &url) {
-	size_t p1 = url.find("://");
-	if( p1 == std::string::npos )
-		return "";
-	p1 += 3;
-	size_t p3 = url.find("/",p1);
-	if( p3 == std::string::npos )
-		return "";
-	return url.substr(p3);
-}
-
-std::string extract_proto(const std::string &url) {
-	size_t p1 = url.find("://");
-	if( p1 == std::string::npos )
-		return "";
-	return url.substr(0,p1);
+	const unsigned char *a = (const unsigned char *)ent.data();
+	char buf[16];
+	sprintf(buf,"%d.%d.%d.%d",a[0],a[1],a[2],a[3]);
+	return buf;
 }
 class DnsCache
 {
@@ -120,6 +88,17 @@ class DnsCache
 	};
 	std::map<std::string,DnsCacheEntry> dns_cache;
 
+	// CURLOPT_RESOLVE list pinning host:port to an address. A handle reads
+	// its list whenever it connects, so a list lives as long as a request
+	// holds it, even after a newer address replaced it for new requests.
+	struct ResolvePin {
+		curl_slist *list;
+		std::string ip;
+		int refs;      // requests holding it, plus one while current
+	};
+	std::map<std::string,ResolvePin *> pins;    // current, by host:port
+	std::map<curl_slist *,ResolvePin *> held;   // every live list
+
 	// Forbid copying
 	DnsCache(const DnsCache &);
 	DnsCache &operator=(const DnsCache &);
@@ -127,6 +106,12 @@ public:
 	DnsCache() {
 	}
 	virtual ~DnsCache() {
+		std::map<curl_slist *,ResolvePin *>::iterator e = held.end();
+		std::map<curl_slist *,ResolvePin *>::iterator i = held.begin();
+		for( ; i != e; i++ ) {
+			curl_slist_free_all(i->second->list);
+			delete i->second;
+		}
 	}
 
 	std::string get_ent(const std::string &hostname) const {
@@ -153,39 +138,98 @@ public:
 	void add_ent(const std::string &hostname, hostent *result) {
 		add_ent(hostname,std::string((char *)(result->h_addr),result->h_length));
 	}
+	// CURLOPT_RESOLVE list for host:port at ip, to be given back with unpin()
+	// when the handle using it is cleaned up. Requests to the same address
+	// share one list. When the address changes the new list first drops
+	// what libcurl cached for host:port, then adds the new address.
+	curl_slist *pin(const std::string &host,int port,const std::string &ip) {
+		char key[512];
+		snprintf(key,sizeof(key),"%s:%d",host.c_str(),port);
+		std::map<std::string,ResolvePin *>::iterator f = pins.find(key);
+		if( f != pins.end() && f->second->ip == ip ) {
+			f->second->refs++;
+			return f->second->list;
+		}
+		bool replacing = f != pins.end();
+		if( replacing ) {
+			drop(f->second);
+			pins.erase(f);
+		}
+		ResolvePin *p = new ResolvePin();
+		p->list = 0;
+		p->ip = ip;
+		p->refs = 2;
+		char buf[600];
+		if( replacing ) {
+			snprintf(buf,sizeof(buf),"-%s",key);
+			p->list = curl_slist_append(p->list,buf);
+		}
+		snprintf(buf,sizeof(buf),"%s:%s",key,ip.c_str());
+		p->list = curl_slist_append(p->list,buf);
+		pins[key] = p;
+		held[p->list] = p;
+		return p->list;
+	}
+	void unpin(curl_slist *list) {
+		std::map<curl_slist *,ResolvePin *>::iterator f = held.find(list);
+		if( f != held.end() )
+			drop(f->second);
+	}
+private:
+	void drop(ResolvePin *p) {
+		if( --p->refs > 0 )
+			return;
+		held.erase(p->list);
+		curl_slist_free_all(p->list);
+		delete p;
+	}
 };
 
 class Request {
 	CURL *curl;
 	ares_channel ares;
-	curl_slist *headers;
+	curl_slist *resolve;  // pinned in dns_cache
 	CURLM *curlm;
 	CURLSH *curlsh;
 	DnsCache *dns_cache;
+	RedirectMemo *redirects;
 	HTTPStatus state;
 	int errcode;
 	std::string url;
 	std::string redirect_url;
+	UrlView target;           // of redirect_url, or url without one
+	std::string target_host;
 	std::string direct_ip;
 	std::string content;
 	std::string errmsg;
+	int rewritten_hops;       // redirects the memo let this request skip
+	std::string moved_to;     // where the permanent redirects at the start led
+	int moved_hops;
+	bool moved_chain;         // no other redirect came yet
+	bool direct;              // a rewrite failed it, so it goes to url only
 	bool canceling;
 	bool relocating;
 public:
 	Request(const char *a_url)
-		: curl(0),ares(0),headers(0),curlm(0),curlsh(0),dns_cache(0),
-		state(kNone),errcode(CURLE_OK),url(a_url),canceling(false),relocating(false)
+		: curl(0),ares(0),resolve(0),curlm(0),curlsh(0),dns_cache(0),redirects(0),
+		state(kNone),errcode(CURLE_OK),url(a_url),rewritten_hops(0),moved_hops(0),moved_chain(true),
+		direct(false),canceling(false),relocating(false)
 	{
+		set_target();
 	}
 	virtual ~Request()
 	{
 		cleanup();
 	}
-	void start(CURLM *a_curlm,CURLSH *a_curlsh,DnsCache *a_dns_cache) {
+	void start(CURLM *a_curlm,CURLSH *a_curlsh,DnsCache *a_dns_cache,RedirectMemo *a_redirects) {
 		state = kStarting;
 		curlm = a_curlm;
 		curlsh = a_curlsh;
 		dns_cache = a_dns_cache;
+		redirects = a_redirects;
+		// a permanent redirect seen before sends a new request straight on
+		if( !redirect_url.size() && !direct && redirects && redirects->rewrite(url,&redirect_url,&rewritten_hops) )
+			set_target();
 		start_resolve();
 	}
 	void step() {
@@ -231,16 +275,12 @@ public:
 			ares = 0;
 		}
 		state = kResolving;
-		std::string actual_url = redirect_url.size() ? redirect_url:url;
-		std::string host = extract_host(actual_url);
-		std::string res = dns_cache->get_ent(host);
+		std::string res = dns_cache->get_ent(target_host);
 		if( !res.size() ) {
 			ares_init(&ares);
-			ares_gethostbyname(ares,host.c_str(),AF_INET,Request::GotResolveStatic,this);
+			ares_gethostbyname(ares,target_host.c_str(),AF_INET,Request::GotResolveStatic,this);
 		} else {
-			char buf[1024];
-			sprintf(buf,"%d.%d.%d.%d",res[0],res[1],res[2],res[3]);
-			direct_ip = buf;
+			direct_ip = dotted_ip(res);
 			state = kStartDownload;
 		}
 	}
@@ -248,17 +288,12 @@ public:
 		state = kDownloading;
 		curl = curl_easy_init();
 		//assert(direct_ip.size());
-		std::string actual_url = redirect_url.size() ? redirect_url:url;
-		char buf[1024];
-		sprintf(buf,"%s://%s%s%s",
-					extract_proto(actual_url).c_str(),
-					direct_ip.c_str(),
-					extract_port(actual_url).c_str(),
-					extract_path(actual_url).c_str());
-		curl_easy_setopt(curl, CURLOPT_URL, buf);
-		sprintf(buf,"Host: %s%s",extract_host(actual_url).c_str(),extract_port(actual_url).c_str());
-		headers = curl_slist_append(headers,buf);
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		// The URL keeps the host name, so connections are cached and reused
+		// per host and the Host header is libcurl's own; the address we
+		// resolved reaches libcurl through CURLOPT_RESOLVE instead
+		curl_easy_setopt(curl, CURLOPT_URL, redirect_url.size() ? redirect_url.c_str() : url.c_str());
+		resolve = dns_cache->pin(target_host,target.port_number(),direct_ip);
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, Request::GotData);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)this);
 		curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-airplay-agent/1.0");
@@ -286,13 +321,18 @@ public:
 		if( ares )
 			ares_destroy( ares );
 		ares = 0;
-		if( headers ) {
-			curl_slist_free_all(headers);
-		}
-		headers = 0;
+		if( resolve )
+			dns_cache->unpin(resolve);
+		resolve = 0;
 		errmsg = "";
 		content = "";
 		url = "";
+		set_target();
+		rewritten_hops = 0;
+		moved_to = "";
+		moved_hops = 0;
+		moved_chain = true;
+		direct = false;
 		state = kNone;
 		canceling = false;
 		relocating = false;
@@ -304,10 +344,14 @@ public:
 		if( ares )
 			ares_destroy( ares );
 		ares = 0;
-		if( headers ) {
-			curl_slist_free_all(headers);
+		if( resolve )
+			dns_cache->unpin(resolve);
+		resolve = 0;
+		// a rewritten request which failed may have been sent somewhere gone
+		if( rewritten_hops && !canceling ) {
+			resend_direct();
+			return;
 		}
-		headers = 0;
 		canceling = false;
 		relocating = false;
 		state = kError;
@@ -318,21 +362,29 @@ public:
 		state = kFinishingError;
 	}
 	void got_done() {
-		if( curl )
+		long code = 0;
+		if( curl ) {
+			curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&code);
 			curl_easy_cleanup(curl);
+		}
 		curl = 0;
 		if( ares )
 			ares_destroy( ares );
 		ares = 0;
-		if( headers ) {
-			curl_slist_free_all(headers);
-		}
-		headers = 0;
+		if( resolve )
+			dns_cache->unpin(resolve);
+		resolve = 0;
 		if( relocating ) {
 			relocating = false;
 			state = kStarting;
-			start(curlm,curlsh,dns_cache);
+			start(curlm,curlsh,dns_cache,redirects);
+		} else if( rewritten_hops && code >= 400 && !canceling ) {
+			resend_direct();
 		} else {
+			if( rewritten_hops && code >= 400 )
+				redirects->forget(url);
+			else if( moved_hops && code < 400 )
+				redirects->learn(url,moved_to,rewritten_hops + moved_hops);
 			state = kOK;
 			canceling = false;
 			relocating = false;
@@ -355,6 +407,28 @@ public:
 	HTTPStatus get_state() const { return state; }
 	bool get_canceling() const { return canceling; }
 private:
+	// Forgets the rule which rewrote the request and sends it once more, to
+	// its own URL, which is never rewritten again
+	void resend_direct() {
+		redirects->forget(url);
+		redirect_url = "";
+		rewritten_hops = 0;
+		moved_to = "";
+		moved_hops = 0;
+		moved_chain = true;
+		direct = true;
+		content = "";
+		errmsg = "";
+		errcode = CURLE_OK;
+		relocating = false;
+		set_target();
+		start(curlm,curlsh,dns_cache,redirects);
+	}
+	// Parses the URL the next transfer goes to, once for every URL
+	void set_target() {
+		target.parse(redirect_url.size() ? redirect_url : url);
+		target_host = target.host.str();
+	}
 	static size_t GotData(void *ptr, size_t size, size_t nmemb, void *data)
 	{
 	  size_t realsize = size * nmemb;
@@ -381,12 +455,9 @@ private:
 		switch(status) {
 			case ARES_SUCCESS:
 				{
-					char buf[1024];
-					sprintf(buf,"%d.%d.%d.%d",hostent->h_addr[0],hostent->h_addr[1],hostent->h_addr[2],hostent->h_addr[3]);
-					direct_ip = buf;
+					dns_cache->add_ent(target_host,hostent);
+					direct_ip = dotted_ip(std::string(hostent->h_addr,hostent->h_length));
 					state = kStartDownload;
-					std::string actual_url = redirect_url.size() ? redirect_url:url;
-					dns_cache->add_ent(extract_host(actual_url),hostent);
 			    }
 				break;
 			case ARES_EDESTRUCTION:
@@ -427,9 +498,18 @@ private:
 			if( code >= 300 && code < 400 ) {
 				printf("Relocation happening\n");
 				relocating = true;
-				redirect_url = std::string(ptr+sizeof("Location:"),size - sizeof("Location:") - 2);
-				while( redirect_url[0] == ' ' )
-					redirect_url = redirect_url.substr(1);
+				std::string location = std::string(ptr+sizeof("Location:"),size - sizeof("Location:") - 2);
+				while( location[0] == ' ' )
+					location = location.substr(1);
+				std::string to = RedirectMemo::resolve(redirect_url.size() ? redirect_url : url,location);
+				if( moved_chain && (code == 301 || code == 308) && to.size() ) {
+					moved_to = to;
+					moved_hops++;
+				} else {
+					moved_chain = false;
+				}
+				redirect_url = to.size() ? to : location;
+				set_target();
 			}
 		}
 		return size;
@@ -446,6 +526,7 @@ class RequestManager {
 	CURLM *curlm;
 	CURLSH *curlsh;
 	DnsCache dns_cache;
+	RedirectMemo redirects;
 	size_t max_handles;
 public:
 	RequestManager(size_t a_max_handles)
@@ -533,10 +614,11 @@ public:
 		// start found request
 		if( i != e && (*i)->get_state() == kNone && !(*i)->get_canceling() ) {
 			// new request found
-			(*i)->start(curlm,curlsh,&dns_cache);
+			(*i)->start(curlm,curlsh,&dns_cache,&redirects);
 		}
 	}
 	const std::list<Request *> &get_queue() const { return queue; }
+	const RedirectMemo &get_redirects() const { return redirects; }
 	bool clean(Request *r) {
 		switch(r->get_state()) {
 		case kStarting:
@@ -725,6 +807,11 @@ void ExampleRender()
 		sy += 20;
 		count++;
 	}
+	char buf[256];
+	const RedirectMemo &rm = manager.get_redirects();
+	snprintf(buf, 255, "redirects: %d rules, %d requests sent directly, %d round trips saved",
+		(int)rm.get_rules(),(int)rm.get_rewrites(),(int)rm.get_hops_saved());
+	IwGxPrintString(sx, sy, buf, true);
 	// Swap buffers
 	IwGxFlush();
 	IwGxSwapBuffers();
@@ -5,7 +5,11 @@
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 #include "s3eMemory.h"
+#include "RequestManager.h"
+#include "TilePrefetcher.h"
+#include "SlabAllocator.h"
 #include "ExamplesMain.h"
 #include "IwGx.h"
 #include "IwGxPrint.h"
@@ -13,15 +17,7 @@
 #include <curl/curl.h>
 #include <stdio.h>
 #include <string.h>
-
-enum HTTPStatus
-{
-	kNone,
-	kStarting,
-	kDownloading,
-	kOK,
-	kError,
-};
+#include <math.h>
 
 const char *HTTPStatusName[] = {
 	"None",
@@ -32,252 +28,6 @@ const char *HTTPStatusName[] = {
 	0
 };
 
-class Request {
-	CURL *curl;
-	HTTPStatus state;
-	CURLcode errcode;
-	std::string url;
-	std::string content;
-	std::string errmsg;
-	bool canceling;
-public:
-	Request(const char *a_url)
-		: curl(0),state(kNone),errcode(CURLE_OK),url(a_url),canceling(false)
-	{
-	}
-	virtual ~Request()
-	{
-		cleanup();
-	}
-	CURL *start(CURLSH *curlsh) {
-		state = kStarting;
-		curl = curl_easy_init();	
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, Request::GotData);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)this);
-		curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-airplay-agent/1.0");
-		curl_easy_setopt(curl,CURLOPT_CONNECTTIMEOUT, 15);
-		curl_easy_setopt(curl,CURLOPT_TIMEOUT, 30);
-		curl_easy_setopt(curl,CURLOPT_NOPROGRESS, 0);
-		curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION, 1);
-		curl_easy_setopt(curl,CURLOPT_PROGRESSFUNCTION, Request::GotProgressStatic);
-		curl_easy_setopt(curl,CURLOPT_PROGRESSDATA, (void *)this);
-		if( curlsh )
-			curl_easy_setopt(curl,CURLOPT_SHARE,curlsh);
-		//curl_easy_setopt(curl,CURLOPT_VERBOSE,1);
-		return curl;
-	}
-	void cleanup() {
-		if( curl ) {
-			curl_easy_cleanup(curl);
-		}
-		curl = 0;
-		errmsg = "";
-		content = "";
-		url = "";
-		state = kNone;
-		canceling = false;
-	}
-	void got_started() {
-		state = kDownloading;
-	}
-	void got_error(CURLcode code,const char *msg) {
-		errmsg = msg;
-		errcode = code;
-		curl_easy_cleanup(curl);
-		curl = 0;
-		state = kError;
-		canceling = false;
-	}
-	void got_done() {
-		errmsg = "";
-		errcode = CURLE_OK;
-		curl_easy_cleanup(curl);
-		curl = 0;
-		state = kOK;
-		canceling = false;
-	}
-	void cancel() {
-		canceling = true;
-	}
-	CURL *get_curl() const { return curl; }
-	std::string get_url() const { return url; }
-	std::string get_content() const { return content; }
-	size_t get_content_length() const { return content.size(); }
-	std::string get_errmsg() const { return errmsg; }
-	CURLcode get_errcode() const { return errcode; }
-	HTTPStatus get_state() const { return state; }
-	bool get_canceling() const { return canceling; }
-private:
-	static size_t GotData(void *ptr, size_t size, size_t nmemb, void *data)
-	{
-	  size_t realsize = size * nmemb;
-	  Request *mem = (Request *)data;
-	  return mem->GotContent(ptr,realsize);
-	}
-	size_t GotContent(void *ptr,size_t size) {
-		content += std::string((char *)ptr,size);
-		return size;
-	}
-	static int GotProgressStatic(void *clientp,double dltotal,double dlnow,double ultotal,double ulnow)
-	{
-		Request *mem = (Request *)clientp;
-		return mem->GotProgress(dltotal,dlnow,ultotal,ulnow);
-	}
-	int GotProgress(double dltotal,double dlnow,double ultotal,double ulnow)
-	{
-		return canceling ? 1:0;
-	}
-};
-
-class RequestManager {
-	std::map<CURL *,Request *> request_map;
-	std::list<Request *> queue;
-	CURLM *curlm;
-	CURLSH *curlsh;
-	size_t max_handles;
-	struct ForDone {
-		CURL *handle;
-		CURLcode result;
-	};
-public:
-	RequestManager(size_t a_max_handles)
-		: curlm(0),curlsh(0),max_handles(a_max_handles)
-	{
-	}
-	size_t get_max_handles() const { return max_handles; }
-	CURLM *start()
-	{
-		curlsh = curl_share_init();
-		curl_share_setopt(curlsh,CURLSHOPT_SHARE,CURL_LOCK_DATA_COOKIE);
-		//curl_share_setopt(curlsh,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
-		return curlm = curl_multi_init();
-	}
-	CURLM *get_curlm() const {
-		return curlm;
-	}
-	void get(const char *url) {
-		Request *r = new Request(url);
-		queue.push_back(r);
-	}
-	void step() {
-		if( !curlm ) {
-			printf("CURLM SHOULD BE INITIALIZED, call start() before!!!\n");
-			return;
-		}
-		int handles = 0;
-		CURLMcode code = CURLM_OK;
-		while( (code = curl_multi_perform(curlm, &handles)) == CURLM_CALL_MULTI_PERFORM )
-			;
-		if( code != CURLM_OK ) {
-			printf("SOMETHING BAD HAPPENS: %d!!!\n",code);
-			return;
-		}
-
-		CURLMsg *msg; /* for picking up messages with the transfer status */
-		int msgs_left; /* how many messages are left */
-
-		std::list<ForDone> handles_for_done;
-		while ((msg = curl_multi_info_read(curlm, &msgs_left))) {
-			if (msg->msg == CURLMSG_DONE) {
-				ForDone d = { msg->easy_handle,msg->data.result };
-			}
-			if( msgs_left == 0 )
-				break;
-		}
-		{
-			std::list<ForDone>::iterator e=handles_for_done.end();
-			std::list<ForDone>::iterator i=handles_for_done.begin();
-			for( ; i != e; i++ ) {
-				CURLcode result = i->result;
-				CURL *handle = i->handle;
-				std::map<CURL *,Request *>::iterator e = request_map.end();
-				std::map<CURL *,Request *>::iterator f = request_map.find(handle);
-				if( f == e ) {
-					printf("REQUEST NOT FOUND FOR HANDLE %p\n",handle);
-					continue;
-				}
-				curl_multi_remove_handle(curlm, handle);
-				if( result != CURLE_OK ) {
-					f->second->got_error(result,curl_easy_strerror(result));
-				} else {
-					f->second->got_done();
-				}
-				request_map.erase(f);
-			}
-		}
-
-		if( (size_t)handles >= max_handles ) {
-			return;
-		}
-
-		// select a new request to start
-		std::list<Request *>::iterator e = queue.end();
-		std::list<Request *>::iterator i = queue.begin();
-
-		for( ; i != e; i++ ) {
-			if( (*i)->get_state() == kNone && !(*i)->get_canceling() )
-				break;
-		}
-		// start found request
-		if( i != e && (*i)->get_state() == kNone && !(*i)->get_canceling() ) {
-			// new request found
-			CURL *handle = (*i)->start(curlsh);
-			curl_multi_add_handle(curlm, handle);
-			request_map[handle] = *i;
-			(*i)->got_started();
-		}
-	}
-	const std::list<Request *> &get_queue() const { return queue; }
-	bool clean(Request *r) {
-		switch(r->get_state()) {
-		case kStarting:
-		case kDownloading:
-			r->cancel();
-			return false; // not in this state - cancel request before
-		case kNone:
-		case kOK:
-		case kError:
-			{
-				std::list<Request *>::iterator e = queue.end();
-				std::list<Request *>::iterator i = queue.begin();
-				for( ; i != e; i++) {
-					if( (*i) == r ) {
-						break;
-					}
-				}
-				if( i == e ) {
-					printf("REQUEST LIST BAD FOR REQUEST %p WHILE CLEAN\n",r);
-					break;
-				}
-				delete r;
-				queue.erase(i);
-			}
-			break;
-		}
-		return true;
-	}
-	size_t active_requests() {
-		return request_map.size();
-	}
-	void stop() {
-		{
-			std::list<Request *>::iterator e = queue.end();
-			std::list<Request *>::iterator i = queue.begin();
-			for( ; i != e; i++ ) {
-				(*i)->cancel();
-			}
-		}
-		while( active_requests() ) {
-			step();
-		}
-		curl_multi_cleanup(curlm);
-		curlm = 0;
-		curl_share_cleanup(curlsh);
-		curlsh = 0;
-	}
-};
-
 class TileMatrix
 {
 	int x_min,y_min;
@@ -301,28 +51,100 @@ public:
 			}
 		}
 	}
+	// Pans the view by whole tiles, the walk restarts from the new corner
+	void move(int dx,int dy) {
+		x_min += dx;
+		x_max += dx;
+		y_min += dy;
+		y_max += dy;
+		x = x_min;
+		y = y_min;
+	}
+	TileRect get_rect() const {
+		TileRect r = { z,x_min,y_min,x_max,y_max };
+		return r;
+	}
+	bool visible(int tz,int tx,int ty) const {
+		return get_rect().contains(tz,tx,ty);
+	}
+	// Request score for a tile: the distance of its centre from the centre of
+	// the view in tiles, plus a penalty per zoom level away from the current
+	// one. Tiles which are no longer visible get -1 and are dropped.
+	double score(int tz,int tx,int ty) const {
+		if( !visible(tz,tx,ty) )
+			return -1;
+		double dx = (tx + 0.5) - (x_min + x_max) / 2.0;
+		double dy = (ty + 0.5) - (y_min + y_max) / 2.0;
+		double dz = tz > z ? tz - z : z - tz;
+		return sqrt(dx * dx + dy * dy) + dz * kZoomPenalty;
+	}
+private:
+	static const int kZoomPenalty = 4;
 };
 
 //#define HTTP_TILES "http://tile.openstreetmap.org/%d/%d/%d.png" // tile z,x,y
 //#define HTTP_TILES "http://78.40.184.246/jams/%d/%d/%d.png" // tile z,x,y
 //#define HTTP_TILES "http://jams1.doroga.tv/jams/%d/%d/%d.png" // tile z,x,y
 #define HTTP_TILES "http://jams.doroga.tv/jams/%d/%d/%d.png" // tile z,x,y
+// Network threads the transfers run on, 0 steps them in ExampleUpdate()
+#define NETWORK_THREADS 2
+// Share of the frame manager.step() may take, in microseconds
+#define STEP_BUDGET_US (MS_PER_FRAME * 1000 / 4)
+// libcurl's small allocations come from size-class slabs, 0 for the heap
+#define SLAB_ALLOCATOR 1
 
-RequestManager manager(3);
+RequestManager manager(3,1024 * 1024);
+DiskCache disk("tiles",2 * 1024 * 1024);
 TileMatrix matrix(10189,5076,10192,5080,14);
+TilePrefetcher prefetcher(8,256 * 1024);
+
+bool TileOf(const Request *r,TileKey *k)
+{
+	return sscanf(r->get_url().c_str(),HTTP_TILES,&k->z,&k->x,&k->y) == 3;
+}
+
+// Scores a queued tile request against the current view of the matrix,
+// tiles out of view keep a low priority while the prefetcher predicts them
+double TileScore(const Request *r,void *userdata)
+{
+	const TileMatrix *m = (const TileMatrix *)userdata;
+	TileKey k;
+	if( !TileOf(r,&k) )
+		return 0;
+	if( m->visible(k.z,k.x,k.y) )
+		return m->score(k.z,k.x,k.y);
+	return prefetcher.score(k.z,k.x,k.y);
+}
 
 //-----------------------------------------------------------------------------
 void ExampleInit()
 {
     IwGxInit();
-	curl_global_init(CURL_GLOBAL_ALL);
+	if( SLAB_ALLOCATOR )
+		SlabAllocator::Install(CURL_GLOBAL_ALL);
+	else
+		curl_global_init(CURL_GLOBAL_ALL);
+	disk.open();
+	manager.set_disk_cache(&disk);
+	// a tile slower than 19 in 20 gets a second transfer
+	manager.set_hedging(0.95);
+	// bodies past half a megabyte pause the transfers, finished ones which
+	// were not taken yet go to files next to the disk cache
+	manager.set_memory_limits(512 * 1024);
+	manager.set_spill_dir(".");
+	// what canceled tiles received, to continue them if they come back;
+	// within the limits above
+	manager.set_partial_bytes(128 * 1024);
 }
 
 //-----------------------------------------------------------------------------
 void ExampleShutDown()
 {
 	manager.stop();
+	disk.close();
 	curl_global_cleanup();
+	if( SLAB_ALLOCATOR && !SlabAllocator::instance().release() )
+		printf("SLAB ALLOCATOR STILL IN USE AT SHUTDOWN\n");
 	IwGxTerminate();
 }
 
@@ -334,27 +156,70 @@ bool ExampleUpdate()
 		manager.stop();
 		while( manager.get_queue().begin() != manager.get_queue().end() )
 			manager.clean(*manager.get_queue().begin());
+		prefetcher.clear();
 		ExampleStep = 0;
 	}
 
 	if( !ExampleStep ) {
 		printf("--------------- STARTING ---------------\n");
-		manager.start();
+		manager.start(NETWORK_THREADS);
 	}
 
-	manager.step();
+	manager.step(STEP_BUDGET_US);
 	ExampleStep += 1;
 	if( manager.get_queue().size() < 20 ) {
 		char buf[256];
 		sprintf(buf,HTTP_TILES,matrix.get_z(),matrix.get_x(),matrix.get_y());
-		manager.get(buf);
+		manager.get(buf,matrix.score(matrix.get_z(),matrix.get_x(),matrix.get_y()),kTrafficUrgent);
 		matrix.step();
 	}
+	{
+		// pan the view with the cursor keys, tiles which went out of view are
+		// dropped and the rest are reordered around the new centre
+		int dx = 0, dy = 0;
+		if( s3eKeyboardGetState(s3eKeyLeft) & S3E_KEY_STATE_PRESSED )
+			dx = -1;
+		if( s3eKeyboardGetState(s3eKeyRight) & S3E_KEY_STATE_PRESSED )
+			dx = 1;
+		if( s3eKeyboardGetState(s3eKeyUp) & S3E_KEY_STATE_PRESSED )
+			dy = -1;
+		if( s3eKeyboardGetState(s3eKeyDown) & S3E_KEY_STATE_PRESSED )
+			dy = 1;
+		if( dx || dy ) {
+			matrix.move(dx,dy);
+		}
+	}
+	{
+		// promote prefetches which came into view, drop the ones which are
+		// no longer predicted, then queue the next likely tiles
+		prefetcher.update(matrix.get_rect(),(long)s3eTimerGetMs());
+		manager.rescore(TileScore,&matrix);
+		std::list<Request *>::const_iterator e = manager.get_queue().end();
+		std::list<Request *>::const_iterator i = manager.get_queue().begin();
+		for( ; i != e; i++ ) {
+			TileKey k;
+			if( (*i)->get_state() != kDownloading || !TileOf(*i,&k) )
+				continue;
+			if( prefetcher.is_outstanding(k) && !matrix.visible(k.z,k.x,k.y) && !prefetcher.wanted(k.z,k.x,k.y) )
+				manager.cancel(*i);
+		}
+		std::vector<TileKey> next;
+		prefetcher.next(next);
+		for( size_t n = 0; n < next.size(); n++ ) {
+			char buf[256];
+			sprintf(buf,HTTP_TILES,next[n].z,next[n].x,next[n].y);
+			manager.get(buf,prefetcher.score(next[n].z,next[n].x,next[n].y),kTrafficBackground);
+			prefetcher.started(next[n]);
+		}
+	}
 	if( manager.active_requests() < manager.get_max_handles() ) {
 		std::list<Request *>::const_iterator e = manager.get_queue().end();
 		std::list<Request *>::const_iterator i = manager.get_queue().begin();
 		for( ; i != e; i++ ) {
 			if( (*i)->get_state() == kOK || (*i)->get_state() == kError ) {
+				TileKey k;
+				if( TileOf(*i,&k) )
+					prefetcher.finished(k,(*i)->get_state() == kOK ? (*i)->get_content_length() : 0);
 				manager.clean(*i);
 				break;
 			}
@@ -366,7 +231,7 @@ bool ExampleUpdate()
 		std::list<Request *>::const_iterator i = manager.get_queue().begin();
 		for( ; i != e; i++ ) {
 			if( (*i)->get_state() == kDownloading ) {
-				(*i)->cancel();
+				manager.cancel(*i);
 				break;
 			}
 		}
@@ -390,11 +255,134 @@ void ExampleRender()
 	for( ; i != e; i++ ) {
 		char buf[1024];
 		const char *name = HTTPStatusName[(*i)->get_state()];
-		snprintf(buf, 1023, "%d) %s: %s/%d (%s)",count,(*i)->get_url().c_str(),name,(*i)->get_content_length(),(*i)->get_errmsg().c_str());
+		const RequestTiming &t = (*i)->get_timing();
+		if( (*i)->get_state() == kOK && !(*i)->get_cached() )
+			snprintf(buf, 1023, "%d) %s: %s/%d dns %d connect %d wait %d receive %d ms",count,(*i)->get_url().c_str(),name,
+				(int)(*i)->get_content_length(),(int)(t.dns_us() / 1000),(int)(t.connect_us() / 1000),
+				(int)(t.wait_us() / 1000),(int)(t.receive_us() / 1000));
+		else
+			snprintf(buf, 1023, "%d) %s: %s/%d (%s)",count,(*i)->get_url().c_str(),name,(int)(*i)->get_content_length(),(*i)->get_errmsg().c_str());
 	    IwGxPrintString(sx, sy, buf, true);
 		sy += 20;
 		count++;
 	}
+	{
+		char buf[256];
+		const ResponseCache &cache = manager.get_cache();
+		snprintf(buf, 255, "cache: %d entries %d/%d bytes, hit ratio %d%%, %d bytes saved, %d coalesced",
+			(int)cache.get_entries(),(int)cache.get_bytes(),(int)cache.get_max_bytes(),
+			(int)(cache.hit_ratio() * 100),(int)cache.get_bytes_saved(),(int)manager.get_coalesced());
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		const RedirectMemo &rm = manager.get_redirects();
+		snprintf(buf, 255, "redirects: %d rules, %d requests sent directly, %d round trips saved, %d rules dropped",
+			(int)rm.get_rules(),(int)rm.get_rewrites(),(int)rm.get_hops_saved(),(int)(rm.get_forgotten() + rm.get_expired()));
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		const RetryPolicy &rp = manager.get_retry();
+		snprintf(buf, 255, "retry: %d retries, %d over budget, %d waiting, %d hedges, %d won",
+			(int)rp.get_retries(),(int)rp.get_retries_denied(),(int)manager.get_delayed(),
+			(int)rp.get_hedges(),(int)rp.get_hedges_won());
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		const BandwidthScheduler &bw = manager.get_bandwidth();
+		snprintf(buf, 255, "bandwidth: %d KB/s, %d rebalances, %d pauses",
+			(int)(bw.get_capacity() / 1024),(int)bw.get_rebalances(),(int)bw.get_pauses());
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		const MemoryGovernor &mg = manager.get_memory();
+		snprintf(buf, 255, "memory: %d KB in bodies, %d KB peak, %d holds, %d spills %d KB",
+			(int)(mg.get_buffered() / 1024),(int)(mg.get_peak() / 1024),(int)mg.get_holds(),
+			(int)mg.get_spills(),(int)(mg.get_spilled_bytes() / 1024));
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		const PartialStore &ps = manager.get_partials();
+		snprintf(buf, 255, "resume: %d continued, %d KB saved, %d refused, %d KB kept",
+			(int)ps.get_resumes(),(int)(ps.get_resumed_bytes() / 1024),(int)ps.get_refusals(),
+			(int)(ps.get_bytes() / 1024));
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		snprintf(buf, 255, "cancel: %d, slot freed in %d us mean, %d us max",
+			(int)manager.get_cancels(),(int)manager.get_cancel_us_mean(),(int)manager.get_cancel_us_max());
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		snprintf(buf, 255, "step: %d of %d us, %d carried, %d over budget",
+			(int)manager.get_step_us(),STEP_BUDGET_US,(int)manager.get_carried(),(int)manager.get_over_budget());
+	    IwGxPrintString(sx, sy, buf, true);
+		sy += 20;
+		snprintf(buf, 255, "disk: %d entries %d bytes, %d fresh hits, %d revalidated",
+			(int)disk.get_entries(),(int)disk.get_data_size(),
+			(int)disk.get_fresh_hits(),(int)disk.get_revalidated());
+	    IwGxPrintString(sx, sy, buf, true);
+		const ConcurrencyControl &cc = manager.get_concurrency();
+		sy += 20;
+		snprintf(buf, 255, "limit: %.1f (%s), %d active, %s, %d completions waiting",cc.get_global().value,
+			ConcurrencyControl::reason_name(cc.get_global().reason),(int)cc.get_active(),
+			manager.is_threaded() ? "network threads" : "game thread",(int)manager.get_completion_backlog());
+	    IwGxPrintString(sx, sy, buf, true);
+		static const curl_lock_data shared[] = { CURL_LOCK_DATA_DNS,CURL_LOCK_DATA_COOKIE };
+		for( size_t n = 0; n < sizeof(shared) / sizeof(shared[0]); n++ ) {
+			const CurlShare::Stats &st = manager.get_share().get_stats(shared[n]);
+			sy += 20;
+			snprintf(buf, 255, "share %s: %d locks, %d%% contended, %d us waited, %d us max",
+				CurlShare::data_name(shared[n]),(int)st.locks,(int)(manager.get_share().contention(shared[n]) * 100),
+				(int)st.wait_us,(int)st.max_wait_us);
+		    IwGxPrintString(sx, sy, buf, true);
+		}
+		std::map<std::string,HostTiming>::const_iterator te = manager.get_timings().end();
+		std::map<std::string,HostTiming>::const_iterator ti = manager.get_timings().begin();
+		for( ; ti != te; ti++ ) {
+			const HostTiming &t = ti->second;
+			sy += 20;
+			snprintf(buf, 255, "%s: total p50 %d p95 %d p99 %d ms, wait p50 %d p99 %d ms, connect p99 %d ms, %.2f connects/request, %d errors",
+				ti->first.c_str(),(int)(t.total.percentile(0.50) / 1000),(int)(t.total.percentile(0.95) / 1000),
+				(int)(t.total.percentile(0.99) / 1000),(int)(t.wait.percentile(0.50) / 1000),(int)(t.wait.percentile(0.99) / 1000),
+				(int)(t.connect.percentile(0.99) / 1000),t.connects_per_request(),(int)t.errors);
+		    IwGxPrintString(sx, sy, buf, true);
+			Timeouts limits = manager.get_timeouts().get(ti->first);
+			std::map<std::string,AdaptiveTimeouts::Host>::const_iterator h = manager.get_timeouts().get_hosts().find(ti->first);
+			sy += 20;
+			snprintf(buf, 255, "%s: connect timeout %d ms, stall %d s below %d B/s, %d timeouts",
+				ti->first.c_str(),(int)limits.connect_ms,(int)limits.low_speed_time,(int)limits.low_speed_limit,
+				h == manager.get_timeouts().get_hosts().end() ? 0 : (int)h->second.timeouts);
+		    IwGxPrintString(sx, sy, buf, true);
+		}
+		if( SLAB_ALLOCATOR ) {
+			const SlabAllocator &a = SlabAllocator::instance();
+			const SlabAllocator::LargeStats &l = a.get_large_stats();
+			sy += 20;
+			snprintf(buf, 255, "alloc: %d of %d KB of slabs used, %d large blocks %d KB, %d KB peak",
+				(int)(a.get_used_bytes() / 1024),(int)(a.get_slab_bytes() / 1024),
+				(int)l.in_use,(int)(l.bytes / 1024),(int)(l.peak_bytes / 1024));
+		    IwGxPrintString(sx, sy, buf, true);
+			// in use/peak blocks of every class
+			int len = 0;
+			for( int n = 0; n < SlabAllocator::get_classes() && len < 255; n++ ) {
+				SlabAllocator::ClassStats st = a.get_class_stats(n);
+				len += snprintf(buf + len, 255 - len, "%s%d: %d/%d",n ? ", " : "",
+					(int)a.get_class_size(n),(int)st.in_use,(int)st.peak);
+			}
+			sy += 20;
+		    IwGxPrintString(sx, sy, buf, true);
+		}
+		for( size_t n = 0; manager.is_threaded() && n < manager.get_shards().size(); n++ ) {
+			const NetworkThread *shard = manager.get_shards()[n];
+			sy += 20;
+			snprintf(buf, 255, "shard %d: %d running, %d stolen",
+				(int)n,(int)shard->get_running(),(int)shard->get_stolen());
+		    IwGxPrintString(sx, sy, buf, true);
+		}
+		std::map<std::string,ConcurrencyControl::Host>::const_iterator he = cc.get_hosts().end();
+		std::map<std::string,ConcurrencyControl::Host>::const_iterator hi = cc.get_hosts().begin();
+		for( ; hi != he; hi++ ) {
+			const ConcurrencyControl::Host &h = hi->second;
+			sy += 20;
+			snprintf(buf, 255, "%s: limit %.1f (%s), %d active, rtt %d ms, %d KB/s, %d%% errors",
+				hi->first.c_str(),h.limit.value,ConcurrencyControl::reason_name(h.limit.reason),
+				(int)h.active,(int)(h.srtt * 1000),(int)(h.rate / 1024),(int)(h.error_rate * 100));
+		    IwGxPrintString(sx, sy, buf, true);
+		}
+	}
 	// Swap buffers
 	IwGxFlush();
 	IwGxSwapBuffers();